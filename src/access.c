@@ -0,0 +1,182 @@
+#include "access.h"
+#include "cmd.h"
+#include "client.h"
+#include "http.h"
+#include "server.h"
+#include "worker.h"
+#include "conf.h"
+#include "slog.h"
+#include "acl.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+/* Access log
+ *
+ * With "access_log" set in the configuration, each HTTP response is logged
+ * as a line of JSON once it has been written, with the time taken by each
+ * phase of the request. The lines go through the same per-worker queues as
+ * the other log messages (see slog.c), so that the worker doesn't wait for
+ * the file to be written.
+ */
+
+uint64_t
+access_now_us(void) {
+
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+}
+
+/**
+ * Requests are timed for the access log, the latency metrics, the slow
+ * request log, the Server-Timing headers, and the stall detector.
+ */
+int
+access_timing_enabled(const struct conf *cfg) {
+
+	return cfg->access_log || cfg->metrics.enabled || cfg->slowlog.slower_than_us >= 0
+		|| acl_has_server_timing(cfg->acl) || cfg->stall_detector.interval_ms > 0;
+}
+
+/**
+ * Add a Server-Timing header with the time taken by each phase so far, in
+ * milliseconds, if the ACLs enable it for this client.
+ */
+void
+access_server_timing(struct http_response *r, const struct cmd *cmd) {
+
+	const struct access_timing *t = &cmd->timing;
+	uint64_t now, reply, parsed;
+	char val[160];
+	int n;
+
+	if(!cmd->server_timing || !t->start) {
+		return;
+	}
+	now = access_now_us();
+	reply = t->reply ? t->reply : now;
+	parsed = t->sent ? t->sent : reply;
+
+	n = snprintf(val, sizeof(val), "parse;dur=%.3f", (double)(parsed - t->start) / 1000.0);
+	if(t->sent) { /* sent to Redis, not run by Webdis */
+		n += snprintf(val + n, sizeof(val) - n, ", redis;dur=%.3f", (double)(reply - t->sent) / 1000.0);
+	}
+	snprintf(val + n, sizeof(val) - n, ", format;dur=%.3f, total;dur=%.3f",
+		(double)(now - reply) / 1000.0, (double)(now - t->start) / 1000.0);
+
+	http_response_set_header(r, "Server-Timing", val, HEADER_COPY_VALUE);
+	http_response_set_header(r, "Timing-Allow-Origin", "*", HEADER_COPY_NONE);
+}
+
+static struct access_entry *
+access_entry_new(struct server *s) {
+
+	struct access_entry *e;
+
+	if(!s || !s->cfg->access_log || !(e = calloc(1, sizeof(struct access_entry)))) {
+		return NULL;
+	}
+	e->s = s;
+	return e;
+}
+
+/* only keeps characters that don't need escaping in JSON */
+static void
+access_set_name(struct access_entry *e, const char *p, size_t sz) {
+
+	size_t i;
+
+	for(i = 0; i < sz && i < ACCESS_CMD_MAX_LEN; ++i) {
+		unsigned char c = (unsigned char)p[i];
+		e->cmd[i] = (isalnum(c) || c == '.' || c == '_' || c == '-' || c == ':') ? (char)toupper(c) : '?';
+	}
+	e->cmd[i] = 0;
+}
+
+/**
+ * Log this response once written, as a reply to a command.
+ */
+void
+access_attach_cmd(struct http_response *r, const struct cmd *cmd) {
+
+	struct access_entry *e;
+
+	if(!cmd->w || !(e = access_entry_new(cmd->w->s))) {
+		return;
+	}
+	e->t = cmd->timing;
+	e->addr = cmd->addr;
+	e->db = cmd->database;
+	if(cmd->count) {
+		access_set_name(e, cmd->argv[0], cmd->argv_len[0]);
+	}
+	r->access = e;
+}
+
+/**
+ * Log this response once written, sent without running a command.
+ */
+void
+access_attach_client(struct http_response *r, const struct http_client *c) {
+
+	struct access_entry *e;
+
+	if(!(e = access_entry_new(c->s))) {
+		return;
+	}
+	e->t.start = c->request_start;
+	e->addr = c->addr;
+	e->db = c->s->cfg->database;
+	r->access = e;
+}
+
+/**
+ * Write the access log line for a response, called once it's been sent.
+ */
+void
+access_log_response(struct http_response *r, int success) {
+
+	struct access_entry *e = r->access;
+	uint64_t done = access_now_us(), start, reply;
+	char line[SLOG_ACCESS_LINE_MAX_LEN], addr[INET_ADDRSTRLEN], time_buf[32];
+	struct in_addr in;
+	struct timespec ts;
+	struct tm tm;
+	int line_sz;
+
+	r->access = NULL;
+
+	/* missing timestamps are taken from the next phase */
+	reply = e->t.reply ? e->t.reply : done;
+	start = e->t.start ? e->t.start : (e->t.sent ? e->t.sent : reply);
+
+	in.s_addr = e->addr;
+	if(!inet_ntop(AF_INET, &in, addr, sizeof(addr))) {
+		strcpy(addr, "-");
+	}
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	if(gmtime_r(&ts.tv_sec, &tm)) {
+		size_t n = strftime(time_buf, sizeof(time_buf), "%Y-%m-%dT%H:%M:%S", &tm);
+		snprintf(time_buf + n, sizeof(time_buf) - n, ".%03ldZ", ts.tv_nsec / 1000000);
+	} else {
+		strcpy(time_buf, "-");
+	}
+
+	line_sz = snprintf(line, sizeof(line),
+		"{\"time\":\"%s\",\"client\":\"%s\",\"cmd\":\"%s\",\"db\":%d,\"status\":%d,\"bytes\":%zu,"
+		"\"parse_us\":%llu,\"redis_us\":%llu,\"write_us\":%llu,\"total_us\":%llu,\"complete\":%s}\n",
+		time_buf, addr, e->cmd[0] ? e->cmd : "-", e->db, r->code, (size_t)(r->sent > 0 ? r->sent : 0),
+		(unsigned long long)((e->t.sent ? e->t.sent : reply) - start),
+		(unsigned long long)(e->t.sent ? reply - e->t.sent : 0),
+		(unsigned long long)(done - reply),
+		(unsigned long long)(done - start),
+		success ? "true" : "false");
+	if(line_sz > 0 && (size_t)line_sz < sizeof(line)) {
+		slog_access(e->s, line, (size_t)line_sz);
+	}
+	free(e);
+}
@@ -0,0 +1,50 @@
+#ifndef ACCESS_H
+#define ACCESS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+struct server;
+struct conf;
+struct cmd;
+struct http_client;
+struct http_response;
+
+#define ACCESS_CMD_MAX_LEN 32
+
+/* when each phase of a request ended, in microseconds on a monotonic clock */
+struct access_timing {
+	uint64_t start; /* first byte of the request read */
+	uint64_t sent;  /* command sent to Redis, 0 if it wasn't */
+	uint64_t reply; /* reply received, or response ready */
+};
+
+/* what's logged for a response, kept with it until it's written */
+struct access_entry {
+	struct server *s;
+	struct access_timing t;
+	in_addr_t addr;
+	int db;
+	char cmd[ACCESS_CMD_MAX_LEN + 1];
+};
+
+uint64_t
+access_now_us(void);
+
+int
+access_timing_enabled(const struct conf *cfg);
+
+void
+access_server_timing(struct http_response *r, const struct cmd *cmd);
+
+void
+access_attach_cmd(struct http_response *r, const struct cmd *cmd);
+
+void
+access_attach_client(struct http_response *r, const struct http_client *c);
+
+void
+access_log_response(struct http_response *r, int success);
+
+#endif
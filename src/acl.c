@@ -6,16 +6,76 @@
 
 #include <string.h>
 #include <strings.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <evhttp.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
+/* Compiled ACLs
+ *
+ * Each command named in a rule gets an entry in a table, found with a hash
+ * of its name; one more entry stands for all the commands that no rule names.
+ * An entry lists the rules that allow or deny its command, starting with the
+ * last one since it takes precedence. A command is checked by hashing its
+ * name once and matching the client against these rules only, instead of
+ * comparing the name with every command of every rule.
+ */
+
+/* some commands are always disabled, regardless of the config file. */
+static const char *acl_always_off[] = {"MULTI", "EXEC", "WATCH", "DISCARD", "SELECT"};
+
+/* commands handled by Webdis that report on the server and its clients, disabled unless a rule enables them. */
+static const char *acl_default_off[] = {"WEBDIS.METRICS", "WEBDIS.SLOWLOG", "WEBDIS.SUBSCRIBERS"};
+
+struct acl_decision {
+	const struct acl *rule;
+	int allow;
+};
+
+struct acl_entry {
+	const char *name; /* NULL for commands not named in any rule */
+	size_t len;
+	int always_off;
+	int default_off;
+
+	struct acl_decision *decisions; /* last rule first */
+	unsigned int count;
+};
+
+struct acl_table {
+	unsigned long serial; /* tells tables apart in the per-connection memos */
+	struct acl *rules;
+	unsigned int rule_count;
+	int server_timing; /* whether any rule sets it */
+
+	struct acl_entry *entries;
+	unsigned int entry_count; /* the last one is for commands not named in any rule */
+
+	/* open addressing, each slot holds an entry index + 1 or 0 if free */
+	unsigned int *slots;
+	uint32_t slot_mask;
+};
+
+/* Per-connection memo
+ *
+ * Which rules match a client only depends on its address, which is fixed for
+ * a connection, and on its Authorization header. They are evaluated for the
+ * first command of a connection and kept in a bitmap, which is only rebuilt
+ * if a later request on a keep-alive connection sends a different header.
+ */
+struct acl_memo {
+	unsigned long serial; /* table the bitmap was built for */
+	char *auth; /* Authorization header it was built with, or NULL */
+	unsigned char matches[]; /* one bit per rule, by index */
+};
+
+static unsigned long acl_serial = 0;
+
 int
-acl_match_client(struct acl *a, struct http_client *client, in_addr_t *ip) {
+acl_match_client(const struct acl *a, const char *auth, in_addr_t ip) {
 
 	/* check HTTP Basic Auth */
-	const char *auth;
-	auth = client_get_header(client, "Authorization");
 	if(a->http_basic_auth) {
 		if(auth && strncasecmp(auth, "Basic ", 6) == 0) { /* sent auth */
 			if(strcmp(auth + 6, a->http_basic_auth) != 0) { /* bad password */
@@ -30,70 +90,333 @@ acl_match_client(struct acl *a, struct http_client *client, in_addr_t *ip) {
 	if(a->cidr.enabled == 0) { /* none given, all match */
 		return 1;
 	}
-	if(((*ip) & a->cidr.mask) == (a->cidr.subnet & a->cidr.mask)) {
-		return 1;
+	return (ip & a->cidr.mask) == a->cidr.subnet;
+}
+
+/* case-insensitive 32-bit FNV-1a */
+static uint32_t
+acl_hash(const char *p, size_t sz) {
+
+	uint32_t h = 2166136261u;
+	size_t i;
+
+	for(i = 0; i < sz; ++i) {
+		h ^= (unsigned char)toupper((unsigned char)p[i]);
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static struct acl_entry *
+acl_lookup(const struct acl_table *t, const char *name, size_t len) {
+
+	uint32_t i = acl_hash(name, len) & t->slot_mask;
+
+	for(; t->slots[i]; i = (i + 1) & t->slot_mask) {
+		struct acl_entry *e = &t->entries[t->slots[i] - 1];
+		if(e->len == len && strncasecmp(e->name, name, len) == 0) {
+			return e;
+		}
 	}
+	return NULL;
+}
+
+static struct acl_entry *
+acl_insert(struct acl_table *t, const char *name) {
+
+	size_t len = strlen(name);
+	struct acl_entry *e;
+	uint32_t i;
+
+	if((e = acl_lookup(t, name, len))) {
+		return e;
+	}
+	for(i = acl_hash(name, len) & t->slot_mask; t->slots[i]; i = (i + 1) & t->slot_mask);
+
+	e = &t->entries[t->entry_count++];
+	e->name = name;
+	e->len = len;
+	t->slots[i] = t->entry_count;
+	return e;
+}
+
+static int
+acl_names_star(const struct acl_commands *ac) {
 
+	unsigned int i;
+	for(i = 0; i < ac->count; ++i) {
+		if(strcmp(ac->commands[i], "*") == 0) {
+			return 1;
+		}
+	}
 	return 0;
 }
 
-int
-acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client) {
+/**
+ * Fill in what a rule decides for each entry: 1 to allow, 0 to deny, -1 for no decision.
+ * Disabled commands take precedence over enabled ones within a rule.
+ */
+static void
+acl_rule_verdicts(struct acl_table *t, const struct acl *a, signed char *v) {
+
+	unsigned int i;
+
+	memset(v, acl_names_star(&a->enabled) ? 1 : -1, t->entry_count);
+	for(i = 0; i < a->enabled.count; ++i) {
+		struct acl_entry *e = acl_lookup(t, a->enabled.commands[i], strlen(a->enabled.commands[i]));
+		if(e) v[e - t->entries] = 1;
+	}
+
+	if(acl_names_star(&a->disabled)) {
+		memset(v, 0, t->entry_count);
+	}
+	for(i = 0; i < a->disabled.count; ++i) {
+		struct acl_entry *e = acl_lookup(t, a->disabled.commands[i], strlen(a->disabled.commands[i]));
+		if(e) v[e - t->entries] = 0;
+	}
+}
+
+/**
+ * Build the table used by acl_allow_command from the list of ACLs.
+ */
+struct acl_table *
+acl_compile(struct acl *perms) {
 
-	char *always_off[] = {"MULTI", "EXEC", "WATCH", "DISCARD", "SELECT"};
+	struct acl_table *t = calloc(1, sizeof(struct acl_table));
+	struct acl *a, **rules = NULL;
+	signed char *verdicts = NULL;
+	unsigned int i, j, names, rule_count = 0;
+	uint32_t slot_count = 16;
+
+	if(!t) {
+		return NULL;
+	}
+	t->serial = ++acl_serial;
+	t->rules = perms;
+
+	/* upper bound on the number of entries */
+	names = sizeof(acl_always_off) / sizeof(acl_always_off[0])
+		+ sizeof(acl_default_off) / sizeof(acl_default_off[0]);
+	for(a = perms; a; a = a->next) {
+		names += a->enabled.count + a->disabled.count;
+		rule_count++;
+		if(a->server_timing != ACL_TIMING_UNSET) {
+			t->server_timing = 1;
+		}
+	}
+	t->rule_count = rule_count;
+	while(slot_count < 2 * names) slot_count *= 2;
+
+	t->entries = calloc(names + 1, sizeof(struct acl_entry));
+	t->slots = calloc(slot_count, sizeof(unsigned int));
+	t->slot_mask = slot_count - 1;
+	rules = calloc(rule_count + 1, sizeof(struct acl *));
+	if(!t->entries || !t->slots || !rules) {
+		goto fail;
+	}
+
+	/* give an entry to each command name */
+	for(i = 0; i < sizeof(acl_always_off) / sizeof(acl_always_off[0]); ++i) {
+		acl_insert(t, acl_always_off[i])->always_off = 1;
+	}
+	for(i = 0; i < sizeof(acl_default_off) / sizeof(acl_default_off[0]); ++i) {
+		acl_insert(t, acl_default_off[i])->default_off = 1;
+	}
+	for(a = perms, i = 0; a; a = a->next, ++i) {
+		a->index = i;
+		rules[i] = a;
+		for(j = 0; j < a->enabled.count; ++j) {
+			if(strcmp(a->enabled.commands[j], "*") != 0) acl_insert(t, a->enabled.commands[j]);
+		}
+		for(j = 0; j < a->disabled.count; ++j) {
+			if(strcmp(a->disabled.commands[j], "*") != 0) acl_insert(t, a->disabled.commands[j]);
+		}
+	}
+	t->entry_count++; /* commands not named in any rule */
+
+	/* what each rule decides for each entry */
+	if(!(verdicts = malloc((size_t)rule_count * t->entry_count + 1))) {
+		goto fail;
+	}
+	for(i = 0; i < rule_count; ++i) {
+		acl_rule_verdicts(t, rules[i], verdicts + (size_t)i * t->entry_count);
+	}
+
+	/* list the rules with a decision for each entry, last one first */
+	for(j = 0; j < t->entry_count; ++j) {
+		struct acl_entry *e = &t->entries[j];
+		for(i = 0; i < rule_count; ++i) {
+			if(verdicts[(size_t)i * t->entry_count + j] >= 0) e->count++;
+		}
+		if(e->count == 0) continue;
+		if(!(e->decisions = calloc(e->count, sizeof(struct acl_decision)))) {
+			goto fail;
+		}
+		e->count = 0;
+		for(i = rule_count; i-- > 0; ) {
+			signed char v = verdicts[(size_t)i * t->entry_count + j];
+			if(v >= 0) {
+				e->decisions[e->count].rule = rules[i];
+				e->decisions[e->count].allow = v;
+				e->count++;
+			}
+		}
+	}
+
+	free(verdicts);
+	free(rules);
+	return t;
+
+fail:
+	free(verdicts);
+	free(rules);
+	acl_table_free(t);
+	return NULL;
+}
+
+void
+acl_table_free(struct acl_table *t) {
 
 	unsigned int i;
-	int authorized = 1;
-	struct acl *a;
 
-	in_addr_t client_addr;
+	if(!t) return;
+	if(t->entries) {
+		for(i = 0; i < t->entry_count; ++i) {
+			free(t->entries[i].decisions);
+		}
+	}
+	free(t->entries);
+	free(t->slots);
+	free(t);
+}
 
-	const char *cmd_name;
-	size_t cmd_len;
+static int
+acl_same_auth(const char *a, const char *b) {
 
-	if(cmd->count == 0) {
-		return 0;
+	if(!a || !b) {
+		return a == b;
 	}
+	return strcmp(a, b) == 0;
+}
 
-	cmd_name = cmd->argv[0];
-	cmd_len = cmd->argv_len[0];
+/**
+ * Return the bitmap of rules matching this client, from its memo if it's still valid.
+ * Returns NULL if it can't be allocated.
+ */
+static const unsigned char *
+acl_client_matches(const struct acl_table *t, struct http_client *client, const char *auth) {
 
-	/* some commands are always disabled, regardless of the config file. */
-	for(i = 0; i < sizeof(always_off) / sizeof(always_off[0]); ++i) {
-		if(strncasecmp(always_off[i], cmd_name, cmd_len) == 0) {
-			return 0;
+	struct acl_memo *m = client->acl;
+	const struct acl *a;
+	in_addr_t client_addr;
+
+	if(m && m->serial == t->serial && acl_same_auth(m->auth, auth)) {
+		return m->matches;
+	}
+
+	if(!m || m->serial != t->serial) {
+		acl_memo_free(m);
+		client->acl = m = calloc(1, sizeof(struct acl_memo) + (t->rule_count + 7) / 8);
+		if(!m) {
+			return NULL;
 		}
+		m->serial = t->serial;
 	}
+	free(m->auth);
+	m->auth = auth ? strdup(auth) : NULL; /* recomputed next time if this fails */
 
 	/* find client's address */
 	client_addr = ntohl(client->addr);
 
-	/* go through permissions */
-	for(a = cfg->perms; a; a = a->next) {
+	memset(m->matches, 0, (t->rule_count + 7) / 8);
+	for(a = t->rules; a; a = a->next) {
+		if(acl_match_client(a, auth, client_addr)) {
+			m->matches[a->index / 8] |= (unsigned char)(1 << (a->index % 8));
+		}
+	}
+	return m->matches;
+}
 
-		if(!acl_match_client(a, client, &client_addr)) continue; /* match client */
+int
+acl_has_server_timing(const struct acl_table *t) {
 
-		/* go through authorized commands */
-		for(i = 0; i < a->enabled.count; ++i) {
-			if(strncasecmp(a->enabled.commands[i], cmd_name, cmd_len) == 0) {
-				authorized = 1;
-			}
-			if(strncasecmp(a->enabled.commands[i], "*", 1) == 0) {
-				authorized = 1;
-			}
-		}
+	return t && t->server_timing;
+}
 
-		/* go through unauthorized commands */
-		for(i = 0; i < a->disabled.count; ++i) {
-			if(strncasecmp(a->disabled.commands[i], cmd_name, cmd_len) == 0) {
-				authorized = 0;
-			}
-			if(strncasecmp(a->disabled.commands[i], "*", 1) == 0) {
-				authorized = 0;
-			}
+/**
+ * Whether to send a Server-Timing header to this client: the last matching
+ * rule that sets "server_timing" decides.
+ */
+int
+acl_server_timing(const struct acl_table *t, struct http_client *client) {
+
+	const unsigned char *matches;
+	const struct acl *a;
+	acl_timing timing = ACL_TIMING_OFF;
+
+	if(!acl_has_server_timing(t)
+			|| !(matches = acl_client_matches(t, client, client_get_header(client, "Authorization")))) {
+		return 0;
+	}
+	for(a = t->rules; a; a = a->next) {
+		if(a->server_timing != ACL_TIMING_UNSET && (matches[a->index / 8] & (1 << (a->index % 8)))) {
+			timing = a->server_timing;
 		}
 	}
 
-	return authorized;
+	switch(timing) {
+		case ACL_TIMING_ALWAYS:
+			return 1;
+		case ACL_TIMING_ON_REQUEST:
+			return client_get_header(client, "X-Server-Timing") != NULL;
+		default:
+			return 0;
+	}
+}
+
+void
+acl_memo_free(struct acl_memo *m) {
+
+	if(!m) return;
+	free(m->auth);
+	free(m);
 }
 
+int
+acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client) {
+
+	const struct acl_table *t = cfg->acl;
+	const struct acl_entry *e;
+	const unsigned char *matches;
+	const char *auth;
+	unsigned int i;
+
+	if(cmd->count == 0 || !t) {
+		return 0;
+	}
+
+	if(!(e = acl_lookup(t, cmd->argv[0], cmd->argv_len[0]))) {
+		e = &t->entries[t->entry_count - 1];
+	}
+	if(e->always_off) {
+		return 0;
+	}
+	if(e->count == 0) { /* no rule about this command */
+		return !e->default_off;
+	}
+
+	auth = client_get_header(client, "Authorization");
+	if(!(matches = acl_client_matches(t, client, auth))) {
+		return 0;
+	}
+
+	/* the last rule matching the client decides */
+	for(i = 0; i < e->count; ++i) {
+		unsigned int index = e->decisions[i].rule->index;
+		if(matches[index / 8] & (1 << (index % 8))) {
+			return e->decisions[i].allow;
+		}
+	}
+
+	return !e->default_off;
+}
@@ -6,6 +6,16 @@
 struct http_client;
 struct cmd;
 struct conf;
+struct acl_table;
+struct acl_memo;
+
+/* Server-Timing header for the clients matching a rule */
+typedef enum {
+	ACL_TIMING_UNSET = 0, /* decided by an earlier rule */
+	ACL_TIMING_OFF,
+	ACL_TIMING_ALWAYS,
+	ACL_TIMING_ON_REQUEST /* only if the request has an X-Server-Timing header */
+} acl_timing;
 
 struct acl_commands {
 	unsigned int count;
@@ -17,7 +27,7 @@ struct acl {
 	/* CIDR subnet + mask */
 	struct {
 		int enabled;
-		in_addr_t subnet;
+		in_addr_t subnet; /* already masked */
 		in_addr_t mask;
 	} cidr;
 
@@ -27,13 +37,31 @@ struct acl {
 	struct acl_commands enabled;
 	struct acl_commands disabled;
 
+	acl_timing server_timing;
+
+	unsigned int index; /* position in the list, set by acl_compile */
 	struct acl *next;
 };
 
 int
-acl_match_client(struct acl *a, struct http_client *client, in_addr_t *ip);
+acl_match_client(const struct acl *a, const char *auth, in_addr_t ip);
 
 int
 acl_allow_command(struct cmd *cmd, struct conf *cfg, struct http_client *client);
 
+int
+acl_server_timing(const struct acl_table *t, struct http_client *client);
+
+int
+acl_has_server_timing(const struct acl_table *t);
+
+struct acl_table *
+acl_compile(struct acl *perms);
+
+void
+acl_table_free(struct acl_table *t);
+
+void
+acl_memo_free(struct acl_memo *m);
+
 #endif
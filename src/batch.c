@@ -0,0 +1,158 @@
+#include "batch.h"
+#include "cmd.h"
+#include "worker.h"
+#include "formats/common.h"
+
+#include <string.h>
+#include <event.h>
+
+/* Coalescing of pub/sub messages.
+ *
+ * A subscriber can ask for its messages to be grouped: each message is added
+ * to a JSON array, which is sent as a single chunk or frame once it holds
+ * `size` messages or when its first message has waited for `delay_us`,
+ * whichever comes first.
+ */
+
+struct batch {
+	struct cmd *cmd;
+	struct timeval delay;
+	unsigned int size;
+
+	/* pending messages, as a JSON array without its closing bracket */
+	char *buf;
+	size_t buf_sz;
+	size_t buf_alloc;
+	unsigned int count;
+	const char *content_type;
+
+	struct event ev;
+	int timer_set;
+};
+
+/**
+ * Enable batching for a subscription, or disable it if either value is too small.
+ * Returns -1 if the values are out of range.
+ */
+int
+batch_configure(struct cmd *cmd, long delay_us, long size) {
+
+	struct batch *b;
+
+	if(delay_us > BATCH_MAX_DELAY_US || size > BATCH_MAX_SIZE) {
+		return -1;
+	}
+
+	/* send what's pending with the previous settings */
+	if(cmd->batch) {
+		batch_flush(cmd);
+	}
+	if(delay_us <= 0 || size <= 1) {
+		batch_free(cmd->batch);
+		cmd->batch = NULL;
+		return 0;
+	}
+
+	if(!cmd->batch && !(cmd->batch = calloc(1, sizeof(struct batch)))) {
+		return -1;
+	}
+	b = cmd->batch;
+	b->cmd = cmd;
+	b->delay.tv_sec = delay_us / 1000000;
+	b->delay.tv_usec = delay_us % 1000000;
+	b->size = (unsigned int)size;
+	return 0;
+}
+
+static void
+batch_on_timer(int fd, short event, void *p) {
+
+	struct batch *b = p;
+	(void)fd;
+	(void)event;
+
+	b->timer_set = 0;
+	batch_flush(b->cmd);
+}
+
+static int
+batch_append(struct batch *b, const char *p, size_t sz) {
+
+	if(b->buf_sz + sz + 2 > b->buf_alloc) { /* room for the closing bracket */
+		size_t alloc = b->buf_alloc ? b->buf_alloc : 1024;
+		char *buf;
+		while(alloc < b->buf_sz + sz + 2) alloc *= 2;
+		if(!(buf = realloc(b->buf, alloc))) {
+			return -1;
+		}
+		b->buf = buf;
+		b->buf_alloc = alloc;
+	}
+	memcpy(b->buf + b->buf_sz, p, sz);
+	b->buf_sz += sz;
+	return 0;
+}
+
+/**
+ * Add an encoded message to the pending batch.
+ * Returns 1 if the message was taken, 0 if the caller should send it.
+ */
+int
+batch_add(struct cmd *cmd, const char *p, size_t sz, const char *content_type) {
+
+	struct batch *b = cmd->batch;
+
+	/* only JSON messages can be grouped, into an array; not with envelope IDs */
+	if(!b || cmd->jsonp || cmd->ws_id || strcmp(content_type, "application/json") != 0) {
+		return 0;
+	}
+
+	if(batch_append(b, b->count ? "," : "[", 1) < 0 || batch_append(b, p, sz) < 0) {
+		return 0;
+	}
+	b->content_type = content_type;
+	b->count++;
+
+	if(b->count >= b->size) {
+		batch_flush(cmd);
+	} else if(!b->timer_set) {
+		evtimer_assign(&b->ev, cmd->w->base, batch_on_timer, b);
+		evtimer_add(&b->ev, &b->delay);
+		b->timer_set = 1;
+	}
+	return 1;
+}
+
+/**
+ * Send the pending messages, if there are any.
+ */
+void
+batch_flush(struct cmd *cmd) {
+
+	struct batch *b = cmd->batch;
+
+	if(!b) return;
+	if(b->timer_set) {
+		evtimer_del(&b->ev);
+		b->timer_set = 0;
+	}
+	if(!b->count) {
+		return;
+	}
+
+	b->buf[b->buf_sz++] = ']';
+	b->count = 0;
+	format_send_reply(cmd, b->buf, b->buf_sz, b->content_type);
+	b->buf_sz = 0;
+}
+
+void
+batch_free(struct batch *b) {
+
+	if(!b) return;
+	if(b->timer_set) {
+		evtimer_del(&b->ev);
+	}
+	free(b->buf);
+	free(b);
+}
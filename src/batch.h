@@ -0,0 +1,25 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdlib.h>
+
+struct cmd;
+struct batch;
+
+/* upper bounds for the batching parameters */
+#define BATCH_MAX_DELAY_US 10000000
+#define BATCH_MAX_SIZE 10000
+
+int
+batch_configure(struct cmd *cmd, long delay_us, long size);
+
+int
+batch_add(struct cmd *cmd, const char *p, size_t sz, const char *content_type);
+
+void
+batch_flush(struct cmd *cmd);
+
+void
+batch_free(struct batch *b);
+
+#endif
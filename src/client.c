@@ -6,6 +6,10 @@
 #include "websocket.h"
 #include "cmd.h"
 #include "conf.h"
+#include "acl.h"
+#include "access.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <string.h>
@@ -132,6 +136,10 @@ http_client_on_query_string(struct http_parser *parser, const char *at, size_t s
 				memcpy(c->separator, val, val_len);
 			} else if(key_len == 8 && strncmp(key, "filename", 8) == 0) {
 				c->filename = wrap_filename(val, val_len);
+			} else if(key_len == 14 && strncmp(key, "batch_delay_us", 14) == 0) {
+				c->batch_delay_us = strtol(val, NULL, 10);
+			} else if(key_len == 10 && strncmp(key, "batch_size", 10) == 0) {
+				c->batch_size = strtol(val, NULL, 10);
 			}
 
 			if(!amp) {
@@ -201,7 +209,15 @@ http_client_on_message_complete(struct http_parser *p) {
 		c->path_sz = strlen(c->path);
 	}
 
+	/* metrics endpoint, for scrapers that can't be given a command */
+	if(c->w->s->cfg->metrics.path && c->path_sz == strlen(c->w->s->cfg->metrics.path)
+			&& memcmp(c->path, c->w->s->cfg->metrics.path, c->path_sz) == 0) {
+		free(c->path);
+		c->path = strdup("/WEBDIS.METRICS.txt");
+		c->path_sz = strlen(c->path);
+	}
 
+	TRACE_REQUEST(c->fd, c->path, c->path_sz, c->request_sz);
 	worker_process_client(c);
 	http_client_reset(c);
 
@@ -258,7 +274,10 @@ http_client_reset(struct http_client *c) {
 	free(c->type); c->type = NULL;
 	free(c->jsonp); c->jsonp = NULL;
 	free(c->filename); c->filename = NULL;
+	c->batch_delay_us = 0;
+	c->batch_size = 0;
 	c->request_sz = 0;
+	c->request_start = 0;
 
 	/* no last known header callback */
 	c->last_cb = LAST_CB_NONE;
@@ -274,6 +293,8 @@ http_client_free(struct http_client *c) {
 
 	http_client_reset(c);
 	free(c->buffer);
+	acl_memo_free(c->acl);
+	metrics_add(METRICS_CONNECTIONS_CLOSED, 1);
 	free(c);
 }
 
@@ -313,6 +334,11 @@ http_client_read(struct http_client *c) {
 		return (int)CLIENT_DISCONNECTED;
 	}
 
+	metrics_add(METRICS_BYTES_IN, (uint64_t)ret);
+	if(c->request_start == 0 && access_timing_enabled(c->s->cfg)) {
+		c->request_start = access_now_us();
+	}
+
 	/* save what we've just read */
 	c->buffer = realloc(c->buffer, c->sz + ret);
 	if(!c->buffer) {
@@ -2,6 +2,7 @@
 #define CLIENT_H
 
 #include <event.h>
+#include <stdint.h>
 #include <arpa/inet.h>
 #include "http_parser.h"
 #include "websocket.h"
@@ -35,6 +36,7 @@ struct http_client {
 	char *buffer;
 	size_t sz;
 	size_t request_sz; /* accumulated so far. */
+	uint64_t request_start; /* first byte read, see access.h */
 	last_cb_t last_cb;
 
 	/* various flags. */
@@ -60,11 +62,14 @@ struct http_client {
 	char *jsonp; /* jsonp wrapper */
 	char *separator; /* list separator for raw lists */
 	char *filename; /* content-disposition */
+	long batch_delay_us; /* pub/sub batching, see batch.h */
+	long batch_size;
 
 	struct cmd *reused_cmd;
 	struct cmd *last_cmd; /* last command executed, might be in flight */
 
 	struct ws_client *ws; /* websocket client */
+	struct acl_memo *acl; /* ACL rules matching this client, see acl.c */
 };
 
 struct http_client *
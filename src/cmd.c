@@ -6,12 +6,15 @@
 #include "worker.h"
 #include "http.h"
 #include "server.h"
+#include "batch.h"
+#include "internal.h"
+#include "metrics.h"
+#include "stall.h"
+#include "trace.h"
 
 #include "formats/json.h"
 #include "formats/raw.h"
-#ifdef MSGPACK
 #include "formats/msgpack.h"
-#endif
 #include "formats/custom-type.h"
 
 #include <stdlib.h>
@@ -62,6 +65,11 @@ cmd_free(struct cmd *c) {
 	free(c->separator);
 	free(c->if_none_match);
 	if(c->mime_free) free(c->mime);
+	compress_stream_free(c->zstream);
+	http_stream_free(c->stream);
+	batch_free(c->batch);
+	if(c->ws_id_free) free(c->ws_id);
+	if(c->ws_pending) LIST_REMOVE(c, ws_entries);
 
 	/* detach last_cmd from http_client since the cmd is being freed */
 	if(c->http_client && c->http_client->last_cmd == c) {
@@ -123,6 +131,9 @@ cmd_setup(struct cmd *cmd, struct http_client *client) {
 		} else if(strcasecmp(client->headers[i].key, "Connection") == 0 &&
 				strcasecmp(client->headers[i].val, "Keep-Alive") == 0) {
 			cmd->keep_alive = 1;
+		} else if(strcasecmp(client->headers[i].key, "Accept-Encoding") == 0 &&
+				client->s->cfg->compression.enabled) {
+			cmd->accept_encoding = compress_negotiate(client->headers[i].val);
 		}
 	}
 
@@ -147,8 +158,18 @@ cmd_setup(struct cmd *cmd, struct http_client *client) {
 		client->filename = NULL;
 	}
 
+	if(client->batch_size > 1 && client->batch_delay_us > 0) {
+		batch_configure(cmd, client->batch_delay_us, client->batch_size);
+	}
+
 	cmd->fd = client->fd;
 	cmd->http_version = client->http_version;
+
+	cmd->addr = client->addr;
+	cmd->server_timing = !cmd->is_websocket && acl_server_timing(client->s->cfg->acl, client);
+	if(access_timing_enabled(client->s->cfg)) { /* WebSocket commands start when they're parsed */
+		cmd->timing.start = (client->request_start && !cmd->is_websocket) ? client->request_start : access_now_us();
+	}
 }
 
 
@@ -236,6 +257,41 @@ cmd_run(struct worker *w, struct http_client *client,
 		return CMD_ACL_FAIL;
 	}
 
+	if(slash) {
+		p = cmd_name + cmd_len + 1;
+		while(p < uri + uri_len) {
+
+			const char *arg = p;
+			int arg_len;
+			char *next = memchr(arg, '/', uri_len - (arg-uri));
+			if(!next || next > uri + uri_len) { /* last argument */
+				p = uri + uri_len;
+				arg_len = p - arg;
+			} else { /* found a slash */
+				arg_len = next - arg;
+				p = next + 1;
+			}
+
+			/* record argument */
+			cmd->argv[cur_param] = decode_uri(arg, arg_len, &cmd->argv_len[cur_param], 1);
+			cur_param++;
+		}
+
+		if(body && body_len) { /* PUT request */
+			cmd->argv[cur_param] = malloc(body_len);
+			memcpy(cmd->argv[cur_param], body, body_len);
+			cmd->argv_len[cur_param] = body_len;
+		}
+	} else { /* no args (e.g. INFO command) */
+		cmd->count = 1;
+	}
+
+	/* handled by Webdis, without a connection to Redis */
+	if(internal_is_command(cmd)) {
+		internal_run(cmd, f_format);
+		return CMD_SENT;
+	}
+
 	if(cmd_is_subscribe(cmd)) {
 		/* create a new connection to Redis */
 		cmd->ac = (redisAsyncContext*)pool_connect(w->pool, cmd->database, 0);
@@ -251,41 +307,6 @@ cmd_run(struct worker *w, struct http_client *client,
 		cmd->ac = (redisAsyncContext*)pool_get_context(w->pool);
 	}
 
-	/* no args (e.g. INFO command) */
-	if(!slash) {
-		if(!cmd->ac) {
-			cmd_free(cmd);
-			return CMD_REDIS_UNAVAIL;
-		}
-		redisAsyncCommandArgv(cmd->ac, f_format, cmd, 1,
-				(const char **)cmd->argv, cmd->argv_len);
-		return CMD_SENT;
-	}
-	p = cmd_name + cmd_len + 1;
-	while(p < uri + uri_len) {
-
-		const char *arg = p;
-		int arg_len;
-		char *next = memchr(arg, '/', uri_len - (arg-uri));
-		if(!next || next > uri + uri_len) { /* last argument */
-			p = uri + uri_len;
-			arg_len = p - arg;
-		} else { /* found a slash */
-			arg_len = next - arg;
-			p = next + 1;
-		}
-
-		/* record argument */
-		cmd->argv[cur_param] = decode_uri(arg, arg_len, &cmd->argv_len[cur_param], 1);
-		cur_param++;
-	}
-
-	if(body && body_len) { /* PUT request */
-		cmd->argv[cur_param] = malloc(body_len);
-		memcpy(cmd->argv[cur_param], body, body_len);
-		cmd->argv_len[cur_param] = body_len;
-	}
-
 	/* send it off! */
 	if(cmd->ac) {
 		cmd_send(cmd, f_format);
@@ -297,9 +318,48 @@ cmd_run(struct worker *w, struct http_client *client,
 	return CMD_REDIS_UNAVAIL;
 }
 
+/**
+ * Record when the reply to a timed command arrived, before it's formatted.
+ * Commands on a connection of their own (pub/sub, WebSocket) aren't in the
+ * latency metrics: their replies can't be told apart.
+ */
+void
+cmd_timing_reply(struct cmd *cmd) {
+
+	if(!cmd->timing.start) {
+		return;
+	}
+	cmd->timing.reply = access_now_us();
+	if(!cmd->pub_sub_client && cmd->count) {
+		metrics_command(cmd->argv[0], cmd->argv_len[0], cmd->timing.reply - cmd->timing.start);
+	}
+}
+
+static void
+cmd_on_reply(redisAsyncContext *ac, void *r, void *privdata) {
+
+	struct cmd *cmd = privdata;
+	struct stall *st = cmd->w ? cmd->w->stall : NULL;
+	struct stall_mark mark;
+
+	cmd_timing_reply(cmd);
+	stall_mark(st, &mark, cmd); /* cmd may be freed by the formatting function */
+	cmd->f_format(ac, r, privdata);
+	stall_check(st, &mark);
+}
+
 void
 cmd_send(struct cmd *cmd, formatting_fun f_format) {
-	redisAsyncCommandArgv(cmd->ac, f_format, cmd, cmd->count,
+
+	TRACE_DISPATCH(cmd);
+	if(!cmd->timing.start) {
+		redisAsyncCommandArgv(cmd->ac, f_format, cmd, cmd->count,
+			(const char **)cmd->argv, cmd->argv_len);
+		return;
+	}
+	cmd->f_format = f_format;
+	cmd->timing.sent = access_now_us();
+	redisAsyncCommandArgv(cmd->ac, cmd_on_reply, cmd, cmd->count,
 		(const char **)cmd->argv, cmd->argv_len);
 }
 
@@ -325,10 +385,7 @@ cmd_select_format(struct http_client *client, struct cmd *cmd,
 	struct reply_format funs[] = {
 		{.s = "json", .sz = 4, .f = json_reply, .ct = "application/json"},
 		{.s = "raw", .sz = 3, .f = raw_reply, .ct = "binary/octet-stream"},
-
-#ifdef MSGPACK
 		{.s = "msg", .sz = 3, .f = msgpack_reply, .ct = "application/x-msgpack"},
-#endif
 
 		{.s = "bin", .sz = 3, .f = custom_type_reply, .ct = "binary/octet-stream"},
 		{.s = "txt", .sz = 3, .f = custom_type_reply, .ct = "text/plain"},
@@ -6,12 +6,16 @@
 #include <sys/queue.h>
 #include <event.h>
 #include <evhttp.h>
+#include "compress.h"
+#include "access.h"
 
 struct evhttp_request;
 struct http_client;
 struct server;
 struct worker;
 struct cmd;
+struct http_stream;
+struct batch;
 
 typedef void (*formatting_fun)(redisAsyncContext *, void *, void *);
 typedef char* (*ws_error_fun)(int http_status, const char *msg, size_t msg_sz, size_t *out_sz);
@@ -39,12 +43,31 @@ struct cmd {
 	char *separator; /* list separator for raw lists */
 	int keep_alive;
 
+	/* response compression */
+	compress_encoding accept_encoding; /* negotiated from Accept-Encoding */
+	struct compress_stream *zstream; /* for chunked responses */
+
+	struct http_stream *stream; /* output queue for chunked responses */
+	struct batch *batch; /* pending pub/sub messages, if grouped */
+
+	/* WebSocket envelope, see ws_execute */
+	char *ws_id; /* request ID in JSON form, added to the reply */
+	int ws_id_free; /* need to free ws_id */
+	int ws_pending; /* in the client's list of commands sent over the pool */
+	LIST_ENTRY(cmd) ws_entries;
+
 	/* various flags */
 	int started_responding;
 	int is_websocket;
 	int http_version;
 	int database;
 
+	/* access log */
+	struct access_timing timing;
+	in_addr_t addr;
+	int server_timing; /* add a Server-Timing header to the response */
+	formatting_fun f_format; /* called by cmd_on_reply */
+
 	struct http_client *http_client;
 	struct http_client *pub_sub_client;
 	redisAsyncContext *ac;
@@ -89,4 +112,7 @@ cmd_send(struct cmd *cmd, formatting_fun f_format);
 void
 cmd_setup(struct cmd *cmd, struct http_client *client);
 
+void
+cmd_timing_reply(struct cmd *cmd);
+
 #endif
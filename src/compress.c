@@ -0,0 +1,378 @@
+#include "compress.h"
+#include "conf.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <zlib.h>
+
+/* zlib window size, plus 16 to get a gzip header and trailer */
+#define COMPRESS_WINDOW_BITS 15
+#define COMPRESS_GZIP_OFFSET 16
+
+struct compress_stream {
+	z_stream zs;
+};
+
+struct decompress_stream {
+	z_stream zs;
+};
+
+/**
+ * Pick a content-coding from the Accept-Encoding request header.
+ * "*" stands for the codings not listed elsewhere in the header (RFC 9110,
+ * section 12.5.3). gzip wins over deflate when both are equally acceptable.
+ */
+compress_encoding
+compress_negotiate(const char *accept_encoding) {
+
+	const char *p = accept_encoding;
+	double q_gzip = -1.0, q_deflate = -1.0, q_star = -1.0; /* -1 if not listed */
+
+	if(!p) {
+		return COMPRESS_NONE;
+	}
+
+	while(*p) {
+		const char *token;
+		size_t token_sz;
+		double q = 1.0;
+
+		/* skip separators */
+		while(*p == ' ' || *p == '\t' || *p == ',') p++;
+		if(!*p) break;
+
+		/* coding name */
+		token = p;
+		while(*p && *p != ',' && *p != ';' && *p != ' ' && *p != '\t') p++;
+		token_sz = p - token;
+
+		/* parameters, only "q" is meaningful */
+		while(*p && *p != ',') {
+			const char *name;
+			size_t name_sz;
+
+			while(*p == ' ' || *p == '\t' || *p == ';') p++;
+			name = p;
+			while(*p && *p != '=' && *p != ';' && *p != ',' && *p != ' ' && *p != '\t') p++;
+			name_sz = p - name;
+			while(*p == ' ' || *p == '\t') p++;
+			if(*p == '=') {
+				p++;
+				while(*p == ' ' || *p == '\t') p++;
+				if(name_sz == 1 && (*name == 'q' || *name == 'Q')) {
+					q = strtod(p, NULL);
+				}
+				while(*p && *p != ';' && *p != ',') p++;
+			} else if(*p && *p != ';' && *p != ',') {
+				p++; /* stray character */
+			}
+		}
+
+		if(token_sz == 4 && strncasecmp(token, "gzip", 4) == 0) {
+			q_gzip = q;
+		} else if(token_sz == 7 && strncasecmp(token, "deflate", 7) == 0) {
+			q_deflate = q;
+		} else if(token_sz == 1 && *token == '*') {
+			q_star = q;
+		}
+	}
+
+	if(q_gzip < 0.0) q_gzip = q_star;
+	if(q_deflate < 0.0) q_deflate = q_star;
+
+	if(q_gzip > 0.0 && q_gzip >= q_deflate) {
+		return COMPRESS_GZIP;
+	} else if(q_deflate > 0.0) {
+		return COMPRESS_DEFLATE;
+	}
+	return COMPRESS_NONE;
+}
+
+const char *
+compress_encoding_name(compress_encoding enc) {
+
+	switch(enc) {
+		case COMPRESS_GZIP:
+			return "gzip";
+		case COMPRESS_DEFLATE:
+			return "deflate";
+		default:
+			return NULL;
+	}
+}
+
+/**
+ * Returns whether responses with this Content-Type may be compressed.
+ */
+int
+compress_type_enabled(struct conf *cfg, const char *content_type) {
+
+	unsigned int i;
+	size_t ct_sz;
+	const char *semicolon;
+
+	if(!cfg->compression.enabled || !content_type) {
+		return 0;
+	}
+
+	/* ignore parameters such as "; charset=utf-8" */
+	semicolon = strchr(content_type, ';');
+	ct_sz = semicolon ? (size_t)(semicolon - content_type) : strlen(content_type);
+
+	for(i = 0; i < cfg->compression.type_count; ++i) {
+		const char *t = cfg->compression.types[i];
+		if(strlen(t) == ct_sz && strncasecmp(t, content_type, ct_sz) == 0) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int
+compress_init(z_stream *zs, compress_encoding enc, int level) {
+
+	int bits = COMPRESS_WINDOW_BITS;
+	if(enc == COMPRESS_GZIP) {
+		bits += COMPRESS_GZIP_OFFSET;
+	}
+
+	memset(zs, 0, sizeof(*zs));
+	return deflateInit2(zs, level, Z_DEFLATED, bits, 8, Z_DEFAULT_STRATEGY);
+}
+
+/**
+ * Compress a full buffer in one call, returns NULL on failure.
+ */
+char *
+compress_buffer(compress_encoding enc, int level,
+		const char *p, size_t sz, size_t *out_sz) {
+
+	z_stream zs;
+	char *out;
+	uLong bound;
+
+	if(enc == COMPRESS_NONE || compress_init(&zs, enc, level) != Z_OK) {
+		return NULL;
+	}
+
+	/* leave some slack for the gzip wrapper, older zlibs underestimate it */
+	bound = deflateBound(&zs, sz) + 18;
+	out = malloc(bound);
+	if(!out) {
+		deflateEnd(&zs);
+		return NULL;
+	}
+
+	zs.next_in = (Bytef*)p;
+	zs.avail_in = sz;
+	zs.next_out = (Bytef*)out;
+	zs.avail_out = bound;
+
+	if(deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&zs);
+		free(out);
+		return NULL;
+	}
+
+	*out_sz = zs.total_out;
+	deflateEnd(&zs);
+	return out;
+}
+
+struct compress_stream *
+compress_stream_new(compress_encoding enc, int level) {
+
+	struct compress_stream *cs;
+
+	if(enc == COMPRESS_NONE) {
+		return NULL;
+	}
+
+	cs = calloc(1, sizeof(struct compress_stream));
+	if(!cs) {
+		return NULL;
+	}
+	if(compress_init(&cs->zs, enc, level) != Z_OK) {
+		free(cs);
+		return NULL;
+	}
+	return cs;
+}
+
+/**
+ * Compress one chunk of a stream. The output is flushed so that the
+ * client can decode it right away, while keeping the dictionary for
+ * the next chunks.
+ */
+char *
+compress_stream_chunk(struct compress_stream *cs,
+		const char *p, size_t sz, size_t *out_sz) {
+
+	char *out, *tmp;
+	size_t bound, used = 0;
+	int ret;
+
+	/* sync flush adds a few bytes of marker on top of the deflate bound */
+	bound = deflateBound(&cs->zs, sz) + 18;
+	out = malloc(bound);
+	if(!out) {
+		return NULL;
+	}
+
+	cs->zs.next_in = (Bytef*)p;
+	cs->zs.avail_in = sz;
+
+	while(1) {
+		cs->zs.next_out = (Bytef*)out + used;
+		cs->zs.avail_out = bound - used;
+
+		ret = deflate(&cs->zs, Z_SYNC_FLUSH);
+		used = bound - cs->zs.avail_out;
+		if(ret != Z_OK && ret != Z_BUF_ERROR) {
+			free(out);
+			return NULL;
+		}
+		if(cs->zs.avail_out != 0) { /* all flushed */
+			break;
+		}
+
+		/* output didn't fit, grow buffer and keep going */
+		tmp = realloc(out, bound * 2);
+		if(!tmp) {
+			free(out);
+			return NULL;
+		}
+		out = tmp;
+		bound *= 2;
+	}
+
+	*out_sz = used;
+	return out;
+}
+
+void
+compress_stream_free(struct compress_stream *cs) {
+
+	if(!cs) return;
+	deflateEnd(&cs->zs);
+	free(cs);
+}
+
+/**
+ * Raw deflate stream, with a window of 2^window_bits bytes.
+ * Memory use is scaled down along with the window, since there can be one
+ * stream per WebSocket client.
+ */
+struct compress_stream *
+compress_stream_new_raw(int level, int window_bits) {
+
+	struct compress_stream *cs = calloc(1, sizeof(struct compress_stream));
+	int mem_level = window_bits - 7; /* 8 (the zlib default) for a 32 KB window */
+
+	if(!cs) {
+		return NULL;
+	}
+	if(deflateInit2(&cs->zs, level, Z_DEFLATED, -window_bits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(cs);
+		return NULL;
+	}
+	return cs;
+}
+
+void
+compress_stream_reset(struct compress_stream *cs) {
+
+	deflateReset(&cs->zs);
+}
+
+struct decompress_stream *
+decompress_stream_new_raw(int window_bits) {
+
+	struct decompress_stream *ds = calloc(1, sizeof(struct decompress_stream));
+
+	if(!ds) {
+		return NULL;
+	}
+	if(inflateInit2(&ds->zs, -window_bits) != Z_OK) {
+		free(ds);
+		return NULL;
+	}
+	return ds;
+}
+
+/**
+ * Decompress one chunk of a stream, keeping the dictionary for the next ones.
+ * Returns NULL on failure, with *out_sz set above max_sz if the output
+ * would have been too large or to 0 if the data is invalid.
+ */
+char *
+decompress_stream_chunk(struct decompress_stream *ds,
+		const char *p, size_t sz, size_t max_sz, size_t *out_sz) {
+
+	char *out, *tmp;
+	size_t bound = sz * 4 < 256 ? 256 : sz * 4, used = 0;
+	int ret;
+
+	*out_sz = 0;
+	out = malloc(bound);
+	if(!out) {
+		return NULL;
+	}
+
+	ds->zs.next_in = (Bytef*)p;
+	ds->zs.avail_in = sz;
+
+	while(1) {
+		ds->zs.next_out = (Bytef*)out + used;
+		ds->zs.avail_out = bound - used;
+
+		ret = inflate(&ds->zs, Z_SYNC_FLUSH);
+		used = bound - ds->zs.avail_out;
+		if(ret == Z_STREAM_END) { /* final block, start over for what's left */
+			inflateReset(&ds->zs);
+		} else if(ret != Z_OK && ret != Z_BUF_ERROR) {
+			free(out);
+			return NULL;
+		}
+		if(used > max_sz) {
+			free(out);
+			*out_sz = used;
+			return NULL;
+		}
+		if(ds->zs.avail_in == 0 && ds->zs.avail_out != 0) { /* all consumed */
+			break;
+		}
+		if(ds->zs.avail_out != 0 && ret == Z_BUF_ERROR) { /* no progress possible */
+			free(out);
+			return NULL;
+		}
+
+		if(ds->zs.avail_out == 0) { /* output didn't fit, grow buffer and keep going */
+			tmp = realloc(out, bound * 2);
+			if(!tmp) {
+				free(out);
+				return NULL;
+			}
+			out = tmp;
+			bound *= 2;
+		}
+	}
+
+	*out_sz = used;
+	return out;
+}
+
+void
+decompress_stream_reset(struct decompress_stream *ds) {
+
+	inflateReset(&ds->zs);
+}
+
+void
+decompress_stream_free(struct decompress_stream *ds) {
+
+	if(!ds) return;
+	inflateEnd(&ds->zs);
+	free(ds);
+}
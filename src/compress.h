@@ -0,0 +1,62 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <stdlib.h>
+
+struct conf;
+
+typedef enum {
+	COMPRESS_NONE = 0,
+	COMPRESS_DEFLATE,
+	COMPRESS_GZIP
+} compress_encoding;
+
+/* streaming compressor, used for chunked (pub/sub) responses */
+struct compress_stream;
+
+compress_encoding
+compress_negotiate(const char *accept_encoding);
+
+const char *
+compress_encoding_name(compress_encoding enc);
+
+int
+compress_type_enabled(struct conf *cfg, const char *content_type);
+
+char *
+compress_buffer(compress_encoding enc, int level,
+		const char *p, size_t sz, size_t *out_sz);
+
+struct compress_stream *
+compress_stream_new(compress_encoding enc, int level);
+
+char *
+compress_stream_chunk(struct compress_stream *cs,
+		const char *p, size_t sz, size_t *out_sz);
+
+void
+compress_stream_free(struct compress_stream *cs);
+
+/* raw deflate streams, without header or trailer (WebSocket permessage-deflate) */
+struct decompress_stream;
+
+struct compress_stream *
+compress_stream_new_raw(int level, int window_bits);
+
+void
+compress_stream_reset(struct compress_stream *cs);
+
+struct decompress_stream *
+decompress_stream_new_raw(int window_bits);
+
+char *
+decompress_stream_chunk(struct decompress_stream *ds,
+		const char *p, size_t sz, size_t max_sz, size_t *out_sz);
+
+void
+decompress_stream_reset(struct decompress_stream *ds);
+
+void
+decompress_stream_free(struct decompress_stream *ds);
+
+#endif
@@ -34,6 +34,33 @@ conf_auth_username_password(json_t *jarray);
 static void
 conf_parse_hiredis(struct conf *conf, json_t *jhiredis);
 
+static void
+conf_parse_compression(struct conf *conf, json_t *jcompression);
+
+static void
+conf_parse_format_offload(struct conf *conf, json_t *joffload);
+
+static void
+conf_parse_ws_backpressure(struct conf *conf, json_t *jbackpressure);
+
+static void
+conf_parse_ws_deflate(struct conf *conf, json_t *jdeflate);
+
+static void
+conf_parse_sub_queue(struct conf *conf, json_t *jqueue);
+
+static void
+conf_parse_log_async(struct conf *conf, json_t *jlog);
+
+static void
+conf_parse_metrics(struct conf *conf, json_t *jmetrics);
+
+static void
+conf_parse_slowlog(struct conf *conf, json_t *jslowlog);
+
+static void
+conf_parse_stall_detector(struct conf *conf, json_t *jstall);
+
 int
 conf_str_allcaps(const char *s, const size_t sz) {
 	size_t i;
@@ -77,8 +104,12 @@ is_true_free(char *s) {
 	return val;
 }
 
-struct conf *
-conf_read(const char *filename) {
+/**
+ * Read the configuration file. With `strict`, a file that can't be loaded
+ * is an error (NULL) instead of falling back to the defaults.
+ */
+static struct conf *
+conf_load(const char *filename, int strict) {
 
 	json_t *j;
 	json_error_t error;
@@ -89,23 +120,50 @@ conf_read(const char *filename) {
 	conf = calloc(1, sizeof(struct conf));
 	conf->redis_host = strdup("127.0.0.1");
 	conf->redis_port = 6379;
+	conf->redis_protocol = 2;
 	conf->http_host = strdup("0.0.0.0");
 	conf->http_port = 7379;
 	conf->http_max_request_size = 128*1024*1024;
 	conf->http_threads = 4;
 	conf->user = getuid();
 	conf->group = getgid();
-	conf->logfile = "webdis.log";
+	conf->logfile = strdup("webdis.log");
 	conf->log_fsync.mode = LOG_FSYNC_AUTO;
+	conf->log_async.enabled = 1;
+	conf->log_async.lines = 1024;
+	conf->log_async.overflow = LOG_OVERFLOW_DROP;
+	conf->metrics.enabled = 1;
+	conf->slowlog.slower_than_us = 10000;
+	conf->slowlog.max_len = 128;
+	conf->stall_detector.interval_ms = 100;
+	conf->stall_detector.threshold_ms = 100;
 	conf->verbosity = WEBDIS_NOTICE;
 	conf->daemonize = 0;
-	conf->pidfile = "webdis.pid";
+	conf->pidfile = strdup("webdis.pid");
 	conf->database = 0;
 	conf->pool_size_per_thread = 2;
+	conf->compression.level = 6;
+	conf->compression.min_size = 1024;
+	conf->format_offload.threads = 2;
+	conf->format_offload.min_size = 1024*1024;
+	conf->ws_backpressure.high_watermark = 4*1024*1024;
+	conf->ws_backpressure.low_watermark = 1024*1024;
+	conf->ws_backpressure.policy = WS_OVERFLOW_PAUSE;
+	conf->sub_queue.max_bytes = 4*1024*1024;
+	conf->sub_queue.policy = SUB_OVERFLOW_DROP_OLDEST;
+	conf->ws_deflate.level = 6;
+	conf->ws_deflate.min_size = 128;
+	conf->ws_deflate.server_max_window_bits = 15;
+	conf->ws_deflate.client_max_window_bits = 15;
 
 	j = json_load_file(filename, 0, &error);
 	if(!j) {
 		fprintf(stderr, "Error: %s (line %d)\n", error.text, error.line);
+		if(strict) {
+			conf_free(conf);
+			return NULL;
+		}
+		conf->acl = acl_compile(conf->perms);
 		return conf;
 	}
 
@@ -127,6 +185,13 @@ conf_read(const char *filename) {
 			} else if(json_typeof(jtmp) != JSON_NULL) {
 				fprintf(stderr, ACL_ERROR_PREFIX "expected a string or an array of two strings" ACL_ERROR_SUFFIX);
 			}
+		} else if(strcmp(json_object_iter_key(kv), "redis_protocol") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			int proto = (int)json_integer_value(jtmp);
+			if(proto != 2 && proto != 3) {
+				fprintf(stderr, "Invalid Redis protocol version: %d, expected 2 or 3. Defaulting to 2.\n", proto);
+				proto = 2;
+			}
+			conf->redis_protocol = proto;
 		} else if(strcmp(json_object_iter_key(kv), "http_host") == 0 && json_typeof(jtmp) == JSON_STRING) {
 			free(conf->http_host);
 			conf->http_host = conf_string_or_envvar(json_string_value(jtmp));
@@ -171,7 +236,10 @@ conf_read(const char *filename) {
 			}
 			free(groupname);
 		} else if(strcmp(json_object_iter_key(kv),"logfile") == 0 && json_typeof(jtmp) == JSON_STRING){
+			free(conf->logfile);
 			conf->logfile = conf_string_or_envvar(json_string_value(jtmp));
+		} else if(strcmp(json_object_iter_key(kv),"access_log") == 0 && json_typeof(jtmp) == JSON_STRING){
+			conf->access_log = conf_string_or_envvar(json_string_value(jtmp));
 		} else if(strcmp(json_object_iter_key(kv),"log_fsync") == 0) {
 			if(json_typeof(jtmp) == JSON_STRING && strcmp(json_string_value(jtmp), "auto") == 0) {
 				conf->log_fsync.mode = LOG_FSYNC_AUTO;
@@ -195,6 +263,7 @@ conf_read(const char *filename) {
 		} else if(strcmp(json_object_iter_key(kv), "daemonize") == 0 && json_typeof(jtmp) == JSON_STRING) {
 			conf->daemonize = is_true_free(conf_string_or_envvar(json_string_value(jtmp)));
 		} else if(strcmp(json_object_iter_key(kv),"pidfile") == 0 && json_typeof(jtmp) == JSON_STRING){
+			free(conf->pidfile);
 			conf->pidfile = conf_string_or_envvar(json_string_value(jtmp));
 		} else if(strcmp(json_object_iter_key(kv), "websockets") == 0 && (json_typeof(jtmp) == JSON_TRUE || json_typeof(jtmp) == JSON_FALSE)) {
 			conf->websockets = (json_typeof(jtmp) == JSON_TRUE) ? 1 : 0;
@@ -216,6 +285,24 @@ conf_read(const char *filename) {
 #endif
 		} else if(strcmp(json_object_iter_key(kv), "hiredis") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
 			conf_parse_hiredis(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "compression") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_compression(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "format_offload") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_format_offload(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "websocket_backpressure") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_ws_backpressure(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "websocket_compression") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_ws_deflate(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "subscriber_queue") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_sub_queue(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "log_async") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_log_async(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "metrics") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_metrics(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "slowlog") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_slowlog(conf, jtmp);
+		} else if(strcmp(json_object_iter_key(kv), "stall_detector") == 0 && json_typeof(jtmp) == JSON_OBJECT) {
+			conf_parse_stall_detector(conf, jtmp);
 		} else {
 			fprintf(stderr, "Warning! Unexpected key or incorrect value in %s: '%s'\n", filename, json_object_iter_key(kv));
 		}
@@ -223,9 +310,28 @@ conf_read(const char *filename) {
 
 	json_decref(j);
 
+	/* ACLs are checked for every command, from a table built once */
+	conf->acl = acl_compile(conf->perms);
+
 	return conf;
 }
 
+struct conf *
+conf_read(const char *filename) {
+
+	return conf_load(filename, 0);
+}
+
+/**
+ * Read the configuration file again, on SIGHUP. Returns NULL if it can't be
+ * loaded, in which case the current configuration is kept.
+ */
+struct conf *
+conf_reload(const char *filename) {
+
+	return conf_load(filename, 1);
+}
+
 #if HAVE_SSL
 void
 conf_parse_ssl(struct conf *conf, json_t *jssl, const char *filename) {
@@ -281,7 +387,7 @@ acl_read_commands(json_t *jlist, struct acl_commands *ac) {
 struct acl *
 conf_parse_acl(json_t *j) {
 
-	json_t *jcidr, *jbasic, *jlist;
+	json_t *jcidr, *jbasic, *jlist, *jtiming;
 	unsigned short mask_bits = 0;
 
 	struct acl *a = calloc(1, sizeof(struct acl));
@@ -343,6 +449,19 @@ conf_parse_acl(json_t *j) {
 		acl_read_commands(jlist, &a->disabled);
 	}
 
+	/* parse Server-Timing setting */
+	if((jtiming = json_object_get(j, "server_timing"))) {
+		if(json_typeof(jtiming) == JSON_TRUE) {
+			a->server_timing = ACL_TIMING_ALWAYS;
+		} else if(json_typeof(jtiming) == JSON_FALSE) {
+			a->server_timing = ACL_TIMING_OFF;
+		} else if(json_typeof(jtiming) == JSON_STRING && strcmp(json_string_value(jtiming), "on_request") == 0) {
+			a->server_timing = ACL_TIMING_ON_REQUEST;
+		} else {
+			fprintf(stderr, "Config error under 'acl': 'server_timing' must be true, false, or \"on_request\".\n");
+		}
+	}
+
 	return a;
 }
 
@@ -367,9 +486,34 @@ conf_parse_acls(json_t *jtab) {
 	return head;
 }
 
+static void
+conf_free_commands(struct acl_commands *ac) {
+
+	unsigned int i;
+	for(i = 0; i < ac->count; ++i) {
+		free(ac->commands[i]);
+	}
+	free(ac->commands);
+}
+
+static void
+conf_free_acls(struct acl *a) {
+
+	struct acl *next;
+	for(; a; a = next) {
+		next = a->next;
+		free(a->http_basic_auth);
+		conf_free_commands(&a->enabled);
+		conf_free_commands(&a->disabled);
+		free(a);
+	}
+}
+
 void
 conf_free(struct conf *conf) {
 
+	unsigned int i;
+
 	free(conf->redis_host);
 	if(conf->redis_auth) {
 		free(conf->redis_auth->username);
@@ -378,6 +522,18 @@ conf_free(struct conf *conf) {
 	free(conf->redis_auth);
 
 	free(conf->http_host);
+	acl_table_free(conf->acl);
+	conf_free_acls(conf->perms);
+
+	free(conf->logfile);
+	free(conf->pidfile);
+	free(conf->access_log);
+	free(conf->default_root);
+	free(conf->metrics.path);
+	for(i = 0; i < conf->compression.type_count; ++i) {
+		free(conf->compression.types[i]);
+	}
+	free(conf->compression.types);
 
 	free(conf);
 }
@@ -438,3 +594,293 @@ conf_parse_hiredis(struct conf *conf, json_t *jhiredis) {
 		}
 	}
 }
+
+/* copy the strings of a JSON array, returns NULL if it has anything else */
+static char **
+conf_read_strings(json_t *jlist, unsigned int *count) {
+
+	size_t i, n = json_array_size(jlist);
+	char **out;
+
+	for(i = 0; i < n; ++i) {
+		if(json_typeof(json_array_get(jlist, i)) != JSON_STRING) {
+			return NULL;
+		}
+	}
+	if(!(out = calloc(n ? n : 1, sizeof(char*)))) {
+		return NULL;
+	}
+	for(i = 0; i < n; ++i) {
+		out[i] = conf_string_or_envvar(json_string_value(json_array_get(jlist, i)));
+	}
+	*count = (unsigned int)n;
+	return out;
+}
+
+static void
+conf_parse_compression(struct conf *conf, json_t *jcompression) {
+	const char *default_types[] = {"application/json", "application/javascript",
+		"text/plain", "text/html", "text/xml", "text/css", "application/xhtml+xml"};
+	unsigned int i;
+
+	for(void *kv = json_object_iter(jcompression); kv; kv = json_object_iter_next(jcompression, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "enabled") == 0 && (json_typeof(jtmp) == JSON_TRUE || json_typeof(jtmp) == JSON_FALSE)) {
+			conf->compression.enabled = (json_typeof(jtmp) == JSON_TRUE) ? 1 : 0;
+		} else if(strcmp(key, "enabled") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			conf->compression.enabled = is_true_free(conf_string_or_envvar(json_string_value(jtmp)));
+		} else if(strcmp(key, "level") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			int level = (int)json_integer_value(jtmp);
+			if(level < 1 || level > 9) {
+				fprintf(stderr, "Invalid compression level: %d. Acceptable range: [1 .. 9]\n", level);
+				level = (level < 1 ? 1 : 9);
+			}
+			conf->compression.level = level;
+		} else if(strcmp(key, "min_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->compression.min_size = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(key, "types") == 0 && json_typeof(jtmp) == JSON_ARRAY) {
+			unsigned int count = 0;
+			char **types = conf_read_strings(jtmp, &count);
+			if(!types) {
+				fprintf(stderr, "Config error under 'compression': 'types' should be an array of Content-Type strings.\n");
+				continue;
+			}
+			for(i = 0; i < conf->compression.type_count; ++i) {
+				free(conf->compression.types[i]);
+			}
+			free(conf->compression.types);
+			conf->compression.types = types;
+			conf->compression.type_count = count;
+		} else {
+			fprintf(stderr, "Config error under 'compression': unknown key '%s'.\n", key);
+		}
+	}
+
+	/* compress textual formats by default */
+	if(!conf->compression.types) {
+		conf->compression.type_count = sizeof(default_types) / sizeof(default_types[0]);
+		conf->compression.types = calloc(conf->compression.type_count, sizeof(char*));
+		for(i = 0; i < conf->compression.type_count; ++i) {
+			conf->compression.types[i] = strdup(default_types[i]);
+		}
+	}
+}
+
+static void
+conf_parse_format_offload(struct conf *conf, json_t *joffload) {
+
+	for(void *kv = json_object_iter(joffload); kv; kv = json_object_iter_next(joffload, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "threads") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			int threads = (int)json_integer_value(jtmp);
+			conf->format_offload.threads = threads < 0 ? 0 : threads;
+		} else if(strcmp(key, "threads") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			int threads = atoi_free(conf_string_or_envvar(json_string_value(jtmp)));
+			conf->format_offload.threads = threads < 0 ? 0 : threads;
+		} else if(strcmp(key, "min_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->format_offload.min_size = (size_t)json_integer_value(jtmp);
+		} else {
+			fprintf(stderr, "Config error under 'format_offload': unknown key '%s'.\n", key);
+		}
+	}
+}
+
+static void
+conf_parse_ws_backpressure(struct conf *conf, json_t *jbackpressure) {
+
+	for(void *kv = json_object_iter(jbackpressure); kv; kv = json_object_iter_next(jbackpressure, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "high_watermark") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t sz = json_integer_value(jtmp);
+			conf->ws_backpressure.high_watermark = sz < 0 ? 0 : (size_t)sz;
+		} else if(strcmp(key, "low_watermark") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t sz = json_integer_value(jtmp);
+			conf->ws_backpressure.low_watermark = sz < 0 ? 0 : (size_t)sz;
+		} else if(strcmp(key, "policy") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			const char *policy = json_string_value(jtmp);
+			if(strcmp(policy, "pause") == 0) {
+				conf->ws_backpressure.policy = WS_OVERFLOW_PAUSE;
+			} else if(strcmp(policy, "drop") == 0) {
+				conf->ws_backpressure.policy = WS_OVERFLOW_DROP;
+			} else if(strcmp(policy, "disconnect") == 0) {
+				conf->ws_backpressure.policy = WS_OVERFLOW_DISCONNECT;
+			} else {
+				fprintf(stderr, "Invalid WebSocket backpressure policy: '%s'. Acceptable values: pause, drop, disconnect\n", policy);
+			}
+		} else {
+			fprintf(stderr, "Config error under 'websocket_backpressure': unknown key '%s'.\n", key);
+		}
+	}
+
+	if(conf->ws_backpressure.low_watermark > conf->ws_backpressure.high_watermark) {
+		fprintf(stderr, "WebSocket low watermark (%zu) is above the high watermark (%zu), using %zu.\n",
+			conf->ws_backpressure.low_watermark, conf->ws_backpressure.high_watermark,
+			conf->ws_backpressure.high_watermark / 2);
+		conf->ws_backpressure.low_watermark = conf->ws_backpressure.high_watermark / 2;
+	}
+}
+
+static void
+conf_parse_sub_queue(struct conf *conf, json_t *jqueue) {
+
+	for(void *kv = json_object_iter(jqueue); kv; kv = json_object_iter_next(jqueue, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "max_bytes") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t sz = json_integer_value(jtmp);
+			conf->sub_queue.max_bytes = sz < 0 ? 0 : (size_t)sz;
+		} else if(strcmp(key, "max_messages") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t count = json_integer_value(jtmp);
+			conf->sub_queue.max_messages = count < 0 ? 0 : (unsigned int)count;
+		} else if(strcmp(key, "policy") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			const char *policy = json_string_value(jtmp);
+			if(strcmp(policy, "drop_oldest") == 0) {
+				conf->sub_queue.policy = SUB_OVERFLOW_DROP_OLDEST;
+			} else if(strcmp(policy, "drop_newest") == 0) {
+				conf->sub_queue.policy = SUB_OVERFLOW_DROP_NEWEST;
+			} else if(strcmp(policy, "disconnect") == 0) {
+				conf->sub_queue.policy = SUB_OVERFLOW_DISCONNECT;
+			} else {
+				fprintf(stderr, "Invalid subscriber queue policy: '%s'. Acceptable values: drop_oldest, drop_newest, disconnect\n", policy);
+			}
+		} else {
+			fprintf(stderr, "Config error under 'subscriber_queue': unknown key '%s'.\n", key);
+		}
+	}
+}
+
+static void
+conf_parse_log_async(struct conf *conf, json_t *jlog) {
+
+	for(void *kv = json_object_iter(jlog); kv; kv = json_object_iter_next(jlog, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "enabled") == 0 && (json_typeof(jtmp) == JSON_TRUE || json_typeof(jtmp) == JSON_FALSE)) {
+			conf->log_async.enabled = (json_typeof(jtmp) == JSON_TRUE);
+		} else if(strcmp(key, "lines") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t lines = json_integer_value(jtmp);
+			unsigned int rounded = 16;
+			if(lines < 16 || lines > 1024*1024) {
+				fprintf(stderr, "Invalid value for 'lines' under 'log_async': %d. Acceptable range: [16 .. 1048576]\n", (int)lines);
+				lines = lines < 16 ? 16 : 1024*1024;
+			}
+			while(rounded < lines) rounded *= 2;
+			conf->log_async.lines = rounded;
+		} else if(strcmp(key, "overflow") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			const char *policy = json_string_value(jtmp);
+			if(strcmp(policy, "drop") == 0) {
+				conf->log_async.overflow = LOG_OVERFLOW_DROP;
+			} else if(strcmp(policy, "wait") == 0) {
+				conf->log_async.overflow = LOG_OVERFLOW_WAIT;
+			} else {
+				fprintf(stderr, "Invalid log overflow policy: '%s'. Acceptable values: drop, wait\n", policy);
+			}
+		} else {
+			fprintf(stderr, "Config error under 'log_async': unknown key '%s'.\n", key);
+		}
+	}
+}
+
+static void
+conf_parse_metrics(struct conf *conf, json_t *jmetrics) {
+
+	for(void *kv = json_object_iter(jmetrics); kv; kv = json_object_iter_next(jmetrics, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "enabled") == 0 && (json_typeof(jtmp) == JSON_TRUE || json_typeof(jtmp) == JSON_FALSE)) {
+			conf->metrics.enabled = (json_typeof(jtmp) == JSON_TRUE);
+		} else if(strcmp(key, "path") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			const char *path = json_string_value(jtmp);
+			if(path[0] == '/') {
+				conf->metrics.path = strdup(path);
+			} else {
+				fprintf(stderr, "Invalid metrics path: '%s'. It must start with '/'\n", path);
+			}
+		} else {
+			fprintf(stderr, "Config error under 'metrics': unknown key '%s'.\n", key);
+		}
+	}
+}
+
+static void
+conf_parse_slowlog(struct conf *conf, json_t *jslowlog) {
+
+	for(void *kv = json_object_iter(jslowlog); kv; kv = json_object_iter_next(jslowlog, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "slower_than_us") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->slowlog.slower_than_us = (long long)json_integer_value(jtmp);
+		} else if(strcmp(key, "max_len") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t max_len = json_integer_value(jtmp);
+			conf->slowlog.max_len = max_len < 0 ? 0 : (unsigned int)max_len;
+		} else {
+			fprintf(stderr, "Config error under 'slowlog': unknown key '%s'.\n", key);
+		}
+	}
+}
+
+static void
+conf_parse_stall_detector(struct conf *conf, json_t *jstall) {
+
+	for(void *kv = json_object_iter(jstall); kv; kv = json_object_iter_next(jstall, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		if(strcmp(key, "interval_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t ms = json_integer_value(jtmp);
+			conf->stall_detector.interval_ms = ms < 0 ? 0 : (ms > 60000 ? 60000 : (int)ms);
+		} else if(strcmp(key, "threshold_ms") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			json_int_t ms = json_integer_value(jtmp);
+			conf->stall_detector.threshold_ms = ms < 0 ? 0 : (ms > 3600000 ? 3600000 : (int)ms);
+		} else {
+			fprintf(stderr, "Config error under 'stall_detector': unknown key '%s'.\n", key);
+		}
+	}
+}
+
+static int
+conf_window_bits(const char *key, json_int_t bits) {
+
+	/* zlib doesn't support 256-byte windows for raw deflate, so 8 isn't allowed */
+	if(bits < 9 || bits > 15) {
+		fprintf(stderr, "Invalid value for '%s': %d. Acceptable range: [9 .. 15]\n", key, (int)bits);
+		return bits < 9 ? 9 : 15;
+	}
+	return (int)bits;
+}
+
+static void
+conf_parse_ws_deflate(struct conf *conf, json_t *jdeflate) {
+
+	for(void *kv = json_object_iter(jdeflate); kv; kv = json_object_iter_next(jdeflate, kv)) {
+		json_t *jtmp = json_object_iter_value(kv);
+		const char *key = json_object_iter_key(kv);
+		int is_bool = (json_typeof(jtmp) == JSON_TRUE || json_typeof(jtmp) == JSON_FALSE);
+		if(strcmp(key, "enabled") == 0 && is_bool) {
+			conf->ws_deflate.enabled = (json_typeof(jtmp) == JSON_TRUE) ? 1 : 0;
+		} else if(strcmp(key, "enabled") == 0 && json_typeof(jtmp) == JSON_STRING) {
+			conf->ws_deflate.enabled = is_true_free(conf_string_or_envvar(json_string_value(jtmp)));
+		} else if(strcmp(key, "level") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			int level = (int)json_integer_value(jtmp);
+			if(level < 1 || level > 9) {
+				fprintf(stderr, "Invalid compression level: %d. Acceptable range: [1 .. 9]\n", level);
+				level = (level < 1 ? 1 : 9);
+			}
+			conf->ws_deflate.level = level;
+		} else if(strcmp(key, "min_size") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->ws_deflate.min_size = (size_t)json_integer_value(jtmp);
+		} else if(strcmp(key, "server_max_window_bits") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->ws_deflate.server_max_window_bits = conf_window_bits(key, json_integer_value(jtmp));
+		} else if(strcmp(key, "client_max_window_bits") == 0 && json_typeof(jtmp) == JSON_INTEGER) {
+			conf->ws_deflate.client_max_window_bits = conf_window_bits(key, json_integer_value(jtmp));
+		} else if(strcmp(key, "server_no_context_takeover") == 0 && is_bool) {
+			conf->ws_deflate.server_no_context_takeover = (json_typeof(jtmp) == JSON_TRUE) ? 1 : 0;
+		} else if(strcmp(key, "client_no_context_takeover") == 0 && is_bool) {
+			conf->ws_deflate.client_no_context_takeover = (json_typeof(jtmp) == JSON_TRUE) ? 1 : 0;
+		} else {
+			fprintf(stderr, "Config error under 'websocket_compression': unknown key '%s'.\n", key);
+		}
+	}
+}
@@ -11,12 +11,27 @@ struct auth {
 	char *password;
 };
 
+/* what to do with a WebSocket client whose output buffer is full */
+typedef enum {
+	WS_OVERFLOW_PAUSE = 0, /* stop reading its Redis connection until the buffer drains */
+	WS_OVERFLOW_DROP,      /* discard new messages until the buffer drains */
+	WS_OVERFLOW_DISCONNECT /* close the connection */
+} ws_overflow_policy;
+
+/* what to do with an HTTP subscriber whose output queue is full */
+typedef enum {
+	SUB_OVERFLOW_DROP_OLDEST = 0, /* discard the oldest queued messages */
+	SUB_OVERFLOW_DROP_NEWEST,     /* discard new messages until the queue drains */
+	SUB_OVERFLOW_DISCONNECT       /* close the connection */
+} sub_overflow_policy;
+
 struct conf {
 
 	/* connection to Redis */
 	char *redis_host;
 	int redis_port;
 	struct auth *redis_auth;
+	int redis_protocol; /* 2 (default) or 3 to negotiate RESP3 with HELLO */
 
 	/* HTTP server interface */
 	char *http_host;
@@ -34,11 +49,37 @@ struct conf {
 	/* WebSocket support, off by default */
 	int websockets;
 
+	/* WebSocket output buffering */
+	struct {
+		size_t high_watermark; /* buffered bytes above which the policy applies, 0 for no limit */
+		size_t low_watermark;  /* buffered bytes below which a paused client resumes */
+		ws_overflow_policy policy;
+	} ws_backpressure;
+
+	/* HTTP pub/sub output queues */
+	struct {
+		size_t max_bytes;          /* queued bytes above which the policy applies, 0 for no limit */
+		unsigned int max_messages; /* queued messages above which the policy applies, 0 for no limit */
+		sub_overflow_policy policy;
+	} sub_queue;
+
+	/* WebSocket permessage-deflate (RFC 7692), off by default */
+	struct {
+		int enabled;
+		int level;                      /* zlib compression level, 1 to 9 */
+		size_t min_size;                /* smaller messages are sent uncompressed */
+		int server_max_window_bits;     /* 9 to 15, for the messages we send */
+		int client_max_window_bits;     /* 9 to 15, requested from clients that support it */
+		int server_no_context_takeover; /* reset our compressor after each message */
+		int client_no_context_takeover; /* ask clients to do the same */
+	} ws_deflate;
+
 	/* database number */
 	int database;
 
 	/* ACL */
 	struct acl *perms;
+	struct acl_table *acl; /* compiled from perms */
 
 	/* user/group */
 	uid_t user;
@@ -47,10 +88,34 @@ struct conf {
 	/* Logging */
 	char *logfile;
 	log_level verbosity;
+	char *access_log; /* JSON lines, one per HTTP response, or NULL */
 	struct {
 		log_fsync_mode mode;
 		int period_millis; /* only used with LOG_FSYNC_MILLIS */
 	} log_fsync;
+	struct {
+		int enabled;                  /* worker threads queue lines for a writer thread */
+		unsigned int lines;           /* lines queued per worker, a power of 2 */
+		log_overflow_policy overflow; /* when a worker's queue is full */
+	} log_async;
+
+	/* slow requests, see slowlog.c */
+	struct {
+		long long slower_than_us; /* negative to disable */
+		unsigned int max_len;     /* entries kept per worker thread */
+	} slowlog;
+
+	/* event loop watchdog, see stall.c */
+	struct {
+		int interval_ms;  /* timer period, 0 to disable */
+		int threshold_ms; /* lag logged as a stall, 0 to never log */
+	} stall_detector;
+
+	/* counters and latencies, see metrics.c */
+	struct {
+		int enabled;
+		char *path; /* served as WEBDIS.METRICS.txt, or NULL */
+	} metrics;
 
 	/* HiRedis options */
 	struct {
@@ -71,11 +136,29 @@ struct conf {
 
 	/* Request to serve on “/” */
 	char *default_root;
+
+	/* HTTP response compression, off by default */
+	struct {
+		int enabled;
+		int level;        /* zlib compression level, 1 to 9 */
+		size_t min_size;  /* smaller responses are sent as-is */
+		char **types;     /* Content-Type values that can be compressed */
+		unsigned int type_count;
+	} compression;
+
+	/* formatting of large replies, away from the worker threads */
+	struct {
+		int threads;      /* 0 to format everything on the worker threads */
+		size_t min_size;  /* estimated reply size above which formatting is offloaded */
+	} format_offload;
 };
 
 struct conf *
 conf_read(const char *filename);
 
+struct conf *
+conf_reload(const char *filename);
+
 void
 conf_free(struct conf *conf);
 
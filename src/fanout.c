@@ -0,0 +1,278 @@
+#include "fanout.h"
+#include "worker.h"
+#include "client.h"
+#include "websocket.h"
+#include "cmd.h"
+#include "http.h"
+#include "batch.h"
+#include "formats/common.h"
+
+#include <string.h>
+#include <stdint.h>
+
+/* Encode-once cache for pub/sub messages.
+ *
+ * Each subscriber has its own Redis connection, so a message published to a
+ * channel with many subscribers reaches a worker once per subscriber, all at
+ * about the same time. The worker encodes it for the first of them and keeps
+ * the result in a small table indexed by a hash of the message, the output
+ * format and everything else the encoding depends on. The other subscribers
+ * reuse the same bytes, and WebSocket clients share the same frame by
+ * reference in their output buffers.
+ *
+ * The table is only ever used from its worker's thread.
+ */
+
+#define FANOUT_SLOTS 64
+
+struct fanout_entry {
+	uint64_t hash;
+	offload_encoder enc;
+	char *key;
+	size_t key_sz;
+
+	struct fanout_buf *body;     /* encoded message */
+	struct fanout_buf *ws_frame; /* body in a WebSocket frame, built on first use */
+};
+
+struct fanout {
+	struct fanout_entry slots[FANOUT_SLOTS];
+
+	/* key of the message being looked up, reused across messages */
+	char *key;
+	size_t key_sz;
+	size_t key_alloc;
+};
+
+struct fanout *
+fanout_new(void) {
+
+	return calloc(1, sizeof(struct fanout));
+}
+
+struct fanout_buf *
+fanout_buf_new(char *data, size_t sz) {
+
+	struct fanout_buf *fb = malloc(sizeof(struct fanout_buf));
+	if(!fb) {
+		return NULL;
+	}
+	fb->refs = 1;
+	fb->data = data;
+	fb->sz = sz;
+	return fb;
+}
+
+void
+fanout_buf_release(struct fanout_buf *fb) {
+
+	if(fb && --fb->refs == 0) {
+		free(fb->data);
+		free(fb);
+	}
+}
+
+static void
+fanout_buf_cleanup(const void *data, size_t len, void *extra) {
+
+	(void)data;
+	(void)len;
+	fanout_buf_release(extra);
+}
+
+/**
+ * Append a shared buffer to an evbuffer by reference.
+ */
+int
+fanout_buf_add(struct evbuffer *b, struct fanout_buf *fb) {
+
+	fb->refs++;
+	if(evbuffer_add_reference(b, fb->data, fb->sz, fanout_buf_cleanup, fb) < 0) {
+		fb->refs--;
+		return -1;
+	}
+	return 0;
+}
+
+/* only (p)message pushes are shared, not (un)subscribe confirmations */
+static int
+fanout_is_message(const redisReply *r) {
+
+	unsigned int i;
+
+	if(r->type != REDIS_REPLY_ARRAY && r->type != REDIS_REPLY_PUSH) {
+		return 0;
+	}
+	for(i = 0; i < r->elements; ++i) {
+		if(r->element[i]->type != REDIS_REPLY_STRING) {
+			return 0;
+		}
+	}
+	return (r->elements == 3 && r->element[0]->len == 7 && memcmp(r->element[0]->str, "message", 7) == 0)
+		|| (r->elements == 4 && r->element[0]->len == 8 && memcmp(r->element[0]->str, "pmessage", 8) == 0);
+}
+
+static int
+fanout_key_append(struct fanout *f, const char *p, size_t sz) {
+
+	size_t needed = f->key_sz + sizeof(size_t) + sz;
+
+	if(needed > f->key_alloc) {
+		size_t alloc = f->key_alloc ? f->key_alloc : 256;
+		char *key;
+		while(alloc < needed) alloc *= 2;
+		if(!(key = realloc(f->key, alloc))) {
+			return -1;
+		}
+		f->key = key;
+		f->key_alloc = alloc;
+	}
+
+	/* length-prefixed, so that different splits can't collide */
+	memcpy(f->key + f->key_sz, &sz, sizeof(size_t));
+	memcpy(f->key + f->key_sz + sizeof(size_t), p, sz);
+	f->key_sz = needed;
+	return 0;
+}
+
+/**
+ * Serialize what the encoded form of this message depends on.
+ */
+static int
+fanout_key_build(struct fanout *f, const struct cmd *cmd, const redisReply *r) {
+
+	unsigned int i;
+	char type = (char)r->type;
+
+	f->key_sz = 0;
+	if(fanout_key_append(f, &type, 1) < 0
+			|| fanout_key_append(f, cmd->jsonp ? cmd->jsonp : "", cmd->jsonp ? strlen(cmd->jsonp) : 0) < 0
+			|| fanout_key_append(f, cmd->count ? cmd->argv[0] : "", cmd->count ? cmd->argv_len[0] : 0) < 0) {
+		return -1;
+	}
+	for(i = 0; i < r->elements; ++i) {
+		if(fanout_key_append(f, r->element[i]->str, r->element[i]->len) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/* 64-bit FNV-1a */
+static uint64_t
+fanout_hash(const char *p, size_t sz) {
+
+	uint64_t h = 0xcbf29ce484222325ULL;
+	size_t i;
+
+	for(i = 0; i < sz; ++i) {
+		h ^= (unsigned char)p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+static void
+fanout_entry_clear(struct fanout_entry *e) {
+
+	free(e->key);
+	fanout_buf_release(e->body);
+	fanout_buf_release(e->ws_frame);
+	memset(e, 0, sizeof(struct fanout_entry));
+}
+
+/**
+ * Find the encoded form of a message, encoding it if it isn't in the table.
+ */
+static struct fanout_entry *
+fanout_lookup(struct fanout *f, const struct cmd *cmd, const redisReply *r, offload_encoder enc) {
+
+	struct fanout_entry *e;
+	uint64_t hash;
+	char *out;
+	size_t out_sz;
+
+	if(fanout_key_build(f, cmd, r) < 0) {
+		return NULL;
+	}
+	hash = fanout_hash(f->key, f->key_sz);
+	e = &f->slots[hash % FANOUT_SLOTS];
+
+	if(e->body && e->hash == hash && e->enc == enc
+			&& e->key_sz == f->key_sz && memcmp(e->key, f->key, f->key_sz) == 0) {
+		return e; /* already encoded for another subscriber */
+	}
+
+	/* encode and replace whatever was in this slot */
+	if(!(out = enc(cmd, r, &out_sz))) {
+		return NULL;
+	}
+	fanout_entry_clear(e);
+	e->body = fanout_buf_new(out, out_sz);
+	e->key = malloc(f->key_sz);
+	if(!e->body || !e->key) {
+		if(!e->body) free(out);
+		fanout_entry_clear(e);
+		return NULL;
+	}
+	memcpy(e->key, f->key, f->key_sz);
+	e->key_sz = f->key_sz;
+	e->hash = hash;
+	e->enc = enc;
+	return e;
+}
+
+/**
+ * Send a pub/sub message using the shared encoding, if possible.
+ * Returns 1 if the message was sent, 0 if the caller should format it.
+ */
+int
+fanout_reply(struct cmd *cmd, redisReply *r, offload_encoder enc, const char *content_type) {
+
+	struct fanout *f = cmd->w->fanout;
+	struct fanout_entry *e;
+	struct ws_client *ws;
+
+	if(!f || !cmd_is_subscribe(cmd)) {
+		return 0;
+	}
+	if(!fanout_is_message(r)
+			|| (!cmd->is_websocket && !cmd->started_responding)) { /* first chunk has headers */
+		batch_flush(cmd); /* keep messages in order with other replies */
+		return 0;
+	}
+	if(!(e = fanout_lookup(f, cmd, r, enc))) {
+		batch_flush(cmd);
+		return 0;
+	}
+
+	/* grouped with other messages */
+	if(cmd->batch && batch_add(cmd, e->body->data, e->body->sz, content_type)) {
+		return 1;
+	}
+
+	/* uncompressed WebSocket clients all get the same frame */
+	ws = cmd->is_websocket ? cmd->http_client->ws : NULL;
+	if(ws && !ws->pmd.enabled && !cmd->ws_id) { /* the ID is specific to this client */
+		if(!e->ws_frame) {
+			size_t frame_sz;
+			char *frame = ws_frame_new(WS_BINARY_FRAME, e->body->data, e->body->sz, &frame_sz);
+			if(frame && !(e->ws_frame = fanout_buf_new(frame, frame_sz))) {
+				free(frame);
+			}
+		}
+		if(e->ws_frame) {
+			ws_send_shared(ws, e->ws_frame);
+			return 1;
+		}
+	}
+
+	/* same for HTTP subscribers, with their own chunk header */
+	if(!cmd->is_websocket && cmd->stream && !cmd->zstream) {
+		http_stream_write_shared(cmd->stream, e->body);
+		return 1;
+	}
+
+	format_send_reply(cmd, e->body->data, e->body->sz, content_type);
+	return 1;
+}
@@ -0,0 +1,34 @@
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <stdlib.h>
+#include <event.h>
+#include <hiredis/hiredis.h>
+#include "offload.h"
+
+struct cmd;
+struct fanout;
+
+/* reference-counted buffer, shared by the output buffers of several clients */
+struct fanout_buf {
+	unsigned int refs;
+	char *data;
+	size_t sz;
+};
+
+struct fanout *
+fanout_new(void);
+
+int
+fanout_reply(struct cmd *cmd, redisReply *r, offload_encoder enc, const char *content_type);
+
+struct fanout_buf *
+fanout_buf_new(char *data, size_t sz);
+
+void
+fanout_buf_release(struct fanout_buf *fb);
+
+int
+fanout_buf_add(struct evbuffer *b, struct fanout_buf *fb);
+
+#endif
@@ -3,8 +3,15 @@
 #include "http.h"
 #include "client.h"
 #include "websocket.h"
+#include "worker.h"
+#include "server.h"
+#include "conf.h"
+#include "compress.h"
+#include "json.h"
+#include "slowlog.h"
 
 #include "md5/md5.h"
+#include <hiredis/hiredis.h>
 #include <string.h>
 #include <unistd.h>
 #include <pthread.h>
@@ -45,12 +52,26 @@ format_send_error(struct cmd *cmd, short code, const char *msg) {
 		resp = http_response_init(cmd->w, code, msg);
 		resp->http_version = cmd->http_version;
 		http_response_set_keep_alive(resp, cmd->keep_alive);
+		access_server_timing(resp, cmd);
+		slowlog_record(cmd, resp->body_len);
+		access_attach_cmd(resp, cmd);
 		http_response_write(resp, cmd->fd);
-	} else if(cmd->is_websocket && !cmd->http_client->ws->close_after_events) {
-		ws_frame_and_send_response(cmd->http_client->ws, WS_BINARY_FRAME, msg, strlen(msg));
+	} else if(cmd->is_websocket && cmd->http_client && !cmd->http_client->ws->close_after_events) {
+		if(cmd->ws_id) { /* envelopes are only used with JSON */
+			size_t error_sz;
+			char *error = json_ws_error(code, msg, strlen(msg), &error_sz);
+			ws_send_reply(cmd->http_client->ws, cmd->ws_id, error, error_sz);
+			free(error);
+		} else {
+			ws_frame_and_send_response(cmd->http_client->ws, WS_BINARY_FRAME, msg, strlen(msg));
+		}
 	}
 
-	if (!cmd->is_websocket) { /* don't free or detach persistent cmd */
+	if(cmd->is_websocket) {
+		if(!cmd->pub_sub_client) { /* sent over the pool, not the client's own connection */
+			cmd_free(cmd);
+		}
+	} else { /* don't free or detach persistent cmd */
 		if (cmd->pub_sub_client) { /* for pub/sub, remove command from client */
 			cmd->pub_sub_client->reused_cmd = NULL;
 		} else {
@@ -59,20 +80,130 @@ format_send_error(struct cmd *cmd, short code, const char *msg) {
 	}
 }
 
+/**
+ * Set up a compression stream for a chunked response if the client and
+ * the configuration allow it, and add the matching headers.
+ */
+static void
+format_start_compressed_stream(struct cmd *cmd, struct http_response *resp, const char *ct) {
+
+	struct conf *cfg = cmd->w->s->cfg;
+
+	if(!compress_type_enabled(cfg, ct)) {
+		return;
+	}
+	http_response_set_header(resp, "Vary", "Accept-Encoding", HEADER_COPY_NONE);
+
+	if(cmd->accept_encoding != COMPRESS_NONE) {
+		cmd->zstream = compress_stream_new(cmd->accept_encoding, cfg->compression.level);
+		if(cmd->zstream) {
+			http_response_set_header(resp, "Content-Encoding",
+				compress_encoding_name(cmd->accept_encoding), HEADER_COPY_NONE);
+		}
+	}
+}
+
+/**
+ * Compute the ETag and compressed form of a reply body. This only reads
+ * from the command and the configuration, so it can run on any thread.
+ */
+void
+format_prepare_body(const struct cmd *cmd, const char *p, size_t sz,
+		const char *content_type, struct format_body *b) {
+
+	struct conf *cfg = cmd->w->s->cfg;
+	const char *ct = cmd->mime?cmd->mime:content_type;
+
+	b->etag = etag_new(p, sz);
+	b->zbody = NULL;
+	b->zsz = 0;
+
+	if(compress_type_enabled(cfg, ct) && cmd->accept_encoding != COMPRESS_NONE
+			&& sz >= cfg->compression.min_size) {
+		b->zbody = compress_buffer(cmd->accept_encoding, cfg->compression.level, p, sz, &b->zsz);
+	}
+}
+
+/**
+ * Suffix an ETag with a content-coding, since a strong validator must differ
+ * between the encoded and identity forms of a body: "abc" becomes "abc-gzip".
+ */
+static char *
+etag_with_encoding(char *etag, const char *encoding) {
+
+	size_t sz = strlen(etag), enc_sz = strlen(encoding);
+	char *out = realloc(etag, sz + 1 + enc_sz + 1);
+
+	if(!out) {
+		free(etag);
+		return NULL;
+	}
+	out[sz - 1] = '-'; /* over the closing quote */
+	memcpy(out + sz, encoding, enc_sz);
+	out[sz + enc_sz] = '"';
+	out[sz + enc_sz + 1] = 0;
+	return out;
+}
+
+static void
+format_send(struct cmd *cmd, const char *p, size_t sz, const char *content_type,
+		struct format_body *b, char *owned);
+
 void
 format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content_type) {
 
+	format_send(cmd, p, sz, content_type, NULL, NULL);
+}
+
+/**
+ * Same as format_send_reply, taking ownership of `p`, a malloc'd buffer:
+ * a one-off HTTP reply is written from it rather than copied.
+ */
+void
+format_send_owned(struct cmd *cmd, char *p, size_t sz, const char *content_type) {
+
+	format_send(cmd, p, sz, content_type, NULL, p);
+}
+
+/**
+ * Same as format_send_owned, with a pre-computed body.
+ * Takes ownership of the buffers in `b`, which is only meant for
+ * one-off HTTP replies (not WebSocket or pub/sub).
+ */
+void
+format_send_prepared(struct cmd *cmd, char *p, size_t sz,
+		const char *content_type, struct format_body *b) {
+
+	format_send(cmd, p, sz, content_type, b, p);
+}
+
+/* `owned` is `p` if it can be handed over to the response, NULL otherwise */
+static void
+format_send(struct cmd *cmd, const char *p, size_t sz, const char *content_type,
+		struct format_body *b, char *owned) {
+
 	int free_cmd = 1;
 	const char *ct = cmd->mime?cmd->mime:content_type;
 	struct http_response *resp;
+	struct format_body local;
+	char *zbody = NULL;
+	size_t zsz = 0;
 
 	if(cmd->is_websocket) {
 
-		ws_frame_and_send_response(cmd->http_client->ws, WS_BINARY_FRAME, p, sz);
+		if(cmd->http_client) { /* unset if the client left before the reply */
+			ws_send_reply(cmd->http_client->ws, cmd->ws_id, p, sz);
+		}
 
 		/* If it's a subscribe command, there'll be more responses */
-		if(!cmd_is_subscribe(cmd))
+		if(!cmd_is_subscribe(cmd)) {
 			cmd_free(cmd);
+		} else if(cmd->ws_id) { /* only for this reply, see ws_envelope_tag */
+			if(cmd->ws_id_free) free(cmd->ws_id);
+			cmd->ws_id = NULL;
+			cmd->ws_id_free = 0;
+		}
+		free(owned);
 		return;
 	}
 
@@ -88,18 +219,53 @@ format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content
 				http_response_set_header(resp, "Content-Disposition", cmd->filename, HEADER_COPY_VALUE);
 			}
 			http_response_set_header(resp, "Content-Type", ct, HEADER_COPY_VALUE);
+			format_start_compressed_stream(cmd, resp, ct);
 			http_response_set_keep_alive(resp, 1);
 			http_response_set_header(resp, "Transfer-Encoding", "chunked", HEADER_COPY_NONE);
-			http_response_set_body(resp, p, sz);
-			http_response_write(resp, cmd->fd);
+			if(cmd->zstream && (zbody = compress_stream_chunk(cmd->zstream, p, sz, &zsz))) {
+				http_response_set_body(resp, zbody, zsz);
+			} else {
+				http_response_set_body(resp, p, sz);
+			}
+
+			/* later chunks are queued behind the headers */
+			cmd->stream = http_stream_new(cmd);
+			if(cmd->stream) {
+				http_stream_write_response(cmd->stream, resp);
+			} else {
+				http_response_write(resp, cmd->fd);
+			}
+		} else if(!cmd->stream) {
+			slog(cmd->w->s, WEBDIS_ERROR, "No output stream, dropping chunk", 0);
+		} else if(cmd->zstream) {
+			/* compressed chunk, sharing the dictionary with previous ones */
+			if((zbody = compress_stream_chunk(cmd->zstream, p, sz, &zsz))) {
+				http_stream_write_chunk(cmd->stream, zbody, zsz);
+			}
 		} else {
 			/* Asynchronous chunk write. */
-			http_response_write_chunk(cmd->fd, cmd->w, p, sz);
+			http_stream_write_chunk(cmd->stream, p, sz);
 		}
 
 	} else {
-		/* compute ETag */
-		char *etag = etag_new(p, sz);
+		char *etag;
+
+		/* compute ETag and compressed body, unless done already */
+		if(!b) {
+			format_prepare_body(cmd, p, sz, content_type, &local);
+			b = &local;
+		}
+		etag = b->etag;
+		zbody = b->zbody;
+		zsz = b->zsz;
+
+		if(zbody && zsz >= sz) { /* only use the compressed body if it helps */
+			free(zbody);
+			zbody = NULL;
+		}
+		if(etag && zbody) {
+			etag = etag_with_encoding(etag, compress_encoding_name(cmd->accept_encoding));
+		}
 
 		if(etag) {
 			/* check If-None-Match */
@@ -107,16 +273,34 @@ format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content
 				/* SAME! send 304. */
 				resp = http_response_init(cmd->w, 304, "Not Modified");
 			} else {
+				struct conf *cfg = cmd->w->s->cfg;
 				resp = http_response_init(cmd->w, 200, "OK");
 				if(cmd->filename) {
 					http_response_set_header(resp, "Content-Disposition", cmd->filename, HEADER_COPY_VALUE);
 				}
 				http_response_set_header(resp, "Content-Type", ct, HEADER_COPY_VALUE);
 				http_response_set_header(resp, "ETag", etag, HEADER_COPY_VALUE);
-				http_response_set_body(resp, p, sz);
+
+				if(compress_type_enabled(cfg, ct)) {
+					http_response_set_header(resp, "Vary", "Accept-Encoding", HEADER_COPY_NONE);
+				}
+
+				if(zbody) {
+					http_response_set_header(resp, "Content-Encoding",
+						compress_encoding_name(cmd->accept_encoding), HEADER_COPY_NONE);
+					http_response_set_body(resp, zbody, zsz);
+				} else if(owned) {
+					http_response_set_owned_body(resp, owned, sz);
+					owned = NULL;
+				} else {
+					http_response_set_body(resp, p, sz);
+				}
 			}
 			resp->http_version = cmd->http_version;
 			http_response_set_keep_alive(resp, cmd->keep_alive);
+			access_server_timing(resp, cmd);
+			slowlog_record(cmd, resp->body_len);
+			access_attach_cmd(resp, cmd);
 			http_response_write(resp, cmd->fd);
 			free(etag);
 		} else {
@@ -124,12 +308,49 @@ format_send_reply(struct cmd *cmd, const char *p, size_t sz, const char *content
 		}
 	}
 
+	/* body was copied into the response buffer */
+	free(zbody);
+	free(owned);
+
 	/* cleanup */
 	if(free_cmd) {
 		cmd_free(cmd);
 	}
 }
 
+/**
+ * Rough size of a reply once formatted, used to pick large replies.
+ * Stops counting once `limit` is exceeded.
+ */
+size_t
+format_reply_size(const redisReply *r, size_t limit) {
+
+	size_t sz = 8; /* type, length, separators */
+	unsigned int i;
+
+	switch(r->type) {
+		case REDIS_REPLY_ARRAY:
+		case REDIS_REPLY_MAP:
+		case REDIS_REPLY_SET:
+		case REDIS_REPLY_PUSH:
+			for(i = 0; i < r->elements && sz <= limit; ++i) {
+				sz += format_reply_size(r->element[i], limit - sz);
+			}
+			return sz;
+
+		case REDIS_REPLY_STRING:
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_ERROR:
+		case REDIS_REPLY_DOUBLE:
+		case REDIS_REPLY_BIGNUM:
+		case REDIS_REPLY_VERB:
+			return sz + r->len;
+
+		default:
+			return sz;
+	}
+}
+
 int
 integer_length(long long int i) {
 	int sz = 0;
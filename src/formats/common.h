@@ -4,12 +4,35 @@
 #include <stdlib.h>
 
 struct cmd;
+struct redisReply;
+
+/* reply body prepared ahead of sending, e.g. on a formatting thread */
+struct format_body {
+	char *etag;
+	char *zbody;	/* compressed body, or NULL */
+	size_t zsz;
+};
 
 void
 format_send_reply(struct cmd *cmd,
 		const char *p, size_t sz,
 		const char *content_type);
 
+void
+format_send_owned(struct cmd *cmd, char *p, size_t sz,
+		const char *content_type);
+
+void
+format_prepare_body(const struct cmd *cmd, const char *p, size_t sz,
+		const char *content_type, struct format_body *b);
+
+void
+format_send_prepared(struct cmd *cmd, char *p, size_t sz,
+		const char *content_type, struct format_body *b);
+
+size_t
+format_reply_size(const struct redisReply *r, size_t limit);
+
 void
 format_send_error(struct cmd *cmd, short code, const char *msg);
 int
@@ -2,6 +2,7 @@
 #include "cmd.h"
 #include "common.h"
 #include "http.h"
+#include "trace.h"
 
 #include <string.h>
 #include <hiredis/hiredis.h>
@@ -23,7 +24,7 @@ custom_type_reply(redisAsyncContext *c, void *r, void *privdata) {
 	size_t sz;
 	char *array_out;
 
-
+	TRACE_REPLY(cmd, reply);
 	if (reply == NULL) { /* broken Redis link */
 		format_send_error(cmd, 503, "Service Unavailable");
 		return;
@@ -37,6 +38,9 @@ custom_type_reply(redisAsyncContext *c, void *r, void *privdata) {
 				return;
 
 			case REDIS_REPLY_STRING:
+			case REDIS_REPLY_VERB:
+			case REDIS_REPLY_DOUBLE:
+			case REDIS_REPLY_BIGNUM:
 				format_send_reply(cmd, reply->str, reply->len, cmd->mime);
 				return;
 
@@ -50,10 +54,12 @@ custom_type_reply(redisAsyncContext *c, void *r, void *privdata) {
 				return;
 
 			case REDIS_REPLY_INTEGER:
+			case REDIS_REPLY_BOOL:
 				int_len = sprintf(int_buffer, "%lld", reply->integer);
 				format_send_reply(cmd, int_buffer, int_len, cmd->mime);
 				return;
 			case REDIS_REPLY_ARRAY:
+			case REDIS_REPLY_SET:
 				array_out = custom_array(cmd, r, &sz);
 				format_send_reply(cmd, array_out, sz, cmd->mime);
 				free(array_out);
@@ -3,46 +3,74 @@
 #include "cmd.h"
 #include "http.h"
 #include "client.h"
+#include "offload.h"
+#include "fanout.h"
+#include "websocket.h"
+#include "trace.h"
 
 #include <string.h>
 #include <strings.h>
+#include <math.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
 static json_t *
 json_wrap_redis_reply(const struct cmd *cmd, const redisReply *r);
 
+static char *
+json_encode(const struct cmd *cmd, const redisReply *r, size_t *out_sz) {
+
+	json_t *j;
+	char *jstr;
+
+	/* encode redis reply as JSON */
+	j = json_wrap_redis_reply(cmd, r);
+
+	/* get JSON as string, possibly with JSONP wrapper */
+	jstr = json_string_output(j, cmd->jsonp);
+	json_decref(j);
+
+	*out_sz = jstr ? strlen(jstr) : 0;
+	return jstr;
+}
+
 void
 json_reply(redisAsyncContext *c, void *r, void *privdata) {
 
 	redisReply *reply = r;
 	struct cmd *cmd = privdata;
-	json_t *j;
 	char *jstr;
+	size_t sz;
 	(void)c;
 
 	if(cmd == NULL) {
 		/* broken connection */
 		return;
 	}
+	TRACE_REPLY(cmd, reply);
 
 	if(reply == NULL) { /* broken Redis link */
 		format_send_error(cmd, 503, "Service Unavailable");
 		return;
 	}
 
-	/* encode redis reply as JSON */
-	j = json_wrap_redis_reply(cmd, r);
+	/* pub/sub replies for an envelope carry the ID of their subscription */
+	ws_envelope_tag(cmd, reply);
 
-	/* get JSON as string, possibly with JSONP wrapper */
-	jstr = json_string_output(j, cmd->jsonp);
+	/* pub/sub messages are encoded once for all subscribers */
+	if(fanout_reply(cmd, reply, json_encode, "application/json")) {
+		return;
+	}
+
+	/* large replies are formatted on a separate thread */
+	if(offload_reply(cmd, reply, json_encode, "application/json")) {
+		return;
+	}
 
-	/* send reply */
-	format_send_reply(cmd, jstr, strlen(jstr), "application/json");
+	jstr = json_encode(cmd, reply, &sz);
 
-	/* cleanup */
-	json_decref(j);
-	free(jstr);
+	/* send reply, without copying it again */
+	format_send_owned(cmd, jstr, sz, "application/json");
 }
 
 /**
@@ -92,6 +120,97 @@ json_info_reply(const char *s) {
 static json_t *
 json_expand_array(const redisReply *r);
 
+static json_t *
+json_map_reply(const redisReply *r);
+
+/**
+ * RESP3 scalar types, or NULL if the element is not one of them.
+ */
+static json_t *
+json_resp3_scalar(const redisReply *e) {
+
+	switch(e->type) {
+		case REDIS_REPLY_DOUBLE: /* inf and nan have no JSON representation */
+			return isfinite(e->dval) ? json_real(e->dval) : json_string(e->str);
+
+		case REDIS_REPLY_BOOL:
+			return json_boolean(e->integer);
+
+		case REDIS_REPLY_BIGNUM: /* too large for a JSON integer */
+		case REDIS_REPLY_VERB:
+			return json_string(e->str);
+
+		default:
+			return NULL;
+	}
+}
+
+static json_t *
+json_wrap_element(const redisReply *e) {
+
+	json_t *j;
+
+	switch(e->type) {
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_STRING:
+			return json_string(e->str);
+
+		case REDIS_REPLY_INTEGER:
+			return json_integer(e->integer);
+
+		case REDIS_REPLY_ARRAY:
+		case REDIS_REPLY_SET:
+		case REDIS_REPLY_PUSH:
+			j = json_expand_array(e);
+			break;
+
+		case REDIS_REPLY_MAP:
+			j = json_map_reply(e);
+			break;
+
+		default:
+			j = json_resp3_scalar(e);
+			break;
+	}
+	return j ? j : json_null();
+}
+
+/**
+ * RESP3 map, keys are converted to strings.
+ */
+static json_t *
+json_map_reply(const redisReply *r) {
+
+	json_t *jroot = json_object();
+	char int_key[24];
+	unsigned int i;
+
+	for(i = 0; i + 1 < r->elements; i += 2) {
+		const redisReply *k = r->element[i];
+		const char *key;
+
+		switch(k->type) {
+			case REDIS_REPLY_STRING:
+			case REDIS_REPLY_STATUS:
+			case REDIS_REPLY_DOUBLE:
+			case REDIS_REPLY_BIGNUM:
+			case REDIS_REPLY_VERB:
+				key = k->str;
+				break;
+
+			case REDIS_REPLY_INTEGER:
+				snprintf(int_key, sizeof(int_key), "%lld", k->integer);
+				key = int_key;
+				break;
+
+			default: /* no sensible string form */
+				continue;
+		}
+		json_object_set_new(jroot, key, json_wrap_element(r->element[i+1]));
+	}
+	return jroot;
+}
+
 static json_t *
 json_array_to_keyvalue_reply(const redisReply *r) {
 	/* zip keys and values together in a json object */
@@ -132,6 +251,15 @@ json_array_to_keyvalue_reply(const redisReply *r) {
 			json_object_set_new(jroot, k->str, jlist);
 			break;
 
+		case REDIS_REPLY_MAP:
+		case REDIS_REPLY_SET:
+		case REDIS_REPLY_DOUBLE:
+		case REDIS_REPLY_BOOL:
+		case REDIS_REPLY_BIGNUM:
+		case REDIS_REPLY_VERB:
+			json_object_set_new(jroot, k->str, json_wrap_element(v));
+			break;
+
 		default:
 			json_decref(jroot);
 			return NULL;
@@ -145,34 +273,11 @@ static json_t *
 json_expand_array(const redisReply *r) {
 
 	unsigned int i;
-	json_t *jlist, *sublist;
-	const redisReply *e;
+	json_t *jlist;
 
 	jlist = json_array();
 	for(i = 0; i < r->elements; ++i) {
-		e = r->element[i];
-		switch(e->type) {
-		case REDIS_REPLY_STATUS:
-		case REDIS_REPLY_STRING:
-			json_array_append_new(jlist, json_string(e->str));
-			break;
-
-		case REDIS_REPLY_INTEGER:
-			json_array_append_new(jlist, json_integer(e->integer));
-			break;
-
-		case REDIS_REPLY_ARRAY:
-			if(!(sublist = json_expand_array(e))) {
-				sublist = json_null();
-			}
-			json_array_append_new(jlist, sublist);
-			break;
-
-		case REDIS_REPLY_NIL:
-		default:
-			json_array_append_new(jlist, json_null());
-			break;
-		}
+		json_array_append_new(jlist, json_wrap_element(r->element[i]));
 	}
 	return jlist;
 }
@@ -388,6 +493,7 @@ json_wrap_redis_reply(const struct cmd *cmd, const redisReply *r) {
 			break;
 
 		case REDIS_REPLY_STRING:
+		case REDIS_REPLY_VERB: /* INFO is a verbatim string in RESP3 */
 			if(strcasecmp(verb, "INFO") == 0) {
 				json_object_set_new(jroot, verb, json_info_reply(r->str));
 			} else {
@@ -440,6 +546,16 @@ json_wrap_redis_reply(const struct cmd *cmd, const redisReply *r) {
 			json_object_set_new(jroot, verb, jlist);
 			break;
 
+		/* RESP3 types carry their own structure, no need to look at the verb */
+		case REDIS_REPLY_MAP:
+		case REDIS_REPLY_SET:
+		case REDIS_REPLY_PUSH:
+		case REDIS_REPLY_DOUBLE:
+		case REDIS_REPLY_BOOL:
+		case REDIS_REPLY_BIGNUM:
+			json_object_set_new(jroot, verb, json_wrap_element(r));
+			break;
+
 		case REDIS_REPLY_NIL:
 		default:
 			json_object_set_new(jroot, verb, json_null());
@@ -475,30 +591,15 @@ json_string_output(json_t *j, const char *jsonp) {
 	return json_reply;
 }
 
-/* extract JSON from WebSocket frame and fill struct cmd. */
-struct cmd *
-json_ws_extract(struct http_client *c, const char *p, size_t sz) {
+/* fill struct cmd from the strings and integers of a JSON array */
+static struct cmd *
+json_ws_cmd_from_array(struct http_client *c, json_t *j) {
 
 	struct cmd *cmd = NULL;
-	json_t *j;
-	char *jsonz; /* null-terminated */
-
 	unsigned int i, cur;
 	int argc = 0;
-	json_error_t jerror;
-
-	(void)c;
 
-	jsonz = calloc(sz + 1, 1);
-	memcpy(jsonz, p, sz);
-	j = json_loads(jsonz, sz, &jerror);
-	free(jsonz);
-
-	if(!j) {
-		return NULL;
-	}
 	if(json_typeof(j) != JSON_ARRAY) {
-		json_decref(j);
 		return NULL; /* invalid JSON */
 	}
 
@@ -518,7 +619,6 @@ json_ws_extract(struct http_client *c, const char *p, size_t sz) {
 	}
 
 	if(!argc) { /* not a single item could be decoded */
-		json_decref(j);
 		return NULL;
 	}
 
@@ -551,10 +651,225 @@ json_ws_extract(struct http_client *c, const char *p, size_t sz) {
 		}
 	}
 
+	return cmd;
+}
+
+static json_t *
+json_ws_load(const char *p, size_t sz) {
+
+	json_t *j;
+	char *jsonz; /* null-terminated */
+	json_error_t jerror;
+
+	jsonz = calloc(sz + 1, 1);
+	memcpy(jsonz, p, sz);
+	j = json_loads(jsonz, 0, &jerror);
+	free(jsonz);
+	return j;
+}
+
+/* extract JSON from WebSocket frame using jansson, and fill struct cmd.
+ * This is the fallback for input that json_ws_extract can't parse itself. */
+struct cmd *
+json_ws_extract_tree(struct http_client *c, const char *p, size_t sz) {
+
+	struct cmd *cmd;
+	json_t *j = json_ws_load(p, sz);
+
+	if(!j) {
+		return NULL;
+	}
+	cmd = json_ws_cmd_from_array(c, j);
+	json_decref(j);
+	return cmd;
+}
+
+/**
+ * Extract a command sent in an envelope, e.g. {"id": 42, "cmd": ["GET", "key"]}.
+ * The ID is a string or an integer, returned in its JSON form in `*id`.
+ */
+struct cmd *
+json_ws_extract_envelope(struct http_client *c, const char *p, size_t sz, char **id) {
+
+	struct cmd *cmd = NULL;
+	json_t *j = json_ws_load(p, sz), *jid, *jcmd;
+
+	*id = NULL;
+	if(!j) {
+		return NULL;
+	}
+	jid = json_object_get(j, "id");
+	jcmd = json_object_get(j, "cmd");
+	if(jid && jcmd && (json_is_string(jid) || json_is_integer(jid))
+			&& (*id = json_dumps(jid, JSON_ENCODE_ANY | JSON_COMPACT))) {
+		if(!(cmd = json_ws_cmd_from_array(c, jcmd))) {
+			free(*id);
+			*id = NULL;
+		}
+	}
 	json_decref(j);
 	return cmd;
 }
 
+/* A string or integer found in a WebSocket frame, before copying it to argv */
+struct json_ws_span {
+	const char *p;
+	size_t sz;
+	int escaped; /* contains backslash escapes */
+};
+
+#define JSON_WS_SPANS_STACK 16
+
+static const char *
+json_ws_skip_space(const char *p, const char *end) {
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) {
+		p++;
+	}
+	return p;
+}
+
+/* copy a JSON string body, replacing escapes; returns the decoded size */
+static size_t
+json_ws_unescape(char *out, const char *p, size_t sz) {
+
+	const char *end = p + sz;
+	char *start = out;
+
+	while(p < end) {
+		if(*p != '\\') {
+			*out++ = *p++;
+			continue;
+		}
+		p++;
+		switch(*p++) {
+			case 'b': *out++ = '\b'; break;
+			case 'f': *out++ = '\f'; break;
+			case 'n': *out++ = '\n'; break;
+			case 'r': *out++ = '\r'; break;
+			case 't': *out++ = '\t'; break;
+			default: *out++ = p[-1]; break; /* '"', '\\', '/' */
+		}
+	}
+	return out - start;
+}
+
+/* Single-pass parser for the common case: a flat array of strings and
+ * integers, e.g. ["SET","key","value"] or ["INCRBY","key",10].
+ * Returns NULL with *fallback set if the input needs the generic parser. */
+static struct cmd *
+json_ws_extract_flat(struct http_client *c, const char *p, size_t sz, int *fallback) {
+
+	struct json_ws_span stack_spans[JSON_WS_SPANS_STACK], *spans = stack_spans;
+	size_t count = 0, capacity = JSON_WS_SPANS_STACK;
+	const char *end = p + sz;
+	struct cmd *cmd = NULL;
+	size_t i;
+
+	*fallback = 1;
+
+	p = json_ws_skip_space(p, end);
+	if(p == end || *p != '[') {
+		return NULL;
+	}
+	p = json_ws_skip_space(p + 1, end);
+
+	while(p < end && *p != ']') {
+		struct json_ws_span span = {NULL, 0, 0};
+
+		if(count == capacity) { /* more arguments than fit on the stack */
+			struct json_ws_span *tmp = malloc(2 * capacity * sizeof(*spans));
+			if(!tmp) goto done;
+			memcpy(tmp, spans, count * sizeof(*spans));
+			if(spans != stack_spans) free(spans);
+			spans = tmp;
+			capacity *= 2;
+		}
+
+		if(*p == '"') { /* string */
+			span.p = ++p;
+			while(p < end && *p != '"') {
+				if((unsigned char)*p < 0x20) {
+					goto done; /* control characters must be escaped */
+				} else if(*p == '\\') {
+					if(p + 1 == end || !p[1] || !strchr("\"\\/bfnrt", p[1])) {
+						goto done; /* \uXXXX or invalid escape */
+					}
+					span.escaped = 1;
+					p++;
+				}
+				p++;
+			}
+			if(p == end) goto done;
+			span.sz = p - span.p;
+			p++; /* closing quote */
+		} else if(*p == '-' || (*p >= '0' && *p <= '9')) { /* integer */
+			span.p = p;
+			if(*p == '-') p++;
+			while(p < end && *p >= '0' && *p <= '9') p++;
+			span.sz = p - span.p;
+			/* leave leading zeros, "-0", fractions, exponents and
+			   values that could overflow an int to jansson */
+			if(span.sz == 0 || span.sz > 9 || span.p[span.sz-1] == '-'
+					|| (span.p[0] == '0' && span.sz > 1)
+					|| (span.p[0] == '-' && span.p[1] == '0')) {
+				goto done;
+			}
+			if(p < end && (*p == '.' || *p == 'e' || *p == 'E')) {
+				goto done;
+			}
+		} else { /* nested structures, booleans, null */
+			goto done;
+		}
+		spans[count++] = span;
+
+		p = json_ws_skip_space(p, end);
+		if(p < end && *p == ',') {
+			p = json_ws_skip_space(p + 1, end);
+			if(p < end && *p == ']') goto done; /* trailing comma */
+		} else if(p < end && *p != ']') {
+			goto done;
+		}
+	}
+
+	if(p == end || count == 0) {
+		goto done;
+	}
+	if(json_ws_skip_space(p + 1, end) != end) {
+		goto done; /* trailing data */
+	}
+
+	/* the shape is valid, copy arguments */
+	*fallback = 0;
+	cmd = cmd_new(c, (int)count);
+	for(i = 0; i < count; ++i) {
+		cmd->argv[i] = malloc(spans[i].sz + 1);
+		if(spans[i].escaped) {
+			cmd->argv_len[i] = json_ws_unescape(cmd->argv[i], spans[i].p, spans[i].sz);
+		} else {
+			memcpy(cmd->argv[i], spans[i].p, spans[i].sz);
+			cmd->argv_len[i] = spans[i].sz;
+		}
+		cmd->argv[i][cmd->argv_len[i]] = 0;
+	}
+
+done:
+	if(spans != stack_spans) free(spans);
+	return cmd;
+}
+
+/* extract JSON from WebSocket frame and fill struct cmd. */
+struct cmd *
+json_ws_extract(struct http_client *c, const char *p, size_t sz) {
+
+	int fallback;
+	struct cmd *cmd = json_ws_extract_flat(c, p, sz, &fallback);
+
+	if(fallback) {
+		return json_ws_extract_tree(c, p, sz);
+	}
+	return cmd;
+}
+
 /* Formats a WebSocket error message */
 char* json_ws_error(int http_status, const char *msg, size_t msg_sz, size_t *out_sz) {
 
@@ -17,6 +17,12 @@ json_string_output(json_t *j, const char *jsonp);
 struct cmd *
 json_ws_extract(struct http_client *c, const char *p, size_t sz);
 
+struct cmd *
+json_ws_extract_tree(struct http_client *c, const char *p, size_t sz);
+
+struct cmd *
+json_ws_extract_envelope(struct http_client *c, const char *p, size_t sz, char **id);
+
 char*
 json_ws_error(int http_status, const char *msg, size_t msg_sz, size_t *out_sz);
 
@@ -3,175 +3,320 @@
 #include "cmd.h"
 #include "http.h"
 #include "client.h"
+#include "offload.h"
+#include "fanout.h"
+#include "trace.h"
 
 #include <string.h>
 #include <strings.h>
+#include <stdint.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
-/* msgpack-c versions >= 1.0 changed to support the v5 msgpack spec.
- * As part of doing this, the (un)pack_raw functions were replaced with
- * more explicit (un)pack_str and (un)pack_bin.  1.2.0 introduced the
- * (un)pack_v4raw functions to retain compatibility.
+/* Self-contained MessagePack encoder (https://msgpack.org/).
+ *
+ * The reply is walked twice with the same code: once to compute the exact
+ * output size, then once more to write it into a single allocation. Strings
+ * use the "raw" family of types (fixraw, raw 16, raw 32) as in the original
+ * spec, which newer decoders read as str.
  */
-#if defined(MSGPACK_VERSION_MAJOR) && defined(MSGPACK_VERSION_MINOR) \
-	&& MSGPACK_VERSION_MAJOR > 1 \
-	|| (MSGPACK_VERSION_MAJOR == 1 && MSGPACK_VERSION_MINOR >= 2)
-#define msgpack_pack_raw msgpack_pack_v4raw
-#define msgpack_pack_raw_body msgpack_pack_v4raw_body
-#endif
 
 struct msg_out {
-	char *p;
+	char *p;	/* NULL when only counting */
 	size_t sz;
 };
 
 static void
-msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *, const redisReply *r);
+msg_put(struct msg_out *out, const void *data, size_t sz) {
+	if(out->p) {
+		memcpy(out->p + out->sz, data, sz);
+	}
+	out->sz += sz;
+}
+
+static void
+msg_put_byte(struct msg_out *out, unsigned char b) {
+	if(out->p) {
+		out->p[out->sz] = (char)b;
+	}
+	out->sz++;
+}
+
+/* type byte followed by a big-endian integer of `bytes` bytes */
+static void
+msg_put_be(struct msg_out *out, unsigned char type, uint64_t v, int bytes) {
+	unsigned char buf[9];
+	int i;
+
+	buf[0] = type;
+	for(i = bytes; i > 0; --i) {
+		buf[i] = (unsigned char)(v & 0xff);
+		v >>= 8;
+	}
+	msg_put(out, buf, 1 + bytes);
+}
+
+static void
+msg_pack_nil(struct msg_out *out) {
+	msg_put_byte(out, 0xc0);
+}
+
+static void
+msg_pack_bool(struct msg_out *out, int b) {
+	msg_put_byte(out, b ? 0xc3 : 0xc2);
+}
+
+static void
+msg_pack_int(struct msg_out *out, long long i) {
+
+	if(i >= 0) {
+		uint64_t u = (uint64_t)i;
+		if(u < 128) {
+			msg_put_byte(out, (unsigned char)u); /* positive fixint */
+		} else if(u <= UINT8_MAX) {
+			msg_put_be(out, 0xcc, u, 1);
+		} else if(u <= UINT16_MAX) {
+			msg_put_be(out, 0xcd, u, 2);
+		} else if(u <= UINT32_MAX) {
+			msg_put_be(out, 0xce, u, 4);
+		} else {
+			msg_put_be(out, 0xcf, u, 8);
+		}
+	} else {
+		if(i >= -32) {
+			msg_put_byte(out, (unsigned char)(0xe0 | (i + 32))); /* negative fixint */
+		} else if(i >= INT8_MIN) {
+			msg_put_be(out, 0xd0, (uint64_t)i, 1);
+		} else if(i >= INT16_MIN) {
+			msg_put_be(out, 0xd1, (uint64_t)i, 2);
+		} else if(i >= INT32_MIN) {
+			msg_put_be(out, 0xd2, (uint64_t)i, 4);
+		} else {
+			msg_put_be(out, 0xd3, (uint64_t)i, 8);
+		}
+	}
+}
+
+static void
+msg_pack_double(struct msg_out *out, double d) {
+
+	uint64_t u;
+	memcpy(&u, &d, sizeof(u));
+	msg_put_be(out, 0xcb, u, 8); /* float 64 */
+}
+
+static void
+msg_pack_raw(struct msg_out *out, const char *s, size_t sz) {
+
+	if(sz < 32) {
+		msg_put_byte(out, 0xa0 | (unsigned char)sz);
+	} else if(sz <= UINT16_MAX) {
+		msg_put_be(out, 0xda, sz, 2);
+	} else {
+		msg_put_be(out, 0xdb, sz, 4);
+	}
+	msg_put(out, s, sz);
+}
+
+static void
+msg_pack_array(struct msg_out *out, size_t n) {
+
+	if(n < 16) {
+		msg_put_byte(out, 0x90 | (unsigned char)n);
+	} else if(n <= UINT16_MAX) {
+		msg_put_be(out, 0xdc, n, 2);
+	} else {
+		msg_put_be(out, 0xdd, n, 4);
+	}
+}
+
+static void
+msg_pack_map(struct msg_out *out, size_t n) {
+
+	if(n < 16) {
+		msg_put_byte(out, 0x80 | (unsigned char)n);
+	} else if(n <= UINT16_MAX) {
+		msg_put_be(out, 0xde, n, 2);
+	} else {
+		msg_put_be(out, 0xdf, n, 4);
+	}
+}
+
+static void
+msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *out, const redisReply *r);
+
+static char *
+msgpack_encode(const struct cmd *cmd, const redisReply *r, size_t *out_sz) {
+
+	struct msg_out out;
+
+	/* first pass: compute size */
+	out.p = NULL;
+	out.sz = 0;
+	msgpack_wrap_redis_reply(cmd, &out, r);
+
+	/* second pass: encode redis reply */
+	out.p = malloc(out.sz);
+	if(!out.p) {
+		return NULL;
+	}
+	out.sz = 0;
+	msgpack_wrap_redis_reply(cmd, &out, r);
+
+	*out_sz = out.sz;
+	return out.p;
+}
 
 void
 msgpack_reply(redisAsyncContext *c, void *r, void *privdata) {
 
 	redisReply *reply = r;
 	struct cmd *cmd = privdata;
-	struct msg_out out;
+	char *out;
+	size_t sz;
 	(void)c;
 
 	if(cmd == NULL) {
 		/* broken connection */
 		return;
 	}
+	TRACE_REPLY(cmd, reply);
 
 	if (reply == NULL) { /* broken Redis link */
 		format_send_error(cmd, 503, "Service Unavailable");
 		return;
 	}
 
-	/* prepare data structure for output */
-	out.p = NULL;
-	out.sz = 0;
-
-	/* encode redis reply */
-	msgpack_wrap_redis_reply(cmd, &out, r);
-
-	/* send reply */
-	format_send_reply(cmd, out.p, out.sz, "application/x-msgpack");
-
-	/* cleanup */
-	free(out.p);
-}
-
-static int
-on_msgpack_write(void *data, const char *s, size_t sz) {
+	/* pub/sub messages are encoded once for all subscribers */
+	if(fanout_reply(cmd, reply, msgpack_encode, "application/x-msgpack")) {
+		return;
+	}
 
-	struct msg_out *out = data;
+	/* large replies are formatted on a separate thread */
+	if(offload_reply(cmd, reply, msgpack_encode, "application/x-msgpack")) {
+		return;
+	}
 
-	out->p = realloc(out->p, out->sz + sz);
-	memcpy(out->p + out->sz, s, sz);
-	out->sz += sz;
+	out = msgpack_encode(cmd, reply, &sz);
+	if(!out) {
+		format_send_error(cmd, 503, "Service Unavailable");
+		return;
+	}
 
-	return sz;
+	/* send reply, without copying it again */
+	format_send_owned(cmd, out, sz, "application/x-msgpack");
 }
 
 /**
- * Parse info message and return object.
+ * Parse info message into a map, skipping comments and empty lines.
  */
-void
-msg_info_reply(msgpack_packer* pk, const char *s, size_t sz) {
-
-	const char *p = s;
-	unsigned int count = 0;
-
-	/* TODO: handle new format */
-
-	/* count number of lines */
-	while(p < s + sz) {
-		p = strchr(p, '\r');
-		if(!p) break;
-
-		p++;
-		count++;
-	}
-
-	/* create msgpack object */
-	msgpack_pack_map(pk, count);
+static void
+msg_info_reply(struct msg_out *out, const char *s, size_t sz) {
 
-	p = s;
-	while(p < s + sz) {
-		char *key, *val, *nl, *colon;
-		size_t key_sz, val_sz;
+	const char *p, *end = s + sz;
+	size_t count = 0;
+	int pass;
 
-		/* find key */
-		colon = strchr(p, ':');
-		if(!colon) {
-			break;
-		}
-		key_sz = colon - p;
-		key = calloc(key_sz + 1, 1);
-		memcpy(key, p, key_sz);
-		p = colon + 1;
-
-		/* find value */
-		nl = strchr(p, '\r');
-		if(!nl) {
-			free(key);
-			break;
+	for(pass = 0; pass < 2; ++pass) {
+		if(pass == 1) {
+			msg_pack_map(out, count);
 		}
-		val_sz = nl - p;
-		val = calloc(val_sz + 1, 1);
-		memcpy(val, p, val_sz);
-		p = nl + 1;
-		if(*p == '\n') p++;
+		for(p = s; p < end; ) {
+			const char *eol = memchr(p, '\n', end - p);
+			const char *line_end = eol ? eol : end;
+			const char *colon;
 
-		/* add to object */
-		msgpack_pack_raw(pk, key_sz);
-		msgpack_pack_raw_body(pk, key, key_sz);
-		msgpack_pack_raw(pk, val_sz);
-		msgpack_pack_raw_body(pk, val, val_sz);
-
-		free(key);
-		free(val);
+			if(line_end > p && line_end[-1] == '\r') {
+				line_end--;
+			}
+			colon = memchr(p, ':', line_end - p);
+			if(colon && *p != '#') {
+				if(pass == 0) {
+					count++;
+				} else {
+					msg_pack_raw(out, p, colon - p);
+					msg_pack_raw(out, colon + 1, line_end - colon - 1);
+				}
+			}
+			p = eol ? eol + 1 : end;
+		}
 	}
 }
 
 static void
-msg_hgetall_reply(msgpack_packer* pk, const redisReply *r) {
+msg_pack_element(struct msg_out *out, const redisReply *e);
+
+static void
+msg_hgetall_reply(struct msg_out *out, const redisReply *r) {
 
 	/* zip keys and values together in a msgpack object */
 
 	unsigned int i;
 
 	if(r->elements % 2 != 0) {
+		msg_pack_nil(out);
 		return;
 	}
 
-	msgpack_pack_map(pk, r->elements / 2);
+	msg_pack_map(out, r->elements / 2);
 	for(i = 0; i < r->elements; i += 2) {
-		redisReply *k = r->element[i], *v = r->element[i+1];
+		msg_pack_element(out, r->element[i]);	/* key */
+		msg_pack_element(out, r->element[i+1]);	/* value */
+	}
+}
 
-		/* keys and values need to be strings */
-		if(k->type != REDIS_REPLY_STRING || v->type != REDIS_REPLY_STRING) {
-			return;
-		}
+static void
+msg_pack_element(struct msg_out *out, const redisReply *e) {
 
-		/* key */
-		msgpack_pack_raw(pk, k->len);
-		msgpack_pack_raw_body(pk, k->str, k->len);
+	unsigned int i;
+
+	switch(e->type) {
+		case REDIS_REPLY_STRING:
+		case REDIS_REPLY_STATUS:
+		case REDIS_REPLY_VERB:
+		case REDIS_REPLY_BIGNUM: /* may not fit in 64 bits */
+			msg_pack_raw(out, e->str, e->len);
+			break;
+
+		case REDIS_REPLY_INTEGER:
+			msg_pack_int(out, e->integer);
+			break;
+
+		case REDIS_REPLY_DOUBLE:
+			msg_pack_double(out, e->dval);
+			break;
+
+		case REDIS_REPLY_BOOL:
+			msg_pack_bool(out, e->integer != 0);
+			break;
+
+		case REDIS_REPLY_ARRAY:
+		case REDIS_REPLY_SET:
+		case REDIS_REPLY_PUSH:
+			msg_pack_array(out, e->elements);
+			for(i = 0; i < e->elements; ++i) {
+				msg_pack_element(out, e->element[i]);
+			}
+			break;
 
-		/* value */
-		msgpack_pack_raw(pk, v->len);
-		msgpack_pack_raw_body(pk, v->str, v->len);
+		case REDIS_REPLY_MAP: /* hiredis stores keys and values in turn */
+			msg_pack_map(out, e->elements / 2);
+			for(i = 0; i + 1 < e->elements; i += 2) {
+				msg_pack_element(out, e->element[i]);
+				msg_pack_element(out, e->element[i+1]);
+			}
+			break;
+
+		default:
+			msg_pack_nil(out);
+			break;
 	}
 }
 
 static void
 msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *out, const redisReply *r) {
 
-	unsigned int i;
-	msgpack_packer* pk = msgpack_packer_new(out, (msgpack_packer_write)on_msgpack_write);
-
-	/* copy verb, as jansson only takes a char* but not its length. */
-	char *verb = "";
+	const char *verb = "";
 	size_t verb_sz = 0;
 	if(cmd->count) {
 		verb_sz = cmd->argv_len[0];
@@ -179,71 +324,42 @@ msgpack_wrap_redis_reply(const struct cmd *cmd, struct msg_out *out, const redis
 	}
 
 	/* Create map object */
-	msgpack_pack_map(pk, 1);
+	msg_pack_map(out, 1);
 
 	/* The single element is the verb */
-	msgpack_pack_raw(pk, verb_sz);
-	msgpack_pack_raw_body(pk, verb, verb_sz);
+	msg_pack_raw(out, verb, verb_sz);
 
 	switch(r->type) {
 		case REDIS_REPLY_STATUS:
 		case REDIS_REPLY_ERROR:
-			msgpack_pack_array(pk, 2);
+			msg_pack_array(out, 2);
 
-			/* first element: book */
-			if(r->type == REDIS_REPLY_ERROR)
-				msgpack_pack_false(pk);
-			else
-				msgpack_pack_true(pk);
+			/* first element: bool */
+			msg_pack_bool(out, r->type != REDIS_REPLY_ERROR);
 
 			/* second element: message */
-			msgpack_pack_raw(pk, r->len);
-			msgpack_pack_raw_body(pk, r->str, r->len);
+			msg_pack_raw(out, r->str, r->len);
 			break;
 
 		case REDIS_REPLY_STRING:
-			if(verb_sz ==4 && strncasecmp(verb, "INFO", 4) == 0) {
-				msg_info_reply(pk, r->str, r->len);
+		case REDIS_REPLY_VERB: /* INFO is a verbatim string in RESP3 */
+			if(verb_sz == 4 && strncasecmp(verb, "INFO", 4) == 0) {
+				msg_info_reply(out, r->str, r->len);
 			} else {
-				msgpack_pack_raw(pk, r->len);
-				msgpack_pack_raw_body(pk, r->str, r->len);
+				msg_pack_raw(out, r->str, r->len);
 			}
 			break;
 
-		case REDIS_REPLY_INTEGER:
-			msgpack_pack_int(pk, r->integer);
-			break;
-
 		case REDIS_REPLY_ARRAY:
 			if(verb_sz == 7 && strncasecmp(verb, "HGETALL", 7) == 0) {
-				msg_hgetall_reply(pk, r);
+				msg_hgetall_reply(out, r);
 				break;
 			}
-
-			msgpack_pack_array(pk, r->elements);
-
-			for(i = 0; i < r->elements; ++i) {
-				redisReply *e = r->element[i];
-				switch(e->type) {
-					case REDIS_REPLY_STRING:
-						msgpack_pack_raw(pk, e->len);
-						msgpack_pack_raw_body(pk, e->str, e->len);
-						break;
-					case REDIS_REPLY_INTEGER:
-						msgpack_pack_int(pk, e->integer);
-						break;
-					default:
-						msgpack_pack_nil(pk);
-						break;
-				}
-			}
-
+			msg_pack_element(out, r);
 			break;
 
 		default:
-			msgpack_pack_nil(pk);
+			msg_pack_element(out, r);
 			break;
 	}
-
-	msgpack_packer_free(pk);
 }
@@ -1,7 +1,6 @@
 #ifndef MSGPACK_H
 #define MSGPACK_H
 
-#include <msgpack.h>
 #include <hiredis/hiredis.h>
 #include <hiredis/async.h>
 
@@ -3,6 +3,9 @@
 #include "http.h"
 #include "client.h"
 #include "cmd.h"
+#include "offload.h"
+#include "fanout.h"
+#include "trace.h"
 
 #include <string.h>
 #include <hiredis/hiredis.h>
@@ -11,6 +14,12 @@
 static char *
 raw_wrap(const redisReply *r, size_t *sz);
 
+static char *
+raw_encode(const struct cmd *cmd, const redisReply *r, size_t *sz) {
+	(void)cmd;
+	return raw_wrap(r, sz);
+}
+
 void
 raw_reply(redisAsyncContext *c, void *r, void *privdata) {
 
@@ -20,45 +29,37 @@ raw_reply(redisAsyncContext *c, void *r, void *privdata) {
 	size_t sz;
 	(void)c;
 
+	TRACE_REPLY(cmd, reply);
 	if (reply == NULL) { /* broken Redis link */
 		format_send_error(cmd, 503, "Service Unavailable");
 		return;
 	}
 
-	raw_out = raw_wrap(r, &sz);
+	/* pub/sub messages are encoded once for all subscribers */
+	if(fanout_reply(cmd, reply, raw_encode, "binary/octet-stream")) {
+		return;
+	}
 
-	/* send reply */
-	format_send_reply(cmd, raw_out, sz, "binary/octet-stream");
+	/* large replies are formatted on a separate thread */
+	if(offload_reply(cmd, reply, raw_encode, "binary/octet-stream")) {
+		return;
+	}
+
+	raw_out = raw_wrap(r, &sz);
 
-	/* cleanup */
-	free(raw_out);
+	/* send reply, without copying it again */
+	format_send_owned(cmd, raw_out, sz, "binary/octet-stream");
 }
 
-/* extract Redis protocol string from WebSocket frame and fill struct cmd. */
-struct cmd *
-raw_ws_extract(struct http_client *c, const char *p, size_t sz) {
+/* fill a struct cmd from a command parsed by the client's reader */
+static struct cmd *
+raw_cmd_from_reply(struct http_client *c, const redisReply *reply) {
 
-	struct cmd *cmd = NULL;
-	void *reader = NULL;
-	redisReply *reply = NULL;
-	void **reply_ptr = (void**)&reply;
+	struct cmd *cmd;
 	unsigned int i;
-	(void)c;
 
-	/* create protocol reader */
-	reader = redisReaderCreate();
-
-	/* add data */
-	redisReaderFeed(reader, (char*)p, sz);
-
-	/* parse data into reply object */
-	if(redisReaderGetReply(reader, reply_ptr) == REDIS_ERR) {
-		goto end;
-	}
-
-	/* add data from reply object to cmd struct */
 	if(reply->type != REDIS_REPLY_ARRAY) {
-		goto end;
+		return NULL;
 	}
 
 	/* create cmd object */
@@ -82,23 +83,36 @@ raw_ws_extract(struct http_client *c, const char *p, size_t sz) {
 
 			default:
 				cmd_free(cmd);
-				cmd = NULL;
-				goto end;
+				return NULL;
 		}
 	}
+	return cmd;
+}
 
+/**
+ * Take the next command from data fed to a WebSocket client's reader.
+ * A frame can hold several commands, and a command can span several frames.
+ * Returns 1 and sets *out if a command was parsed, 0 if more data is needed,
+ * and -1 if the data is not a valid command.
+ */
+int
+raw_ws_next(struct http_client *c, redisReader *reader, struct cmd **out) {
 
-end:
-	/* free reader */
-	if(reader) redisReaderFree(reader);
+	redisReply *reply = NULL;
 
-	/* free reply */
-	if(reply) freeReplyObject(reply);
+	*out = NULL;
+	if(redisReaderGetReply(reader, (void**)&reply) == REDIS_ERR) {
+		return -1;
+	}
+	if(!reply) {
+		return 0;
+	}
 
-	return cmd;
+	*out = raw_cmd_from_reply(c, reply);
+	freeReplyObject(reply);
+	return *out ? 1 : -1;
 }
 
-
 static char *
 raw_array(const redisReply *r, size_t *sz) {
 
@@ -112,10 +126,14 @@ raw_array(const redisReply *r, size_t *sz) {
 		redisReply *e = r->element[i];
 		switch(e->type) {
 			case REDIS_REPLY_STRING:
+			case REDIS_REPLY_DOUBLE:
+			case REDIS_REPLY_BIGNUM:
+			case REDIS_REPLY_VERB:
 				*sz += 1 + integer_length(e->len) + 2
 					+ e->len + 2;
 				break;
 			case REDIS_REPLY_INTEGER:
+			case REDIS_REPLY_BOOL:
 				*sz += 1 + integer_length(integer_length(e->integer)) + 2
 					+ integer_length(e->integer) + 2;
 				break;
@@ -132,6 +150,9 @@ raw_array(const redisReply *r, size_t *sz) {
 		redisReply *e = r->element[i];
 		switch(e->type) {
 			case REDIS_REPLY_STRING:
+			case REDIS_REPLY_DOUBLE:
+			case REDIS_REPLY_BIGNUM:
+			case REDIS_REPLY_VERB:
 				p += sprintf(p, "$%zu\r\n", e->len);
 				memcpy(p, e->str, e->len);
 				p += e->len;
@@ -141,6 +162,7 @@ raw_array(const redisReply *r, size_t *sz) {
 				p++;
 				break;
 			case REDIS_REPLY_INTEGER:
+			case REDIS_REPLY_BOOL:
 				p += sprintf(p, "$%d\r\n%lld\r\n",
 					integer_length(e->integer), e->integer);
 				break;
@@ -165,7 +187,11 @@ raw_wrap(const redisReply *r, size_t *sz) {
 			memcpy(ret+*sz - 2, "\r\n", 2);
 			return ret;
 
+		/* RESP3 types are written in their RESP2 form, as Redis would send them */
 		case REDIS_REPLY_STRING:
+		case REDIS_REPLY_DOUBLE:
+		case REDIS_REPLY_BIGNUM:
+		case REDIS_REPLY_VERB:
 			*sz = 1 + integer_length(r->len) + 2 + r->len + 2;
 			p = ret = malloc(*sz);
 			p += sprintf(p, "$%zu\r\n", r->len);
@@ -174,12 +200,16 @@ raw_wrap(const redisReply *r, size_t *sz) {
 			return ret;
 
 		case REDIS_REPLY_INTEGER:
+		case REDIS_REPLY_BOOL:
 			*sz = 3 + integer_length(r->integer);
 			ret = malloc(4+*sz);
 			sprintf(ret, ":%lld\r\n", r->integer);
 			return ret;
 
 		case REDIS_REPLY_ARRAY:
+		case REDIS_REPLY_MAP: /* flattened, keys and values in turn */
+		case REDIS_REPLY_SET:
+		case REDIS_REPLY_PUSH:
 			return raw_array(r, sz);
 
 		default:
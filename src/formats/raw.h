@@ -10,8 +10,8 @@ struct http_client;
 void
 raw_reply(redisAsyncContext *c, void *r, void *privdata);
 
-struct cmd *
-raw_ws_extract(struct http_client *c, const char *p, size_t sz);
+int
+raw_ws_next(struct http_client *c, redisReader *reader, struct cmd **out);
 
 char*
 raw_ws_error(int http_status, const char *msg, size_t msg_sz, size_t *out_sz);
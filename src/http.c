@@ -2,13 +2,23 @@
 #include "server.h"
 #include "worker.h"
 #include "client.h"
+#include "cmd.h"
+#include "conf.h"
 #include "slog.h"
+#include "fanout.h"
+#include "access.h"
+#include "metrics.h"
+#include "trace.h"
 
 #include <string.h>
 #include <strings.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <stdio.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
 
 /* HTTP Response */
 
@@ -59,7 +69,7 @@ http_response_init(struct worker *w, int code, const char *msg) {
 	Access-Control-Allow-Headers cannot be a wildcard and must be set
 	with explicit names
 	*/
-	http_response_set_header(r, "Access-Control-Allow-Headers", "X-Requested-With, Content-Type, Authorization", HEADER_COPY_NONE);
+	http_response_set_header(r, "Access-Control-Allow-Headers", "X-Requested-With, Content-Type, Authorization, X-Server-Timing", HEADER_COPY_NONE);
 
 	return r;
 }
@@ -156,13 +166,30 @@ http_response_set_body(struct http_response *r, const char *body, size_t body_le
 	r->body_len = body_len;
 }
 
+/**
+ * Same as http_response_set_body, taking ownership of a malloc'd body
+ * that is then written from where it is, without a copy.
+ */
+void
+http_response_set_owned_body(struct http_response *r, char *body, size_t body_len) {
+
+	free(r->owned_body);
+	r->body = r->owned_body = body;
+	r->body_len = body_len;
+}
+
 static void
 http_response_cleanup(struct http_response *r, int fd, int success) {
 
 	int i;
 
+	if(r->access) {
+		access_log_response(r, success);
+	}
+
 	/* cleanup buffer */
 	free(r->out);
+	free(r->owned_body);
 	if((!r->keep_alive || !success) && fd > 0) {
 		/* Close fd is client doesn't support Keep-Alive. */
 		close(fd);
@@ -183,16 +210,37 @@ http_can_write(int fd, short event, void *p) {
 
 	int ret;
 	struct http_response *r = p;
+	size_t total = r->out_sz + (r->owned_body ? r->body_len : 0);
 
 	(void)event;
 
-	ret = write(fd, r->out + r->sent, r->out_sz - r->sent);
+	if(r->owned_body) { /* headers, then the body from its own buffer */
+		struct iovec iov[2];
+		int iovcnt = 0;
+		size_t sent = (size_t)r->sent;
+		if(sent < r->out_sz) {
+			iov[iovcnt].iov_base = r->out + sent;
+			iov[iovcnt++].iov_len = r->out_sz - sent;
+			sent = 0;
+		} else {
+			sent -= r->out_sz;
+		}
+		iov[iovcnt].iov_base = r->owned_body + sent;
+		iov[iovcnt++].iov_len = r->body_len - sent;
+		ret = writev(fd, iov, iovcnt);
+	} else {
+		ret = write(fd, r->out + r->sent, r->out_sz - r->sent);
+	}
+	if(ret > 0) {
+		metrics_add(METRICS_BYTES_OUT, (uint64_t)ret);
+	}
 
 	if(ret > 0)
 		r->sent += ret;
+	TRACE_WRITE(fd, ret, total - r->sent);
 
-	if(ret <= 0 || r->out_sz - r->sent == 0) { /* error or done */
-		http_response_cleanup(r, fd, (int)r->out_sz == r->sent ? 1 : 0);
+	if(ret <= 0 || total - r->sent == 0) { /* error or done */
+		http_response_cleanup(r, fd, (size_t)r->sent == total ? 1 : 0);
 	} else { /* reschedule write */
 		http_schedule_write(fd, r);
 	}
@@ -233,17 +281,15 @@ format_chunk(const char *p, size_t sz, size_t *out_sz) {
 	return out;
 }
 
-void
-http_response_write(struct http_response *r, int fd) {
+/**
+ * Build the status line, headers and body in r->out.
+ */
+static void
+http_response_serialize(struct http_response *r) {
 
 	char *p;
 	int i, ret;
 
-	if(fd < 0) { /* http_client was freed, which set the inflight cmd's fd to -1 */
-		http_response_cleanup(r, fd, 0); /* we would have done this after the write */
-		return;
-	}
-
 	r->out_sz = sizeof("HTTP/1.x xxx ")-1 + strlen(r->msg) + 2;
 	r->out = calloc(r->out_sz + 1, 1);
 
@@ -296,8 +342,8 @@ http_response_write(struct http_response *r, int fd) {
 	memcpy(r->out + r->out_sz, "\r\n", 2);
 	r->out_sz += 2;
 
-	/* append body if there is one. */
-	if(r->body && r->body_len) {
+	/* append body if there is one, unless it is written from its own buffer */
+	if(r->body && r->body_len && !(r->owned_body && !r->chunked)) {
 
 		char *tmp = (char*)r->body;
 		size_t tmp_len = r->body_len;
@@ -313,6 +359,18 @@ http_response_write(struct http_response *r, int fd) {
 			free(tmp);
 		}
 	}
+}
+
+void
+http_response_write(struct http_response *r, int fd) {
+
+	if(fd < 0) { /* http_client was freed, which set the inflight cmd's fd to -1 */
+		http_response_cleanup(r, fd, 0); /* we would have done this after the write */
+		return;
+	}
+
+	http_response_serialize(r);
+	metrics_status(r->code);
 
 	/* send buffer to client */
 	r->sent = 0;
@@ -342,6 +400,7 @@ http_crossdomain(struct http_client *c) {
 	http_response_set_header(resp, "Content-Type", "application/xml", HEADER_COPY_NONE);
 	http_response_set_body(resp, out, sizeof(out)-1);
 
+	access_attach_client(resp, c);
 	http_response_write(resp, c->fd);
 	http_client_reset(c);
 }
@@ -355,6 +414,7 @@ http_send_error(struct http_client *c, short code, const char *msg) {
 	http_response_set_connection_header(c, resp);
 	http_response_set_body(resp, NULL, 0);
 
+	access_attach_client(resp, c);
 	http_response_write(resp, c->fd);
 	http_client_reset(c);
 }
@@ -383,23 +443,364 @@ http_send_options(struct http_client *c) {
 	http_response_set_header(resp, "Content-Type", "text/html", HEADER_COPY_NONE);
 	http_response_set_header(resp, "Content-Length", "0", HEADER_COPY_NONE);
 
+	access_attach_client(resp, c);
 	http_response_write(resp, c->fd);
 	http_client_reset(c);
 }
 
+/* Streamed responses (chunked pub/sub replies)
+ *
+ * Each stream has a single buffer and write event, so chunks are sent in
+ * order even if the socket is slow, and all the chunks queued since the last
+ * write are sent together in one writev call. Chunk headers are appended
+ * directly to the buffer instead of allocating a response for each chunk.
+ *
+ * The size of each queued message is recorded so that whole chunks can be
+ * discarded when the client falls too far behind, see conf.h for the limits.
+ */
+
+struct http_stream *
+http_stream_new(struct cmd *cmd) {
+
+	struct http_stream *s = calloc(1, sizeof(struct http_stream));
+	size_t desc_sz = 0;
+	int i;
+
+	if(!s) {
+		return NULL;
+	}
+	if(!(s->buf = evbuffer_new())) {
+		free(s);
+		return NULL;
+	}
+	s->w = cmd->w;
+	s->fd = cmd->fd;
+	s->can_drop = (cmd->zstream == NULL); /* compressed chunks depend on the previous ones */
+	s->addr = cmd->http_client ? cmd->http_client->addr : 0;
+	s->started = time(NULL);
+
+	/* "SUBSCRIBE chan1 chan2", truncated */
+	for(i = 0; i < cmd->count && desc_sz + 1 < sizeof(s->desc); ++i) {
+		size_t sz = cmd->argv_len[i];
+		if(i) s->desc[desc_sz++] = ' ';
+		if(sz > sizeof(s->desc) - 1 - desc_sz) {
+			sz = sizeof(s->desc) - 1 - desc_sz;
+		}
+		memcpy(s->desc + desc_sz, cmd->argv[i], sz);
+		desc_sz += sz;
+	}
+	s->desc[desc_sz] = 0;
+
+	pthread_mutex_lock(&s->w->streams_lock);
+	LIST_INSERT_HEAD(&s->w->streams, s, entries);
+	pthread_mutex_unlock(&s->w->streams_lock);
+	return s;
+}
+
+static size_t *
+http_stream_msg(struct http_stream *s, unsigned int i) {
+
+	return &s->msg_sz[(s->msg_head + i) & (s->msg_alloc - 1)];
+}
+
+static int
+http_stream_msg_push(struct http_stream *s, size_t sz) {
+
+	if(s->msg_count == s->msg_alloc) {
+		unsigned int alloc = s->msg_alloc ? 2 * s->msg_alloc : 16;
+		size_t *msg_sz = malloc(alloc * sizeof(size_t));
+		unsigned int i;
+		if(!msg_sz) {
+			return -1;
+		}
+		for(i = 0; i < s->msg_count; ++i) { /* unwrap the ring */
+			msg_sz[i] = *http_stream_msg(s, i);
+		}
+		free(s->msg_sz);
+		s->msg_sz = msg_sz;
+		s->msg_head = 0;
+		s->msg_alloc = alloc;
+	}
+	*http_stream_msg(s, s->msg_count++) = sz;
+	return 0;
+}
+
+static void
+http_stream_msg_pop(struct http_stream *s) {
+
+	s->msg_head = (s->msg_head + 1) & (s->msg_alloc - 1);
+	s->msg_count--;
+	s->headers_queued = 0;
+}
+
+/* with the lock held */
+static void
+http_stream_update_stats(struct http_stream *s) {
+
+	s->stats.queued_bytes = evbuffer_get_length(s->buf);
+	s->stats.queued_messages = s->msg_count;
+}
+
 /**
- * Write HTTP chunk.
+ * Stop sending data, the client's read event cleans up.
+ */
+static void
+http_stream_close(struct http_stream *s) {
+
+	evbuffer_drain(s->buf, evbuffer_get_length(s->buf));
+	s->msg_count = 0;
+	s->msg_written = 0;
+	if(s->fd >= 0) {
+		shutdown(s->fd, SHUT_RDWR);
+		s->fd = -1;
+	}
+}
+
+/**
+ * Remove the oldest message that hasn't started being sent.
+ * Returns -1 if there is none.
+ */
+static int
+http_stream_drop_oldest(struct http_stream *s) {
+
+	/* messages that can't be removed at the front of the queue */
+	unsigned int keep = (s->msg_written || s->headers_queued) ? 1 : 0;
+	size_t keep_sz, sz;
+
+	if(s->msg_count <= keep) {
+		return -1;
+	}
+	sz = *http_stream_msg(s, keep);
+
+	if(keep) {
+		/* set aside what's left of the first message, drop the next one */
+		struct evbuffer *front = evbuffer_new();
+		if(!front) {
+			return -1;
+		}
+		keep_sz = *http_stream_msg(s, 0) - s->msg_written;
+		evbuffer_remove_buffer(s->buf, front, keep_sz);
+		evbuffer_drain(s->buf, sz);
+		evbuffer_prepend_buffer(s->buf, front);
+		evbuffer_free(front);
+
+		*http_stream_msg(s, 1) = *http_stream_msg(s, 0);
+		s->msg_head = (s->msg_head + 1) & (s->msg_alloc - 1);
+		s->msg_count--;
+	} else {
+		evbuffer_drain(s->buf, sz);
+		http_stream_msg_pop(s);
+	}
+	return 0;
+}
+
+/**
+ * Apply the overflow policy before queuing a message of `sz` bytes.
+ * Returns 1 if the message should be discarded.
+ */
+static int
+http_stream_overflow(struct http_stream *s, size_t sz) {
+
+	struct conf *cfg = s->w->s->cfg;
+	size_t max_bytes = cfg->sub_queue.max_bytes;
+	unsigned int max_messages = cfg->sub_queue.max_messages;
+	sub_overflow_policy policy = cfg->sub_queue.policy;
+	unsigned long dropped = 0;
+	int ret = 0;
+
+#define HTTP_STREAM_FULL() ((max_bytes && evbuffer_get_length(s->buf) + sz > max_bytes) \
+		|| (max_messages && s->msg_count + 1 > max_messages))
+
+	if(s->fd < 0 || !HTTP_STREAM_FULL()) {
+		return 0;
+	}
+
+	if(!s->can_drop) { /* skipping data would break the compressed stream */
+		policy = SUB_OVERFLOW_DISCONNECT;
+	}
+
+	switch(policy) {
+		case SUB_OVERFLOW_DROP_OLDEST:
+			/* the new message is queued even if it's larger than the limit on its own */
+			while(HTTP_STREAM_FULL() && http_stream_drop_oldest(s) == 0) {
+				dropped++;
+			}
+			break;
+
+		case SUB_OVERFLOW_DROP_NEWEST:
+			ret = 1;
+			break;
+
+		case SUB_OVERFLOW_DISCONNECT:
+			slog(s->w->s, WEBDIS_DEBUG, "HTTP subscriber over its queue limit, disconnecting", 0);
+			http_stream_close(s);
+			ret = 1;
+			break;
+	}
+#undef HTTP_STREAM_FULL
+
+	pthread_mutex_lock(&s->w->streams_lock);
+	if(policy == SUB_OVERFLOW_DROP_OLDEST) {
+		s->w->sub_overflow.dropped_oldest += dropped;
+		s->stats.dropped += dropped;
+	} else if(policy == SUB_OVERFLOW_DROP_NEWEST) {
+		s->w->sub_overflow.dropped_newest++;
+		s->stats.dropped++;
+	} else {
+		s->w->sub_overflow.disconnected++;
+	}
+	http_stream_update_stats(s);
+	pthread_mutex_unlock(&s->w->streams_lock);
+
+	return ret;
+}
+
+static void
+http_stream_can_write(int fd, short event, void *p) {
+
+	struct http_stream *s = p;
+	int ret;
+	(void)event;
+
+	s->scheduled = 0;
+	ret = evbuffer_write(s->buf, fd);
+	TRACE_WRITE(fd, ret, evbuffer_get_length(s->buf));
+	if(ret < 0 && errno != EAGAIN && errno != EINTR) {
+		/* broken link, let the client's read event clean up */
+		http_stream_close(s);
+	} else if(ret > 0) {
+		/* forget about the messages that were fully sent */
+		s->msg_written += (size_t)ret;
+		while(s->msg_count && s->msg_written >= *http_stream_msg(s, 0)) {
+			s->msg_written -= *http_stream_msg(s, 0);
+			http_stream_msg_pop(s);
+		}
+	}
+
+	pthread_mutex_lock(&s->w->streams_lock);
+	if(ret > 0) {
+		s->stats.sent_bytes += (size_t)ret;
+		metrics_add(METRICS_BYTES_OUT, (uint64_t)ret);
+	}
+	http_stream_update_stats(s);
+	pthread_mutex_unlock(&s->w->streams_lock);
+
+	if(s->fd >= 0 && evbuffer_get_length(s->buf) > 0) {
+		s->scheduled = 1;
+		event_add(&s->ev, NULL);
+	}
+}
+
+/**
+ * Record a message that was just added to the buffer, and send it.
+ */
+static void
+http_stream_queued(struct http_stream *s, size_t sz) {
+
+	if(s->fd < 0) { /* nobody to send it to */
+		evbuffer_drain(s->buf, evbuffer_get_length(s->buf));
+		return;
+	}
+	if(http_stream_msg_push(s, sz) < 0) {
+		slog(s->w->s, WEBDIS_ERROR, "Out of memory queuing HTTP chunk", 0);
+		http_stream_close(s);
+		return;
+	}
+
+	pthread_mutex_lock(&s->w->streams_lock);
+	http_stream_update_stats(s);
+	pthread_mutex_unlock(&s->w->streams_lock);
+
+	if(!s->scheduled) {
+		s->scheduled = 1;
+		event_assign(&s->ev, s->w->base, s->fd, EV_WRITE, http_stream_can_write, s);
+		if(event_add(&s->ev, NULL) != 0) {
+			slog(s->w->s, WEBDIS_ERROR, "Could not schedule HTTP write", 0);
+			s->scheduled = 0;
+		}
+	}
+}
+
+/**
+ * Queue a full response, typically the headers and first chunk.
+ * Takes ownership of the response object.
  */
 void
-http_response_write_chunk(int fd, struct worker *w, const char *p, size_t sz) {
+http_stream_write_response(struct http_stream *s, struct http_response *r) {
 
-	struct http_response *r = http_response_init(w, 0, NULL);
-	r->keep_alive = 1; /* chunks are always keep-alive */
+	size_t sz;
 
-	/* format packet */
-	r->out = format_chunk(p, sz, &r->out_sz);
+	http_response_serialize(r);
+	metrics_status(r->code);
 
-	/* send async write */
-	http_schedule_write(fd, r);
+	sz = r->out_sz;
+	evbuffer_add(s->buf, r->out, r->out_sz);
+	if(r->owned_body && !r->chunked && r->body_len) {
+		evbuffer_add(s->buf, r->owned_body, r->body_len);
+		sz += r->body_len;
+	}
+	http_stream_queued(s, sz);
+	s->headers_queued = (s->msg_count == 1);
+	http_response_cleanup(r, -1, 1); /* keeps the connection open */
+}
+
+static size_t
+http_stream_chunk_header(struct http_stream *s, size_t sz) {
+
+	char hdr[20];
+	int hdr_sz = snprintf(hdr, sizeof(hdr), "%zx\r\n", sz);
+	evbuffer_add(s->buf, hdr, hdr_sz);
+	return (size_t)hdr_sz;
+}
+
+/* upper bound of the chunk header and trailer */
+#define HTTP_CHUNK_OVERHEAD 20
+
+void
+http_stream_write_chunk(struct http_stream *s, const char *p, size_t sz) {
+
+	size_t hdr_sz;
+
+	if(http_stream_overflow(s, sz + HTTP_CHUNK_OVERHEAD)) {
+		return;
+	}
+	hdr_sz = http_stream_chunk_header(s, sz);
+	evbuffer_add(s->buf, p, sz);
+	evbuffer_add(s->buf, "\r\n", 2);
+	http_stream_queued(s, hdr_sz + sz + 2);
 }
 
+/**
+ * Same as http_stream_write_chunk, with a body shared between several streams.
+ */
+void
+http_stream_write_shared(struct http_stream *s, struct fanout_buf *fb) {
+
+	size_t hdr_sz;
+
+	if(http_stream_overflow(s, fb->sz + HTTP_CHUNK_OVERHEAD)) {
+		return;
+	}
+	hdr_sz = http_stream_chunk_header(s, fb->sz);
+	if(fanout_buf_add(s->buf, fb) < 0) {
+		evbuffer_add(s->buf, fb->data, fb->sz);
+	}
+	evbuffer_add(s->buf, "\r\n", 2);
+	http_stream_queued(s, hdr_sz + fb->sz + 2);
+}
+
+void
+http_stream_free(struct http_stream *s) {
+
+	if(!s) return;
+	if(s->scheduled) {
+		event_del(&s->ev);
+	}
+	pthread_mutex_lock(&s->w->streams_lock);
+	LIST_REMOVE(s, entries);
+	pthread_mutex_unlock(&s->w->streams_lock);
+
+	evbuffer_free(s->buf);
+	free(s->msg_sz);
+	free(s);
+}
@@ -2,10 +2,15 @@
 #define HTTP_H
 
 #include <sys/types.h>
+#include <sys/queue.h>
+#include <arpa/inet.h>
+#include <time.h>
 #include <event.h>
 
 struct http_client;
 struct worker;
+struct fanout_buf;
+struct cmd;
 
 /* bit flags */
 typedef enum {
@@ -39,6 +44,7 @@ struct http_response {
 
 	const char *body;
 	size_t body_len;
+	char *owned_body; /* written after `out` rather than copied into it, then freed */
 
 	char *out;
 	size_t out_sz;
@@ -49,6 +55,37 @@ struct http_response {
 	int sent;
 
 	struct worker *w;
+	struct access_entry *access; /* logged once sent, see access.c */
+};
+
+/* output queue for a streamed response, sent in order with as few writes as possible */
+struct http_stream {
+	struct event ev;
+	struct evbuffer *buf;
+	int fd;
+	int scheduled; /* set if a write event is pending */
+	struct worker *w;
+
+	/* size of each queued message in buf, oldest first */
+	size_t *msg_sz;
+	unsigned int msg_head;
+	unsigned int msg_count;
+	unsigned int msg_alloc;   /* power of 2 */
+	size_t msg_written;       /* bytes of the oldest message already sent */
+	int headers_queued;       /* the oldest message holds the response headers */
+	int can_drop;             /* unset if skipping a message would corrupt the stream */
+
+	/* listed by WEBDIS.SUBSCRIBERS, updated with the worker's streams_lock held */
+	LIST_ENTRY(http_stream) entries;
+	in_addr_t addr;
+	char desc[128];           /* command and channels */
+	time_t started;
+	struct {
+		size_t queued_bytes;
+		unsigned int queued_messages;
+		unsigned long long sent_bytes;
+		unsigned long dropped;
+	} stats;
 };
 
 /* HTTP response */
@@ -65,6 +102,9 @@ http_response_set_header(struct http_response *r, const char *k, const char *v,
 void
 http_response_set_body(struct http_response *r, const char *body, size_t body_len);
 
+void
+http_response_set_owned_body(struct http_response *r, char *body, size_t body_len);
+
 void
 http_response_write(struct http_response *r, int fd);
 
@@ -80,8 +120,20 @@ http_send_error(struct http_client *c, short code, const char *msg);
 void
 http_send_options(struct http_client *c);
 
+struct http_stream *
+http_stream_new(struct cmd *cmd);
+
+void
+http_stream_write_response(struct http_stream *s, struct http_response *r);
+
+void
+http_stream_write_chunk(struct http_stream *s, const char *p, size_t sz);
+
+void
+http_stream_write_shared(struct http_stream *s, struct fanout_buf *fb);
+
 void
-http_response_write_chunk(int fd, struct worker *w, const char *p, size_t sz);
+http_stream_free(struct http_stream *s);
 
 void
 http_response_set_keep_alive(struct http_response *r, int enabled);
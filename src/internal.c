@@ -0,0 +1,360 @@
+#include "internal.h"
+#include "server.h"
+#include "worker.h"
+#include "http.h"
+#include "conf.h"
+#include "metrics.h"
+#include "slowlog.h"
+
+#include <hiredis/hiredis.h>
+#include <hiredis/alloc.h>
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Replies are built like the ones hiredis returns, so that the formatting
+ * functions can process them (and steal their contents) in the same way. */
+
+static redisReply *
+internal_reply_new(int type) {
+
+	redisReply *r = hi_calloc(1, sizeof(redisReply));
+	if(r) {
+		r->type = type;
+	}
+	return r;
+}
+
+static redisReply *
+internal_reply_str(int type, const char *p, size_t sz) {
+
+	redisReply *r = internal_reply_new(type);
+	if(r && !(r->str = hi_malloc(sz + 1))) {
+		hi_free(r);
+		return NULL;
+	}
+	if(r) {
+		memcpy(r->str, p, sz);
+		r->str[sz] = 0;
+		r->len = sz;
+	}
+	return r;
+}
+
+static redisReply *
+internal_reply_int(long long val) {
+
+	redisReply *r = internal_reply_new(REDIS_REPLY_INTEGER);
+	if(r) {
+		r->integer = val;
+	}
+	return r;
+}
+
+/* takes ownership of the child, even on failure */
+static void
+internal_reply_append(redisReply *parent, redisReply *child) {
+
+	redisReply **element;
+
+	if(!child) {
+		return;
+	}
+	if(!(element = hi_realloc(parent->element, (parent->elements + 1) * sizeof(redisReply*)))) {
+		freeReplyObject(child);
+		return;
+	}
+	parent->element = element;
+	parent->element[parent->elements++] = child;
+}
+
+static void
+internal_map_add(redisReply *map, const char *key, redisReply *val) {
+
+	if(!val) {
+		return;
+	}
+	internal_reply_append(map, internal_reply_str(REDIS_REPLY_STRING, key, strlen(key)));
+	internal_reply_append(map, val);
+}
+
+static redisReply *
+internal_error(const char *msg) {
+
+	return internal_reply_str(REDIS_REPLY_ERROR, msg, strlen(msg));
+}
+
+/* WEBDIS.SUBSCRIBERS [count]: HTTP subscribers with the most queued data */
+
+struct subscriber_info {
+	in_addr_t addr;
+	char desc[sizeof(((struct http_stream*)0)->desc)];
+	time_t started;
+	size_t queued_bytes;
+	unsigned int queued_messages;
+	unsigned long long sent_bytes;
+	unsigned long dropped;
+};
+
+static int
+internal_cmp_subscribers(const void *a, const void *b) {
+
+	const struct subscriber_info *sa = a, *sb = b;
+
+	if(sa->queued_bytes != sb->queued_bytes) {
+		return sa->queued_bytes < sb->queued_bytes ? 1 : -1;
+	}
+	if(sa->dropped != sb->dropped) {
+		return sa->dropped < sb->dropped ? 1 : -1;
+	}
+	return 0;
+}
+
+static redisReply *
+internal_subscribers(struct cmd *cmd) {
+
+	struct server *s = cmd->w->s;
+	struct subscriber_info *subs = NULL;
+	size_t count = 0, alloc = 0, i;
+	unsigned long dropped_oldest = 0, dropped_newest = 0, disconnected = 0;
+	long limit = 10;
+	time_t now = time(NULL);
+	redisReply *r, *list;
+	int n;
+
+	if(cmd->count > 2) {
+		return internal_error("ERR wrong number of arguments for 'WEBDIS.SUBSCRIBERS'");
+	}
+	if(cmd->count == 2) {
+		char buf[24];
+		char *end;
+		size_t sz = cmd->argv_len[1] < sizeof(buf) - 1 ? cmd->argv_len[1] : sizeof(buf) - 1;
+		memcpy(buf, cmd->argv[1], sz);
+		buf[sz] = 0;
+		limit = strtol(buf, &end, 10);
+		if(sz == 0 || *end || limit < 0) {
+			return internal_error("ERR value is not a positive integer");
+		}
+	}
+
+	/* copy what we need from each worker, without holding the locks for long */
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct worker *w = s->w[n];
+		struct http_stream *st;
+
+		pthread_mutex_lock(&w->streams_lock);
+		dropped_oldest += w->sub_overflow.dropped_oldest;
+		dropped_newest += w->sub_overflow.dropped_newest;
+		disconnected += w->sub_overflow.disconnected;
+		LIST_FOREACH(st, &w->streams, entries) {
+			struct subscriber_info *si;
+			if(count == alloc) {
+				size_t new_alloc = alloc ? 2 * alloc : 64;
+				struct subscriber_info *tmp = realloc(subs, new_alloc * sizeof(struct subscriber_info));
+				if(!tmp) {
+					break;
+				}
+				subs = tmp;
+				alloc = new_alloc;
+			}
+			si = &subs[count++];
+			si->addr = st->addr;
+			memcpy(si->desc, st->desc, sizeof(si->desc));
+			si->started = st->started;
+			si->queued_bytes = st->stats.queued_bytes;
+			si->queued_messages = st->stats.queued_messages;
+			si->sent_bytes = st->stats.sent_bytes;
+			si->dropped = st->stats.dropped;
+		}
+		pthread_mutex_unlock(&w->streams_lock);
+	}
+	if(count > 1) {
+		qsort(subs, count, sizeof(struct subscriber_info), internal_cmp_subscribers);
+	}
+
+	if(!(r = internal_reply_new(REDIS_REPLY_MAP)) || !(list = internal_reply_new(REDIS_REPLY_ARRAY))) {
+		freeReplyObject(r);
+		free(subs);
+		return NULL;
+	}
+	for(i = 0; i < count && i < (size_t)limit; ++i) {
+		struct in_addr a;
+		char ip[INET_ADDRSTRLEN] = "";
+		redisReply *e = internal_reply_new(REDIS_REPLY_MAP);
+		if(!e) {
+			break;
+		}
+		a.s_addr = subs[i].addr;
+		inet_ntop(AF_INET, &a, ip, sizeof(ip));
+		internal_map_add(e, "address", internal_reply_str(REDIS_REPLY_STRING, ip, strlen(ip)));
+		internal_map_add(e, "command", internal_reply_str(REDIS_REPLY_STRING, subs[i].desc, strlen(subs[i].desc)));
+		internal_map_add(e, "age", internal_reply_int((long long)(now - subs[i].started)));
+		internal_map_add(e, "queued_bytes", internal_reply_int((long long)subs[i].queued_bytes));
+		internal_map_add(e, "queued_messages", internal_reply_int((long long)subs[i].queued_messages));
+		internal_map_add(e, "sent_bytes", internal_reply_int((long long)subs[i].sent_bytes));
+		internal_map_add(e, "dropped", internal_reply_int((long long)subs[i].dropped));
+		internal_reply_append(list, e);
+	}
+
+	internal_map_add(r, "subscribers", internal_reply_int((long long)count));
+	internal_map_add(r, "dropped_oldest", internal_reply_int((long long)dropped_oldest));
+	internal_map_add(r, "dropped_newest", internal_reply_int((long long)dropped_newest));
+	internal_map_add(r, "disconnected", internal_reply_int((long long)disconnected));
+	internal_map_add(r, "slowest", list);
+
+	free(subs);
+	return r;
+}
+
+/* WEBDIS.METRICS: counters and latencies in the Prometheus text format */
+
+static redisReply *
+internal_metrics(struct cmd *cmd) {
+
+	redisReply *r;
+	char *text;
+	size_t sz;
+
+	if(cmd->count != 1) {
+		return internal_error("ERR wrong number of arguments for 'WEBDIS.METRICS'");
+	}
+	if(!cmd->w->s->cfg->metrics.enabled) {
+		return internal_error("ERR metrics are disabled");
+	}
+	if(!(text = metrics_format(cmd->w->s, &sz))) {
+		return NULL;
+	}
+	r = internal_reply_str(REDIS_REPLY_STRING, text, sz);
+	free(text);
+	return r;
+}
+
+/* WEBDIS.SLOWLOG GET [count] | LEN | RESET: requests slower than slowlog.slower_than_us */
+
+static int
+internal_arg_is(const struct cmd *cmd, int i, const char *s) {
+
+	return cmd->argv_len[i] == strlen(s) && strncasecmp(cmd->argv[i], s, cmd->argv_len[i]) == 0;
+}
+
+static redisReply *
+internal_slowlog_entry(const struct slowlog_entry *e) {
+
+	redisReply *m = internal_reply_new(REDIS_REPLY_MAP), *argv;
+	char ip[INET_ADDRSTRLEN] = "";
+	struct in_addr a;
+	const char *p = e->args;
+	unsigned int i;
+
+	if(!m) {
+		return NULL;
+	}
+	if((argv = internal_reply_new(REDIS_REPLY_ARRAY))) {
+		for(i = 0; i < e->argc; p += e->argv_len[i], ++i) {
+			internal_reply_append(argv, internal_reply_str(REDIS_REPLY_STRING, p, e->argv_len[i]));
+		}
+	}
+	a.s_addr = e->addr;
+	inet_ntop(AF_INET, &a, ip, sizeof(ip));
+
+	internal_map_add(m, "id", internal_reply_int((long long)e->id));
+	internal_map_add(m, "time", internal_reply_int((long long)e->time));
+	internal_map_add(m, "duration_us", internal_reply_int((long long)e->total_us));
+	internal_map_add(m, "parse_us", internal_reply_int((long long)e->parse_us));
+	internal_map_add(m, "redis_us", internal_reply_int((long long)e->redis_us));
+	internal_map_add(m, "format_us", internal_reply_int((long long)e->format_us));
+	internal_map_add(m, "command", argv);
+	internal_map_add(m, "database", internal_reply_int((long long)e->db));
+	internal_map_add(m, "address", internal_reply_str(REDIS_REPLY_STRING, ip, strlen(ip)));
+	internal_map_add(m, "reply_bytes", internal_reply_int((long long)e->reply_size));
+	return m;
+}
+
+static redisReply *
+internal_slowlog(struct cmd *cmd) {
+
+	struct server *s = cmd->w->s;
+	struct slowlog_entry *entries;
+	redisReply *r;
+	size_t count, i;
+	long limit = 10;
+
+	if(cmd->count == 2 && internal_arg_is(cmd, 1, "LEN")) {
+		return internal_reply_int((long long)slowlog_len(s));
+	}
+	if(cmd->count == 2 && internal_arg_is(cmd, 1, "RESET")) {
+		slowlog_reset(s);
+		return internal_reply_str(REDIS_REPLY_STATUS, "OK", 2);
+	}
+	if(cmd->count < 2 || cmd->count > 3 || !internal_arg_is(cmd, 1, "GET")) {
+		return internal_error("ERR unknown subcommand or wrong number of arguments for 'WEBDIS.SLOWLOG'");
+	}
+	if(cmd->count == 3) {
+		char buf[24];
+		char *end;
+		size_t sz = cmd->argv_len[2] < sizeof(buf) - 1 ? cmd->argv_len[2] : sizeof(buf) - 1;
+		memcpy(buf, cmd->argv[2], sz);
+		buf[sz] = 0;
+		limit = strtol(buf, &end, 10);
+		if(sz == 0 || *end || limit < -1) {
+			return internal_error("ERR count should be greater than or equal to -1");
+		}
+	}
+
+	if(!(r = internal_reply_new(REDIS_REPLY_ARRAY))) {
+		return NULL;
+	}
+	count = slowlog_copy(s, &entries);
+	for(i = 0; i < count && (limit < 0 || i < (size_t)limit); ++i) { /* -1 for all of them */
+		internal_reply_append(r, internal_slowlog_entry(&entries[i]));
+	}
+	slowlog_free_entries(entries, count);
+	return r;
+}
+
+static const struct {
+	const char *name;
+	redisReply *(*fun)(struct cmd *cmd);
+} internal_commands[] = {
+	{"WEBDIS.SUBSCRIBERS", internal_subscribers},
+	{"WEBDIS.METRICS", internal_metrics},
+	{"WEBDIS.SLOWLOG", internal_slowlog},
+};
+
+static int
+internal_find(const struct cmd *cmd) {
+
+	unsigned int i;
+
+	if(cmd->count == 0 || cmd->argv_len[0] < 7 || strncasecmp(cmd->argv[0], "WEBDIS.", 7) != 0) {
+		return -1;
+	}
+	for(i = 0; i < sizeof(internal_commands) / sizeof(internal_commands[0]); ++i) {
+		if(strlen(internal_commands[i].name) == cmd->argv_len[0]
+				&& strncasecmp(cmd->argv[0], internal_commands[i].name, cmd->argv_len[0]) == 0) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+int
+internal_is_command(const struct cmd *cmd) {
+
+	return internal_find(cmd) >= 0;
+}
+
+/**
+ * Run a WEBDIS.* command and send its reply with the usual formatting function.
+ */
+void
+internal_run(struct cmd *cmd, formatting_fun f_format) {
+
+	int i = internal_find(cmd);
+	redisReply *r = i < 0 ? internal_error("ERR unknown command") : internal_commands[i].fun(cmd);
+
+	cmd_timing_reply(cmd);
+	f_format(NULL, r, cmd); /* sends a 503 if r is NULL */
+	freeReplyObject(r);
+}
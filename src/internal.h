@@ -0,0 +1,15 @@
+#ifndef INTERNAL_H
+#define INTERNAL_H
+
+#include "cmd.h"
+
+/* Commands named WEBDIS.* are handled by Webdis itself instead of being sent
+ * to Redis. They go through the same ACLs and output formats as Redis commands. */
+
+int
+internal_is_command(const struct cmd *cmd);
+
+void
+internal_run(struct cmd *cmd, formatting_fun f_format);
+
+#endif
@@ -0,0 +1,472 @@
+#include "metrics.h"
+#include "server.h"
+#include "worker.h"
+#include "conf.h"
+#include "slog.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <pthread.h>
+
+/* Metrics
+ *
+ * Each worker counts what it does in its own struct metrics, found from a
+ * thread-local pointer like the log rings. Only the worker writes to it, with
+ * relaxed atomic stores and no locks; WEBDIS.METRICS reads all of them from
+ * any thread and adds them up, in the Prometheus text format.
+ *
+ * Command latencies go to a histogram per command name, with two buckets per
+ * power of two from 1 us to 67 s. The first 96 names seen by a worker get a
+ * histogram of their own, later ones are counted as "other". The stall
+ * detector adds a histogram of the event loop lag, per worker.
+ */
+
+#define METRICS_SLOTS 128        /* command histograms per worker, a power of 2 */
+#define METRICS_SLOTS_USED 96    /* named ones, at most */
+#define METRICS_NAME_MAX_LEN 31
+#define METRICS_BOUNDS 52        /* bucket upper bounds, then one for larger values */
+#define METRICS_BUCKETS (METRICS_BOUNDS + 1)
+#define METRICS_STATUS_MAX 600
+
+struct metrics_histogram {
+	int used; /* set once name is written, then never changes */
+	char name[METRICS_NAME_MAX_LEN + 1];
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics {
+	uint64_t counters[METRICS_COUNTER_COUNT];
+	uint64_t status[METRICS_STATUS_MAX]; /* by HTTP status code */
+
+	unsigned int named; /* histograms in use, only read by the worker */
+	struct metrics_histogram other;
+	struct metrics_histogram commands[METRICS_SLOTS];
+
+	struct metrics_histogram loop_lag; /* from the stall detector */
+};
+
+/* metrics of the current thread, NULL outside of workers or if disabled */
+static __thread struct metrics *metrics_current = NULL;
+
+/* single writer: no need for an atomic read-modify-write */
+static void
+metrics_inc(uint64_t *p, uint64_t n) {
+	__atomic_store_n(p, __atomic_load_n(p, __ATOMIC_RELAXED) + n, __ATOMIC_RELAXED);
+}
+
+static uint64_t
+metrics_load(const uint64_t *p) {
+	return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+struct metrics *
+metrics_new(void) {
+
+	return calloc(1, sizeof(struct metrics));
+}
+
+/**
+ * Count what the current thread does in these metrics.
+ */
+void
+metrics_bind(struct metrics *m) {
+
+	metrics_current = m;
+}
+
+void
+metrics_add(metrics_counter c, uint64_t n) {
+
+	if(metrics_current) {
+		metrics_inc(&metrics_current->counters[c], n);
+	}
+}
+
+void
+metrics_status(int code) {
+
+	if(metrics_current && code >= 0 && code < METRICS_STATUS_MAX) {
+		metrics_inc(&metrics_current->status[code], 1);
+	}
+}
+
+/* index of the bucket for a value: 1, 2, 3, 4, 6, 8, 12, 16, 24, 32... */
+static unsigned int
+metrics_bucket(uint64_t us) {
+
+	unsigned int e, i;
+
+	if(us <= 4) {
+		return us ? (unsigned int)us - 1 : 0;
+	}
+	e = 63 - (unsigned int)__builtin_clzll(us - 1); /* 2^e < us <= 2^(e+1) */
+	i = 4 + (e - 2) * 2 + (us > (3ULL << (e - 1)) ? 1 : 0);
+	return i < METRICS_BOUNDS ? i : METRICS_BOUNDS;
+}
+
+/* upper bound of a bucket, in microseconds */
+static uint64_t
+metrics_bound(unsigned int i) {
+
+	unsigned int e;
+
+	if(i < 4) {
+		return i + 1;
+	}
+	e = 2 + (i - 4) / 2;
+	return ((i - 4) % 2) ? (2ULL << e) : (3ULL << (e - 1));
+}
+
+static int
+metrics_valid_name(const char *name, size_t len) {
+
+	size_t i;
+
+	if(len == 0 || len > METRICS_NAME_MAX_LEN) {
+		return 0;
+	}
+	for(i = 0; i < len; ++i) {
+		unsigned char c = (unsigned char)name[i];
+		if(!isalnum(c) && c != '.' && c != '_' && c != '-' && c != ':') {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static struct metrics_histogram *
+metrics_histogram_for(struct metrics *m, const char *name, size_t len) {
+
+	uint32_t h = 2166136261u;
+	unsigned int i, probe;
+	size_t j;
+
+	if(!metrics_valid_name(name, len)) {
+		return &m->other;
+	}
+	for(j = 0; j < len; ++j) { /* case-insensitive FNV-1a */
+		h ^= (unsigned char)toupper((unsigned char)name[j]);
+		h *= 16777619u;
+	}
+
+	for(i = h & (METRICS_SLOTS - 1), probe = 0; probe < METRICS_SLOTS; ++probe, i = (i + 1) & (METRICS_SLOTS - 1)) {
+		struct metrics_histogram *hist = &m->commands[i];
+		if(!hist->used) {
+			if(m->named >= METRICS_SLOTS_USED) {
+				break;
+			}
+			for(j = 0; j < len; ++j) {
+				hist->name[j] = (char)toupper((unsigned char)name[j]);
+			}
+			hist->name[len] = 0;
+			m->named++;
+			__atomic_store_n(&hist->used, 1, __ATOMIC_RELEASE);
+			return hist;
+		}
+		if(strncasecmp(hist->name, name, len) == 0 && hist->name[len] == 0) {
+			return hist;
+		}
+	}
+	return &m->other;
+}
+
+/**
+ * Record how long a command took, in microseconds.
+ */
+void
+metrics_command(const char *name, size_t len, uint64_t us) {
+
+	struct metrics_histogram *hist;
+
+	if(!metrics_current) {
+		return;
+	}
+	hist = metrics_histogram_for(metrics_current, name, len);
+	metrics_inc(&hist->buckets[metrics_bucket(us)], 1);
+	metrics_inc(&hist->sum_us, us);
+	metrics_inc(&hist->count, 1);
+}
+
+/**
+ * Record how late the event loop ran a timer, in microseconds.
+ */
+void
+metrics_loop_lag(uint64_t us) {
+
+	struct metrics_histogram *hist;
+
+	if(!metrics_current) {
+		return;
+	}
+	hist = &metrics_current->loop_lag;
+	metrics_inc(&hist->buckets[metrics_bucket(us)], 1);
+	metrics_inc(&hist->sum_us, us);
+	metrics_inc(&hist->count, 1);
+}
+
+/* text output */
+
+struct metrics_buf {
+	char *p;
+	size_t sz;
+	size_t alloc;
+	int failed;
+};
+
+static void
+metrics_printf(struct metrics_buf *b, const char *fmt, ...) {
+
+	va_list ap;
+	int n;
+
+	if(b->failed) {
+		return;
+	}
+	while(1) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->p + b->sz, b->alloc - b->sz, fmt, ap);
+		va_end(ap);
+		if(n < 0) {
+			b->failed = 1;
+			return;
+		}
+		if((size_t)n < b->alloc - b->sz) {
+			b->sz += (size_t)n;
+			return;
+		}
+		size_t alloc = 2 * b->alloc + (size_t)n;
+		char *p = realloc(b->p, alloc);
+		if(!p) {
+			b->failed = 1;
+			return;
+		}
+		b->p = p;
+		b->alloc = alloc;
+	}
+}
+
+static void
+metrics_header(struct metrics_buf *b, const char *name, const char *type, const char *help) {
+
+	metrics_printf(b, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void
+metrics_counter_per_worker(struct metrics_buf *b, struct server *s, const char *name,
+		const char *type, const char *help, metrics_counter c) {
+
+	int n;
+
+	metrics_header(b, name, type, help);
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct metrics *m = s->w[n]->metrics;
+		metrics_printf(b, "%s{worker=\"%d\"} %llu\n", name, n, (unsigned long long)metrics_load(&m->counters[c]));
+	}
+}
+
+static void
+metrics_gauge_per_worker(struct metrics_buf *b, struct server *s, const char *name,
+		const char *help, metrics_counter up, metrics_counter down) {
+
+	int n;
+
+	metrics_header(b, name, "gauge", help);
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct metrics *m = s->w[n]->metrics;
+		uint64_t closed = metrics_load(&m->counters[down]); /* first, so it can't exceed the other one */
+		uint64_t opened = metrics_load(&m->counters[up]);
+		metrics_printf(b, "%s{worker=\"%d\"} %llu\n", name, n, (unsigned long long)(opened - closed));
+	}
+}
+
+/* histograms with the same name in different workers, added up */
+struct metrics_merged {
+	const char *name;
+	uint64_t count;
+	uint64_t sum_us;
+	uint64_t buckets[METRICS_BUCKETS];
+};
+
+static void
+metrics_merge(struct metrics_merged *dst, const struct metrics_histogram *src) {
+
+	unsigned int i;
+
+	for(i = 0; i < METRICS_BUCKETS; ++i) {
+		dst->buckets[i] += metrics_load(&src->buckets[i]);
+	}
+	dst->sum_us += metrics_load(&src->sum_us);
+	dst->count += metrics_load(&src->count);
+}
+
+static void
+metrics_print_histogram(struct metrics_buf *b, const char *name, const char *label,
+		const struct metrics_merged *h) {
+
+	uint64_t cumulative = 0;
+	unsigned int j;
+
+	for(j = 0; j < METRICS_BOUNDS; ++j) {
+		cumulative += h->buckets[j];
+		metrics_printf(b, "%s_bucket{%s,le=\"%g\"} %llu\n", name, label,
+			(double)metrics_bound(j) / 1e6, (unsigned long long)cumulative);
+	}
+	cumulative += h->buckets[METRICS_BOUNDS];
+	metrics_printf(b, "%s_bucket{%s,le=\"+Inf\"} %llu\n", name, label, (unsigned long long)cumulative);
+	metrics_printf(b, "%s_sum{%s} %.6f\n", name, label, (double)h->sum_us / 1e6);
+	metrics_printf(b, "%s_count{%s} %llu\n", name, label, (unsigned long long)h->count);
+}
+
+static void
+metrics_histograms(struct metrics_buf *b, struct server *s) {
+
+	const char *name = "webdis_command_duration_seconds";
+	struct metrics_merged *merged;
+	size_t count = 1, k;
+	unsigned int i;
+	int n;
+
+	merged = calloc((size_t)s->cfg->http_threads * METRICS_SLOTS_USED + 1, sizeof(struct metrics_merged));
+	if(!merged) {
+		b->failed = 1;
+		return;
+	}
+	merged[0].name = "other";
+
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct metrics *m = s->w[n]->metrics;
+		metrics_merge(&merged[0], &m->other);
+		for(i = 0; i < METRICS_SLOTS; ++i) {
+			const struct metrics_histogram *hist = &m->commands[i];
+			if(!__atomic_load_n(&hist->used, __ATOMIC_ACQUIRE)) {
+				continue;
+			}
+			for(k = 1; k < count && strcmp(merged[k].name, hist->name) != 0; ++k);
+			if(k == count) {
+				merged[count++].name = hist->name;
+			}
+			metrics_merge(&merged[k], hist);
+		}
+	}
+
+	metrics_header(b, name, "histogram", "Time from reading a request to receiving its reply, by command.");
+	for(k = 0; k < count; ++k) {
+		char label[METRICS_NAME_MAX_LEN + 8];
+		if(merged[k].count == 0) {
+			continue;
+		}
+		snprintf(label, sizeof(label), "cmd=\"%s\"", merged[k].name);
+		metrics_print_histogram(b, name, label, &merged[k]);
+	}
+	free(merged);
+}
+
+static void
+metrics_loop_lag_histograms(struct metrics_buf *b, struct server *s) {
+
+	const char *name = "webdis_event_loop_lag_seconds";
+	int n;
+
+	metrics_header(b, name, "histogram", "How late the event loop of each worker ran its stall detector timer.");
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct metrics_merged lag;
+		char label[32];
+		memset(&lag, 0, sizeof(lag));
+		metrics_merge(&lag, &s->w[n]->metrics->loop_lag);
+		if(lag.count == 0) {
+			continue;
+		}
+		snprintf(label, sizeof(label), "worker=\"%d\"", n);
+		metrics_print_histogram(b, name, label, &lag);
+	}
+}
+
+/**
+ * Format the metrics of all workers. Returns NULL if they're disabled.
+ */
+char *
+metrics_format(struct server *s, size_t *out_sz) {
+
+	struct metrics_buf b = {NULL, 0, 0, 0};
+	unsigned long ws_overflow[4] = {0, 0, 0, 0}, sub_overflow[3] = {0, 0, 0};
+	int n, code;
+
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		if(!s->w[n]->metrics) { /* disabled, or failed to allocate */
+			return NULL;
+		}
+	}
+
+	metrics_counter_per_worker(&b, s, "webdis_requests_total", "counter",
+		"HTTP requests and WebSocket messages received.", METRICS_REQUESTS);
+	metrics_counter_per_worker(&b, s, "webdis_received_bytes_total", "counter",
+		"Bytes read from clients.", METRICS_BYTES_IN);
+	metrics_counter_per_worker(&b, s, "webdis_sent_bytes_total", "counter",
+		"Bytes written to clients.", METRICS_BYTES_OUT);
+	metrics_gauge_per_worker(&b, s, "webdis_connections",
+		"Open client connections.", METRICS_CONNECTIONS_OPENED, METRICS_CONNECTIONS_CLOSED);
+	metrics_counter_per_worker(&b, s, "webdis_connections_total", "counter",
+		"Client connections accepted.", METRICS_CONNECTIONS_OPENED);
+	metrics_gauge_per_worker(&b, s, "webdis_redis_connections",
+		"Open connections to Redis.", METRICS_REDIS_CONNECTED, METRICS_REDIS_DISCONNECTED);
+	metrics_counter_per_worker(&b, s, "webdis_redis_disconnects_total", "counter",
+		"Connections to Redis lost or closed.", METRICS_REDIS_DISCONNECTED);
+	metrics_counter_per_worker(&b, s, "webdis_redis_reconnects_total", "counter",
+		"Attempts to reconnect to Redis.", METRICS_REDIS_RECONNECTS);
+	metrics_counter_per_worker(&b, s, "webdis_event_loop_stalls_total", "counter",
+		"Times the event loop was blocked for longer than the stall detector threshold.", METRICS_LOOP_STALLS);
+
+	metrics_header(&b, "webdis_responses_total", "counter", "HTTP responses sent, by status code.");
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct metrics *m = s->w[n]->metrics;
+		for(code = 0; code < METRICS_STATUS_MAX; ++code) {
+			uint64_t val = metrics_load(&m->status[code]);
+			if(val) {
+				metrics_printf(&b, "webdis_responses_total{worker=\"%d\",code=\"%d\"} %llu\n",
+					n, code, (unsigned long long)val);
+			}
+		}
+	}
+
+	/* overflow counters kept by the workers for slow clients */
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct worker *w = s->w[n];
+		ws_overflow[0] += __atomic_load_n(&w->ws_overflow.paused, __ATOMIC_RELAXED);
+		ws_overflow[1] += __atomic_load_n(&w->ws_overflow.resumed, __ATOMIC_RELAXED);
+		ws_overflow[2] += __atomic_load_n(&w->ws_overflow.dropped, __ATOMIC_RELAXED);
+		ws_overflow[3] += __atomic_load_n(&w->ws_overflow.disconnected, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&w->streams_lock);
+		sub_overflow[0] += w->sub_overflow.dropped_oldest;
+		sub_overflow[1] += w->sub_overflow.dropped_newest;
+		sub_overflow[2] += w->sub_overflow.disconnected;
+		pthread_mutex_unlock(&w->streams_lock);
+	}
+	metrics_header(&b, "webdis_websocket_overflow_total", "counter",
+		"Slow WebSocket clients: Redis reads paused and resumed, messages dropped, clients disconnected.");
+	metrics_printf(&b, "webdis_websocket_overflow_total{event=\"paused\"} %lu\n", ws_overflow[0]);
+	metrics_printf(&b, "webdis_websocket_overflow_total{event=\"resumed\"} %lu\n", ws_overflow[1]);
+	metrics_printf(&b, "webdis_websocket_overflow_total{event=\"dropped\"} %lu\n", ws_overflow[2]);
+	metrics_printf(&b, "webdis_websocket_overflow_total{event=\"disconnected\"} %lu\n", ws_overflow[3]);
+	metrics_header(&b, "webdis_subscriber_overflow_total", "counter",
+		"Slow HTTP subscribers: messages dropped, clients disconnected.");
+	metrics_printf(&b, "webdis_subscriber_overflow_total{event=\"dropped_oldest\"} %lu\n", sub_overflow[0]);
+	metrics_printf(&b, "webdis_subscriber_overflow_total{event=\"dropped_newest\"} %lu\n", sub_overflow[1]);
+	metrics_printf(&b, "webdis_subscriber_overflow_total{event=\"disconnected\"} %lu\n", sub_overflow[2]);
+	metrics_header(&b, "webdis_log_lines_dropped_total", "counter", "Log lines discarded with a full queue.");
+	metrics_printf(&b, "webdis_log_lines_dropped_total %lu\n", slog_dropped(s));
+
+	metrics_histograms(&b, s);
+	metrics_loop_lag_histograms(&b, s);
+
+	if(b.failed) {
+		free(b.p);
+		return NULL;
+	}
+	*out_sz = b.sz;
+	return b.p;
+}
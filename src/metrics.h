@@ -0,0 +1,45 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct server;
+
+typedef enum {
+	METRICS_REQUESTS = 0,       /* HTTP requests and WebSocket messages */
+	METRICS_BYTES_IN,
+	METRICS_BYTES_OUT,
+	METRICS_CONNECTIONS_OPENED,
+	METRICS_CONNECTIONS_CLOSED,
+	METRICS_REDIS_CONNECTED,    /* connections to Redis established */
+	METRICS_REDIS_DISCONNECTED, /* connections to Redis lost or closed */
+	METRICS_REDIS_RECONNECTS,   /* attempts to reconnect to Redis */
+	METRICS_LOOP_STALLS,        /* event loop blocked for longer than the threshold */
+	METRICS_COUNTER_COUNT
+} metrics_counter;
+
+struct metrics;
+
+struct metrics *
+metrics_new(void);
+
+void
+metrics_bind(struct metrics *m);
+
+void
+metrics_add(metrics_counter c, uint64_t n);
+
+void
+metrics_status(int code);
+
+void
+metrics_command(const char *name, size_t len, uint64_t us);
+
+void
+metrics_loop_lag(uint64_t us);
+
+char *
+metrics_format(struct server *s, size_t *out_sz);
+
+#endif
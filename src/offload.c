@@ -0,0 +1,230 @@
+#include "offload.h"
+#include "server.h"
+#include "worker.h"
+#include "conf.h"
+#include "cmd.h"
+#include "formats/common.h"
+
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <limits.h>
+
+/* Formatting of large replies on a small shared thread pool.
+ *
+ * The reply is taken away from hiredis (which frees replies as soon as the
+ * callback returns), encoded on one of the formatting threads along with its
+ * ETag and compressed form, then handed back to the worker that owns the
+ * client through a pipe, where it is sent like any other reply.
+ */
+
+struct offload_job {
+	struct cmd *cmd;
+	redisReply *reply;
+	offload_encoder enc;
+	const char *content_type;
+
+	/* output */
+	char *out;
+	size_t out_sz;
+	struct format_body body;
+
+	struct offload_job *next;
+};
+
+struct offload_thread {
+	pthread_t thread;
+	struct offload *o;
+	unsigned long gen; /* configuration generation in use, 0 when idle */
+};
+
+struct offload {
+	struct server *s;
+	int count;
+	struct offload_thread *threads;
+
+	/* pending jobs, shared by all workers */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct offload_job *head;
+	struct offload_job *tail;
+};
+
+struct offload *
+offload_new(struct server *s) {
+
+	struct offload *o;
+
+	if(s->cfg->format_offload.threads <= 0) {
+		return NULL;
+	}
+
+	o = calloc(1, sizeof(struct offload));
+	o->s = s;
+	o->count = s->cfg->format_offload.threads;
+	o->threads = calloc(o->count, sizeof(struct offload_thread));
+	pthread_mutex_init(&o->lock, NULL);
+	pthread_cond_init(&o->cond, NULL);
+
+	return o;
+}
+
+/**
+ * Record the configuration generation this thread is about to read from, so
+ * that the main thread doesn't free it after a reload (see server_reload).
+ */
+static void
+offload_enter(struct offload_thread *t) {
+
+	unsigned long gen;
+
+	do {
+		gen = __atomic_load_n(&t->o->s->cfg_gen, __ATOMIC_SEQ_CST);
+		__atomic_store_n(&t->gen, gen, __ATOMIC_SEQ_CST);
+	} while(gen != __atomic_load_n(&t->o->s->cfg_gen, __ATOMIC_SEQ_CST));
+}
+
+static void*
+offload_main(void *p) {
+
+	struct offload_thread *t = p;
+	struct offload *o = t->o;
+	struct offload_job *job;
+	int ret;
+
+	while(1) {
+		/* wait for a job */
+		pthread_mutex_lock(&o->lock);
+		while(!o->head) {
+			pthread_cond_wait(&o->cond, &o->lock);
+		}
+		job = o->head;
+		o->head = job->next;
+		if(!o->head) {
+			o->tail = NULL;
+		}
+		pthread_mutex_unlock(&o->lock);
+
+		/* encode, only reading from the command */
+		offload_enter(t);
+		job->out = job->enc(job->cmd, job->reply, &job->out_sz);
+		if(job->out) {
+			format_prepare_body(job->cmd, job->out, job->out_sz, job->content_type, &job->body);
+		}
+		__atomic_store_n(&t->gen, 0, __ATOMIC_RELEASE);
+
+		/* send back to the worker owning the client */
+		ret = write(job->cmd->w->offload_link[1], &job, sizeof(job));
+		(void)ret;
+	}
+
+	return NULL;
+}
+
+void
+offload_start(struct offload *o) {
+
+	int i;
+
+	if(!o) return;
+	for(i = 0; i < o->count; ++i) {
+		o->threads[i].o = o;
+		pthread_create(&o->threads[i].thread, NULL, offload_main, &o->threads[i]);
+	}
+}
+
+/**
+ * Oldest configuration generation still read by a formatting thread,
+ * ULONG_MAX if none of them is busy.
+ */
+unsigned long
+offload_oldest_gen(struct offload *o) {
+
+	unsigned long oldest = ULONG_MAX, gen;
+	int i;
+
+	for(i = 0; o && i < o->count; ++i) {
+		gen = __atomic_load_n(&o->threads[i].gen, __ATOMIC_SEQ_CST);
+		if(gen && gen < oldest) {
+			oldest = gen;
+		}
+	}
+	return oldest;
+}
+
+/**
+ * Queue a reply for formatting if it is large enough.
+ * Returns 1 if the reply was taken, 0 if the caller should format it.
+ */
+int
+offload_reply(struct cmd *cmd, redisReply *r, offload_encoder enc, const char *content_type) {
+
+	struct offload *o = cmd->w->s->offload;
+	struct offload_job *job;
+	size_t limit;
+
+	if(!o || cmd->is_websocket || cmd_is_subscribe(cmd)) {
+		return 0;
+	}
+	limit = o->s->cfg->format_offload.min_size;
+	if(format_reply_size(r, limit) <= limit) {
+		return 0;
+	}
+
+	if(!(job = calloc(1, sizeof(struct offload_job)))) {
+		return 0;
+	}
+	if(!(job->reply = malloc(sizeof(redisReply)))) {
+		free(job);
+		return 0;
+	}
+	job->cmd = cmd;
+	job->enc = enc;
+	job->content_type = content_type;
+
+	/* steal the contents of the reply, hiredis only frees the empty shell */
+	memcpy(job->reply, r, sizeof(redisReply));
+	r->str = NULL;
+	r->len = 0;
+	r->element = NULL;
+	r->elements = 0;
+
+	pthread_mutex_lock(&o->lock);
+	if(o->tail) {
+		o->tail->next = job;
+	} else {
+		o->head = job;
+	}
+	o->tail = job;
+	pthread_cond_signal(&o->cond);
+	pthread_mutex_unlock(&o->lock);
+
+	return 1;
+}
+
+/**
+ * Called on the worker thread when a reply has been formatted.
+ */
+void
+offload_on_complete(int fd, short event, void *ptr) {
+
+	struct offload_job *job;
+	int ret;
+
+	(void)event;
+	(void)ptr;
+
+	ret = read(fd, &job, sizeof(job));
+	if(ret != sizeof(job)) {
+		return;
+	}
+
+	if(job->out) {
+		format_send_prepared(job->cmd, job->out, job->out_sz, job->content_type, &job->body);
+	} else {
+		format_send_error(job->cmd, 503, "Service Unavailable");
+	}
+
+	freeReplyObject(job->reply);
+	free(job);
+}
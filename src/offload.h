@@ -0,0 +1,30 @@
+#ifndef OFFLOAD_H
+#define OFFLOAD_H
+
+#include <stdlib.h>
+#include <hiredis/hiredis.h>
+
+struct server;
+struct worker;
+struct cmd;
+struct offload;
+
+/* encodes a reply into a newly allocated buffer, NULL on failure */
+typedef char *(*offload_encoder)(const struct cmd *cmd, const redisReply *r, size_t *out_sz);
+
+struct offload *
+offload_new(struct server *s);
+
+void
+offload_start(struct offload *o);
+
+int
+offload_reply(struct cmd *cmd, redisReply *r, offload_encoder enc, const char *content_type);
+
+void
+offload_on_complete(int fd, short event, void *ptr);
+
+unsigned long
+offload_oldest_gen(struct offload *o);
+
+#endif
@@ -2,15 +2,20 @@
 #include "worker.h"
 #include "conf.h"
 #include "server.h"
+#include "metrics.h"
 
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
 #include <event.h>
 #include <hiredis/adapters/libevent.h>
 
 static void
 pool_schedule_reconnect(struct pool* p);
 
+static void
+pool_retire_later(struct pool *p, const redisAsyncContext *ac);
+
 struct pool *
 pool_new(struct worker *w, int count) {
 
@@ -20,7 +25,6 @@ pool_new(struct worker *w, int count) {
 	p->ac = calloc(count, sizeof(redisAsyncContext*));
 
 	p->w = w;
-	p->cfg = w->s->cfg;
 
 	return p;
 }
@@ -38,6 +42,9 @@ pool_on_connect(const redisAsyncContext *ac, int status) {
 	struct pool *p = ac->data;
 	int i = 0;
 
+	if(p) {
+		p->connecting--;
+	}
 	if(!p || status == REDIS_ERR || ac->err) {
 		if (p) {
 			pool_schedule_reconnect(p);
@@ -46,13 +53,70 @@ pool_on_connect(const redisAsyncContext *ac, int status) {
 	}
 	/* connected to redis! */
 
+	/* started before the configuration changed */
+	if((uintptr_t)ac->c.privdata != p->epoch) {
+		pool_retire_later(p, ac);
+		pool_connect(p, p->w->s->cfg->database, 1);
+		return;
+	}
+
 	/* add to pool */
 	for(i = 0; i < p->count; ++i) {
 		if(p->ac[i] == NULL) {
 			p->ac[i] = ac;
+			metrics_add(METRICS_REDIS_CONNECTED, 1);
 			return;
 		}
 	}
+
+	/* the pool was made smaller since this connection started */
+	pool_retire_later(p, ac);
+}
+
+/* hiredis can't close a connection from its own connect callback */
+struct pool_retire {
+	struct event ev;
+	struct pool *p;
+	const redisAsyncContext *ac; /* NULL if it was closed in the meantime */
+	struct pool_retire *next;
+};
+
+static void
+pool_on_retire(int fd, short event, void *ptr) {
+	struct pool_retire *pr = ptr, **prev;
+
+	(void)fd;
+	(void)event;
+
+	for(prev = &pr->p->retiring; *prev != pr; prev = &(*prev)->next);
+	*prev = pr->next;
+
+	if(pr->ac) {
+		redisAsyncContext *c = (redisAsyncContext*)pr->ac;
+		c->data = NULL;
+		redisAsyncDisconnect(c);
+	}
+	free(pr);
+}
+
+static void
+pool_retire_later(struct pool *p, const redisAsyncContext *ac) {
+
+	struct pool_retire *pr = calloc(1, sizeof(struct pool_retire));
+	struct timeval tv = {0, 0};
+
+	if(!pr) { /* left open, out of the pool */
+		((redisAsyncContext*)ac)->data = NULL;
+		return;
+	}
+	pr->p = p;
+	pr->ac = ac;
+	pr->next = p->retiring;
+	p->retiring = pr;
+
+	evtimer_set(&pr->ev, pool_on_retire, pr);
+	event_base_set(p->w->base, &pr->ev);
+	evtimer_add(&pr->ev, &tv);
 }
 
 struct pool_reconnect {
@@ -72,13 +136,16 @@ pool_can_connect(int fd, short event, void *ptr) {
 
 	free(pr);
 
-	pool_connect(p, p->cfg->database, 1);
+	p->reconnecting--;
+	metrics_add(METRICS_REDIS_RECONNECTS, 1);
+	pool_connect(p, p->w->s->cfg->database, 1);
 }
 static void
 pool_schedule_reconnect(struct pool *p) {
 
 	struct pool_reconnect *pr = malloc(sizeof(struct pool_reconnect));
 	pr->p = p;
+	p->reconnecting++;
 
 	pr->tv.tv_sec = 0;
 	pr->tv.tv_usec = 100*1000; /* 0.1 sec*/
@@ -94,12 +161,23 @@ static void
 pool_on_disconnect(const redisAsyncContext *ac, int status) {
 
 	struct pool *p = ac->data;
+	struct pool_retire *pr;
 	int i = 0;
 
 	if(p == NULL) { /* no need to clean anything here. */
 		return;
 	}
 
+	/* closed by Redis before it could be retired */
+	for(pr = p->retiring; pr; pr = pr->next) {
+		if(pr->ac == ac) {
+			pr->ac = NULL;
+			return;
+		}
+	}
+
+	metrics_add(METRICS_REDIS_DISCONNECTED, 1);
+
 	if (status != REDIS_OK) {
 		char format[] = "Error disconnecting: %s";
 		size_t msg_sz = sizeof(format) - 2 + ((ac && ac->errstr) ? strlen(ac->errstr) : 6);
@@ -124,7 +202,7 @@ pool_on_disconnect(const redisAsyncContext *ac, int status) {
 }
 
 static void
-pool_log_auth(struct server *s, log_level level, const char *format, size_t format_len, const char *str) {
+pool_log_reply(struct server *s, log_level level, const char *format, size_t format_len, const char *str) {
 	/* -2 for `%s`, 6 for "(null)", +1 for \0 */
 	size_t msg_size = format_len - 2 + (str ? strlen(str) : 6) + 1;
 	char *msg = calloc(1, msg_size);
@@ -152,14 +230,28 @@ pool_on_auth_complete(redisAsyncContext *c, void *r, void *data) {
 		return;
 	}
 	if(reply->type == REDIS_REPLY_ERROR) {
-		pool_log_auth(s, WEBDIS_ERROR, err_format, sizeof(err_format) - 1, reply->str);
+		pool_log_reply(s, WEBDIS_ERROR, err_format, sizeof(err_format) - 1, reply->str);
 	} else if(reply->type == REDIS_REPLY_STATUS) {
-		pool_log_auth(s, WEBDIS_INFO, ok_format, sizeof(ok_format) - 1, reply->str);
+		pool_log_reply(s, WEBDIS_INFO, ok_format, sizeof(ok_format) - 1, reply->str);
 	}
 	s->auth_logged++;
 	pthread_mutex_unlock(&s->auth_log_mutex);
 }
 
+static void
+pool_on_hello_complete(redisAsyncContext *c, void *r, void *data) {
+	redisReply *reply = r;
+	struct pool *p = data;
+	const char err_format[] = "RESP3 negotiation failed, using RESP2: %s";
+	(void)c;
+
+	/* older Redis servers don't know HELLO and keep talking RESP2,
+	 * which the formatters also handle. */
+	if(reply && reply->type == REDIS_REPLY_ERROR) {
+		pool_log_reply(p->w->s, WEBDIS_WARNING, err_format, sizeof(err_format) - 1, reply->str);
+	}
+}
+
 /**
  * Create new connection.
  */
@@ -167,10 +259,11 @@ redisAsyncContext *
 pool_connect(struct pool *p, int db_num, int attach) {
 
 	struct redisAsyncContext *ac;
-	if(p->cfg->redis_host[0] == '/') { /* unix socket */
-		ac = redisAsyncConnectUnix(p->cfg->redis_host);
+	struct conf *cfg = p->w->s->cfg;
+	if(cfg->redis_host[0] == '/') { /* unix socket */
+		ac = redisAsyncConnectUnix(cfg->redis_host);
 	} else {
-		ac = redisAsyncConnect(p->cfg->redis_host, p->cfg->redis_port);
+		ac = redisAsyncConnect(cfg->redis_host, cfg->redis_port);
 	}
 
 	if(attach) {
@@ -209,19 +302,26 @@ pool_connect(struct pool *p, int db_num, int attach) {
 #endif
 
 	redisLibeventAttach(ac, p->w->base);
+	if(attach) {
+		p->connecting++;
+		ac->c.privdata = (void*)(uintptr_t)p->epoch; /* no free_privdata, nothing to free */
+	}
 	redisAsyncSetConnectCallback(ac, pool_on_connect);
 	redisAsyncSetDisconnectCallback(ac, pool_on_disconnect);
 
-	if(p->cfg->redis_auth) { /* authenticate. */
-		if(p->cfg->redis_auth->use_legacy_auth) {
+	if(cfg->redis_auth) { /* authenticate. */
+		if(cfg->redis_auth->use_legacy_auth) {
 			redisAsyncCommand(ac, pool_on_auth_complete, p, "AUTH %s",
-				p->cfg->redis_auth->password);
+				cfg->redis_auth->password);
 		} else {
 			redisAsyncCommand(ac, pool_on_auth_complete, p, "AUTH %s %s",
-				p->cfg->redis_auth->username,
-				p->cfg->redis_auth->password);
+				cfg->redis_auth->username,
+				cfg->redis_auth->password);
 		}
 	}
+	if(cfg->redis_protocol == 3) { /* switch to RESP3, after AUTH since HELLO requires it. */
+		redisAsyncCommand(ac, pool_on_hello_complete, p, "HELLO 3");
+	}
 	if(db_num) { /* change database. */
 		redisAsyncCommand(ac, NULL, NULL, "SELECT %d", db_num);
 	}
@@ -245,3 +345,85 @@ pool_get_context(struct pool *p) {
 
 }
 
+static int
+pool_same_string(const char *a, const char *b) {
+
+	if(!a || !b) {
+		return a == b;
+	}
+	return strcmp(a, b) == 0;
+}
+
+/* whether connections made with one configuration can be kept with the other */
+static int
+pool_same_redis(const struct conf *old, const struct conf *cfg) {
+
+	if(!pool_same_string(old->redis_host, cfg->redis_host)
+			|| old->redis_port != cfg->redis_port
+			|| old->redis_protocol != cfg->redis_protocol
+			|| old->database != cfg->database) {
+		return 0;
+	}
+	if(!old->redis_auth || !cfg->redis_auth) {
+		return old->redis_auth == cfg->redis_auth;
+	}
+	return old->redis_auth->use_legacy_auth == cfg->redis_auth->use_legacy_auth
+		&& pool_same_string(old->redis_auth->username, cfg->redis_auth->username)
+		&& pool_same_string(old->redis_auth->password, cfg->redis_auth->password);
+}
+
+/* close a connection once its pending replies have arrived, without reconnecting */
+static void
+pool_retire(const redisAsyncContext *ac) {
+
+	redisAsyncContext *c = (redisAsyncContext*)ac;
+
+	c->data = NULL;
+	metrics_add(METRICS_REDIS_DISCONNECTED, 1);
+	redisAsyncDisconnect(c);
+}
+
+/**
+ * Apply a new configuration from the worker's thread: replace the connections
+ * if they were made to another server or with other credentials, and resize
+ * the pool. Commands already sent still get their replies.
+ */
+void
+pool_reconfigure(struct pool *p, const struct conf *old, const struct conf *cfg) {
+
+	int i, live = 0, count = cfg->pool_size_per_thread;
+	int replace = !pool_same_redis(old, cfg);
+
+	if(replace) { /* connections in progress are replaced once established */
+		p->epoch++;
+	}
+
+	for(i = 0; i < p->count; ++i) {
+		if(p->ac[i] && (replace || i >= count)) {
+			pool_retire(p->ac[i]);
+			p->ac[i] = NULL;
+		}
+	}
+
+	if(count != p->count) {
+		const redisAsyncContext **ac = calloc(count, sizeof(redisAsyncContext*));
+		if(!ac) {
+			return;
+		}
+		for(i = 0; i < count && i < p->count; ++i) {
+			ac[i] = p->ac[i];
+		}
+		free(p->ac);
+		p->ac = ac;
+		p->count = count;
+		p->cur = 0;
+	}
+
+	/* connect what's missing, counting the connections on their way */
+	for(i = 0; i < p->count; ++i) {
+		if(p->ac[i]) live++;
+	}
+	for(i = live + p->connecting + p->reconnecting; i < p->count; ++i) {
+		pool_connect(p, cfg->database, 1);
+	}
+}
@@ -5,16 +5,21 @@
 
 struct conf;
 struct worker;
+struct pool_retire;
 
 struct pool {
 
 	struct worker *w;
-	struct conf *cfg;
 
 	const redisAsyncContext **ac;
 	int count;
 	int cur;
 
+	int connecting;   /* connections started and not yet established */
+	int reconnecting; /* reconnections scheduled */
+	unsigned long epoch; /* changed when the connections are replaced, see pool_reconfigure */
+	struct pool_retire *retiring; /* established connections waiting to be closed */
+
 };
 
 
@@ -30,4 +35,7 @@ pool_connect(struct pool *p, int db_num, int attach);
 const redisAsyncContext *
 pool_get_context(struct pool *p);
 
+void
+pool_reconfigure(struct pool *p, const struct conf *old, const struct conf *cfg);
+
 #endif
@@ -3,6 +3,8 @@
 #include "client.h"
 #include "conf.h"
 #include "version.h"
+#include "offload.h"
+#include "trace.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -122,6 +124,9 @@ server_new(const char *cfg_file) {
 	struct server *s = calloc(1, sizeof(struct server));
 
 	s->log.fd = -1;
+	s->log.access_fd = -1;
+	s->cfg_file = strdup(cfg_file);
+	s->cfg_gen = 1;
 	s->cfg = conf_read(cfg_file);
 
 	/* initialize logging as soon as we've read the config file */
@@ -133,6 +138,9 @@ server_new(const char *cfg_file) {
 	}
 #endif
 
+	/* formatting threads, shared by all workers */
+	s->offload = offload_new(s);
+
 	/* workers */
 	s->w = calloc(s->cfg->http_threads, sizeof(struct worker*));
 	for(i = 0; i < s->cfg->http_threads; ++i) {
@@ -172,6 +180,7 @@ server_can_accept(int fd, short event, void *ptr) {
 
 	/* create client and send to worker. */
 	if(client_fd > 0) {
+		TRACE_ACCEPT(client_fd, addr.sin_addr.s_addr);
 		c = http_client_new(w, client_fd, addr.sin_addr.s_addr);
 		worker_add_client(w, c);
 
@@ -225,6 +234,153 @@ server_daemonize(struct server *s, const char *pidfile) {
 	}
 }
 
+/* Configuration reloads
+ *
+ * On SIGHUP, the configuration file is read again and the new struct conf
+ * replaces s->cfg, which the workers and formatting threads read without
+ * locking. The previous one is kept until every thread that could still be
+ * reading it has moved on: each worker records the generation it has
+ * switched to between two events (see worker_on_reload), and each
+ * formatting thread the generation it started a job with. Settings that
+ * were used to set up the process can't change and are kept as they were.
+ */
+struct server_retired {
+	struct conf *cfg;
+	unsigned long gen; /* generation that replaced it */
+	struct server_retired *next;
+};
+
+#define SERVER_RECLAIM_MS 100
+
+/**
+ * Keep the settings that only apply at startup, returning how many differ.
+ */
+static int
+server_keep_startup_settings(const struct conf *old, struct conf *cfg) {
+
+	int changed = 0;
+
+	if(strcmp(old->http_host, cfg->http_host) != 0) {
+		changed++;
+	}
+	free(cfg->http_host);
+	cfg->http_host = strdup(old->http_host);
+
+	if(strcmp(old->pidfile, cfg->pidfile) != 0) {
+		changed++;
+	}
+	free(cfg->pidfile);
+	cfg->pidfile = strdup(old->pidfile);
+
+#define SERVER_KEEP(field) do { \
+		if(cfg->field != old->field) changed++; \
+		cfg->field = old->field; \
+	} while(0)
+	SERVER_KEEP(http_port);
+	SERVER_KEEP(http_threads);
+	SERVER_KEEP(daemonize);
+	SERVER_KEEP(log_fsync.mode);
+	SERVER_KEEP(log_fsync.period_millis);
+	SERVER_KEEP(log_async.enabled);
+	SERVER_KEEP(log_async.lines);
+	SERVER_KEEP(log_async.overflow);
+	SERVER_KEEP(format_offload.threads);
+	SERVER_KEEP(metrics.enabled);
+	SERVER_KEEP(slowlog.max_len);
+	SERVER_KEEP(stall_detector.interval_ms);
+#undef SERVER_KEEP
+
+#ifdef HAVE_SSL
+	if(cfg->ssl.enabled != old->ssl.enabled) {
+		changed++;
+	}
+	cfg->ssl = old->ssl; /* the context was created at startup */
+#endif
+	return changed;
+}
+
+/**
+ * Free the configurations that no thread can be reading anymore.
+ */
+static void
+server_reclaim(int fd, short event, void *ptr) {
+
+	struct server *s = ptr;
+	struct server_retired **prev, *r;
+	unsigned long oldest;
+	int i;
+
+	(void)fd;
+	(void)event;
+
+	oldest = offload_oldest_gen(s->offload);
+	for(i = 0; i < s->cfg->http_threads; ++i) {
+		unsigned long gen = __atomic_load_n(&s->w[i]->cfg_gen, __ATOMIC_ACQUIRE);
+		if(gen < oldest) {
+			oldest = gen;
+		}
+	}
+
+	for(prev = &s->retired; (r = *prev); ) {
+		if(r->gen <= oldest) {
+			*prev = r->next;
+			conf_free(r->cfg);
+			free(r);
+		} else {
+			prev = &r->next;
+		}
+	}
+
+	if(s->retired) { /* check again later */
+		struct timeval tv = {0, SERVER_RECLAIM_MS * 1000};
+		evtimer_add(&s->reclaim_ev, &tv);
+	}
+}
+
+/**
+ * Read the configuration file again and switch all threads to it.
+ */
+static void
+server_reload(int sig, short event, void *ptr) {
+
+	struct server *s = ptr;
+	struct server_retired *r;
+	struct conf *old = s->cfg, *cfg;
+	struct timeval tv = {0, SERVER_RECLAIM_MS * 1000};
+	unsigned long gen = s->cfg_gen + 1;
+	int i;
+
+	(void)sig;
+	(void)event;
+
+	if(!(cfg = conf_reload(s->cfg_file)) || !(r = calloc(1, sizeof(struct server_retired)))) {
+		if(cfg) conf_free(cfg);
+		slog(s, WEBDIS_ERROR, "Could not reload the configuration, keeping the current one", 0);
+		slog_init(s); /* still reopen the logs */
+		return;
+	}
+	if(server_keep_startup_settings(old, cfg)) {
+		slog(s, WEBDIS_WARNING, "Some of the new settings only apply after a restart", 0);
+	}
+
+	/* publish: the configuration first, then its generation */
+	__atomic_store_n(&s->cfg, cfg, __ATOMIC_RELEASE);
+	__atomic_store_n(&s->cfg_gen, gen, __ATOMIC_SEQ_CST);
+
+	/* free the old one once nothing reads from it */
+	r->cfg = old;
+	r->gen = gen;
+	r->next = s->retired;
+	s->retired = r;
+	evtimer_add(&s->reclaim_ev, &tv);
+
+	slog_init(s);
+	for(i = 0; i < cfg->http_threads; ++i) {
+		worker_reload(s->w[i]);
+	}
+	slog(s, WEBDIS_INFO, "Configuration reloaded", 0);
+}
+
 /* global pointer to the server object, used in signal handlers */
 static struct server *__server;
 
@@ -233,11 +389,9 @@ server_handle_signal(int id) {
 
 	int ret;
 	switch(id) {
-		case SIGHUP:
-			slog_init(__server);
-			break;
 		case SIGTERM:
 		case SIGINT:
+			slog_async_stop(__server); /* write queued lines first */
 			slog(__server, WEBDIS_INFO, "Webdis terminating", 0);
 			ret = fsync(__server->log.fd);
 			(void)ret;
@@ -252,7 +406,13 @@ static void
 server_install_signal_handlers(struct server *s) {
 	__server = s;
 
-	signal(SIGHUP,  server_handle_signal);
+	/* reloads run on the event loop, between two accepts */
+	evsignal_set(&s->reload_ev, SIGHUP, server_reload, s);
+	event_base_set(s->base, &s->reload_ev);
+	evsignal_add(&s->reload_ev, NULL);
+	evtimer_set(&s->reclaim_ev, server_reclaim, s);
+	event_base_set(s->base, &s->reclaim_ev);
+
 	signal(SIGTERM, server_handle_signal);
 	signal(SIGINT,  server_handle_signal);
 }
@@ -282,7 +442,9 @@ server_start(struct server *s) {
 	/* install signal handlers */
 	server_install_signal_handlers(s);
 
-	/* start worker threads */
+	/* start log writer, formatting and worker threads */
+	slog_async_start(s);
+	offload_start(s->offload);
 	for(i = 0; i < s->cfg->http_threads; ++i) {
 		worker_start(s->w[i]);
 	}
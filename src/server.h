@@ -12,6 +12,8 @@
 
 struct worker;
 struct conf;
+struct slog_async;
+struct server_retired;
 
 struct server {
 
@@ -21,6 +23,13 @@ struct server {
 
 	struct conf *cfg;
 
+	/* configuration reloads, see server_reload */
+	char *cfg_file;
+	unsigned long cfg_gen;           /* incremented when cfg is replaced */
+	struct server_retired *retired;  /* replaced configurations not yet freed */
+	struct event reload_ev;
+	struct event reclaim_ev;
+
 #ifdef HAVE_SSL
 	/* SSL context & error code */
 	redisSSLContext *ssl_context;
@@ -31,12 +40,17 @@ struct server {
 	struct worker **w;
 	int next_worker;
 
+	/* formatting threads for large replies */
+	struct offload *offload;
+
 	/* log lock */
 	struct {
 		pid_t self;
 		int fd;
+		int access_fd; /* -1 without an access log */
 		struct timeval fsync_tv;
 		struct event *fsync_ev;
+		struct slog_async *async; /* log writer thread, see slog.c */
 	} log;
 
 	/* used to log auth message only once */
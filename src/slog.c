@@ -8,6 +8,9 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sched.h>
 
 #include "slog.h"
 #include "server.h"
@@ -17,6 +20,87 @@
 #error "SLOG_MSG_MAX_LEN must be at least 64"
 #endif
 
+/* Asynchronous logging
+ *
+ * Each worker thread formats its lines into a ring of its own, which a
+ * dedicated thread empties with writev. A ring has a single producer and a
+ * single consumer, so they only share its head and tail indexes, updated
+ * with release stores and read with acquire loads. When a ring is full, the
+ * line is either dropped and counted, or the worker waits for the writer to
+ * make room, depending on the "log_async" configuration.
+ *
+ * Threads without a ring, like the main thread, still write synchronously.
+ */
+
+#define SLOG_WRITEV_MAX 64       /* lines per writev call */
+#define SLOG_WRITER_IDLE_MS 10   /* writer sleep when there's nothing to write */
+
+/* each slot of a ring holds the size of its line, followed by the line */
+struct slog_line {
+	unsigned short sz;
+	char data[];
+};
+
+struct slog_ring {
+	char *slots;
+	size_t slot_sz;
+	unsigned int mask;
+	int *fd; /* where the lines go: the log or the access log */
+	unsigned int head;     /* next line to fill, only written by the owner */
+	unsigned int tail;     /* next line to write, only written by the writer */
+	unsigned long dropped; /* only written by the owner */
+	struct slog_ring *next;
+};
+
+struct slog_async {
+	struct server *s;
+	struct slog_ring *rings; /* all created before the writer starts */
+	pthread_t thread;
+	int running;
+	int stop;
+	int fsync_all;          /* copied from the configuration, which can be reloaded */
+	unsigned long reported; /* dropped lines already logged */
+
+	/* wakes up the writer before its timeout */
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+};
+
+/* rings of the current thread, if it has them */
+static __thread struct slog_ring *slog_current = NULL;
+static __thread struct slog_ring *slog_access_current = NULL;
+
+static struct slog_line *
+slog_ring_line(struct slog_ring *r, unsigned int i) {
+	return (struct slog_line *)(r->slots + (size_t)(i & r->mask) * r->slot_sz);
+}
+
+static int
+slog_format(struct server *s, log_level level, const char *body, size_t sz, char *line);
+
+/**
+ * Open the access log, or reopen it on SIGHUP.
+ */
+static void
+slog_access_init(struct server *s) {
+
+	int old_fd = s->log.access_fd;
+
+	if(!s->cfg->access_log) {
+		return;
+	}
+
+	s->log.access_fd = open(s->cfg->access_log,
+		O_WRONLY | O_APPEND | O_CREAT, S_IRUSR|S_IWUSR);
+	if(s->log.access_fd == -1) {
+		fprintf(stderr, "Could not open %s: %s\n", s->cfg->access_log,
+				strerror(errno));
+	}
+	if(old_fd != -1) {
+		close(old_fd);
+	}
+}
+
 /**
  * Initialize log writer.
  */
@@ -24,6 +108,7 @@ void
 slog_init(struct server *s) {
 
 	s->log.self = getpid();
+	slog_access_init(s);
 
 	if(s->cfg->logfile) {
 
@@ -89,21 +174,17 @@ slog_enabled(struct server *s, log_level level) {
 }
 
 /**
- * Write log message to disk, or stderr.
+ * Format a log line, returns its size.
  */
-static void
-slog_internal(struct server *s, log_level level,
-		const char *body, size_t sz) {
+static int
+slog_format(struct server *s, log_level level, const char *body, size_t sz, char *line) {
 
 	const char *c = "EWNIDT";
 	time_t now;
 	struct tm now_tm, *lt_ret;
 	char time_buf[64];
 	char msg[1 + SLOG_MSG_MAX_LEN];
-	char line[2 * SLOG_MSG_MAX_LEN]; /* bounds are checked. */
-	int line_sz, ret;
-
-	if(!s->log.fd) return;
+	int line_sz;
 
 	/* limit message size */
 	sz = sz ? sz:strlen(body);
@@ -121,8 +202,71 @@ slog_internal(struct server *s, log_level level,
 
 	/* generate output line. */
 	char letter = (level == WEBDIS_TRACE ? c[5] : c[level]);
-	line_sz = snprintf(line, sizeof(line),
+	line_sz = snprintf(line, SLOG_LINE_MAX_LEN,
 		"[%d] %s %c %s\n", (int)s->log.self, time_buf, letter, msg);
+	return line_sz < SLOG_LINE_MAX_LEN ? line_sz : SLOG_LINE_MAX_LEN - 1;
+}
+
+static void
+slog_wake_writer(struct slog_async *a) {
+
+	pthread_mutex_lock(&a->lock);
+	pthread_cond_signal(&a->cond);
+	pthread_mutex_unlock(&a->lock);
+}
+
+/**
+ * Queue a line on the current thread's ring.
+ */
+static void
+slog_ring_push(struct slog_async *a, struct slog_ring *r, const char *line, int line_sz) {
+
+	unsigned int head = r->head;
+	unsigned int used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	struct slog_line *l;
+
+	while(used > r->mask) { /* full */
+		if(a->s->cfg->log_async.overflow == LOG_OVERFLOW_DROP
+				|| __atomic_load_n(&a->stop, __ATOMIC_ACQUIRE)) {
+			__atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+			return;
+		}
+		slog_wake_writer(a);
+		sched_yield();
+		used = head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+	}
+
+	l = slog_ring_line(r, head);
+	memcpy(l->data, line, line_sz);
+	l->sz = (unsigned short)line_sz;
+	__atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+	/* don't wait for the timeout if the ring is filling up */
+	if(used + 1 == (r->mask + 1) / 2) {
+		slog_wake_writer(a);
+	}
+}
+
+/**
+ * Write log message to disk, or stderr.
+ */
+static void
+slog_internal(struct server *s, log_level level,
+		const char *body, size_t sz) {
+
+	char line[SLOG_LINE_MAX_LEN];
+	int line_sz, ret;
+	struct slog_async *a = s->log.async;
+
+	if(!s->log.fd) return;
+
+	line_sz = slog_format(s, level, body, sz, line);
+
+	/* leave it to the log writer */
+	if(slog_current && a && __atomic_load_n(&a->running, __ATOMIC_ACQUIRE)) {
+		slog_ring_push(a, slog_current, line, line_sz);
+		return;
+	}
 
 	/* write to log and maybe flush to disk. */
 	ret = write(s->log.fd, line, line_sz);
@@ -133,6 +277,218 @@ slog_internal(struct server *s, log_level level,
 	(void)ret;
 }
 
+/**
+ * Write a line to the access log.
+ */
+void
+slog_access(struct server *s, const char *line, size_t sz) {
+
+	struct slog_async *a = s->log.async;
+	ssize_t ret;
+
+	if(s->log.access_fd < 0 || sz > SLOG_ACCESS_LINE_MAX_LEN) {
+		return;
+	}
+	if(slog_access_current && a && __atomic_load_n(&a->running, __ATOMIC_ACQUIRE)) {
+		slog_ring_push(a, slog_access_current, line, (int)sz);
+		return;
+	}
+	ret = write(s->log.access_fd, line, sz);
+	(void)ret;
+}
+
+/**
+ * Create a ring for a worker thread, for lines up to `line_max` bytes to
+ * be written to `fd`. Returns NULL if logging is synchronous.
+ * Must be called before slog_async_start.
+ */
+struct slog_ring *
+slog_ring_new(struct server *s, int *fd, size_t line_max) {
+
+	struct slog_async *a = s->log.async;
+	struct slog_ring *r;
+
+	if(!s->cfg->log_async.enabled) {
+		return NULL;
+	}
+	if(!a) {
+		if(!(a = calloc(1, sizeof(struct slog_async)))) {
+			return NULL;
+		}
+		a->s = s;
+		pthread_mutex_init(&a->lock, NULL);
+		pthread_cond_init(&a->cond, NULL);
+		s->log.async = a;
+	}
+
+	if(!(r = calloc(1, sizeof(struct slog_ring)))) {
+		return NULL;
+	}
+	r->slot_sz = (sizeof(struct slog_line) + line_max + 7) & ~(size_t)7;
+	if(!(r->slots = malloc(s->cfg->log_async.lines * r->slot_sz))) {
+		free(r);
+		return NULL;
+	}
+	r->mask = s->cfg->log_async.lines - 1;
+	r->fd = fd;
+	r->next = a->rings;
+	a->rings = r;
+	return r;
+}
+
+/**
+ * Use these rings for the lines logged by the current thread.
+ */
+void
+slog_ring_bind(struct slog_ring *log, struct slog_ring *access) {
+
+	slog_current = log;
+	slog_access_current = access;
+}
+
+/**
+ * Write what's queued in a ring, returns the number of lines written.
+ */
+static unsigned int
+slog_ring_flush(struct slog_ring *r) {
+
+	struct iovec iov[SLOG_WRITEV_MAX];
+	unsigned int tail = r->tail;
+	unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	unsigned int count = 0;
+	int fd = __atomic_load_n(r->fd, __ATOMIC_RELAXED);
+
+	while(tail != head) {
+		int n = 0;
+		ssize_t ret;
+
+		for(; tail != head && n < SLOG_WRITEV_MAX; ++tail, ++n) {
+			struct slog_line *l = slog_ring_line(r, tail);
+			iov[n].iov_base = l->data;
+			iov[n].iov_len = l->sz;
+		}
+		ret = writev(fd, iov, n);
+		(void)ret;
+
+		/* the lines can now be reused */
+		__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+		count += n;
+	}
+	return count;
+}
+
+static unsigned int
+slog_async_flush(struct slog_async *a) {
+
+	struct slog_ring *r;
+	unsigned int count = 0;
+	unsigned long dropped = 0;
+	int fd = __atomic_load_n(&a->s->log.fd, __ATOMIC_RELAXED);
+	int ret;
+
+	for(r = a->rings; r; r = r->next) {
+		count += slog_ring_flush(r);
+		dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+
+	/* report lines lost since the last time */
+	if(dropped > a->reported) {
+		char msg[64], line[SLOG_LINE_MAX_LEN];
+		int msg_sz = snprintf(msg, sizeof(msg), "%lu log lines dropped", dropped - a->reported);
+		int line_sz = slog_format(a->s, WEBDIS_WARNING, msg, (size_t)msg_sz, line);
+		ret = write(fd, line, line_sz);
+		a->reported = dropped;
+		count++;
+	}
+
+	if(count && a->fsync_all) {
+		ret = fsync(fd);
+	}
+	(void)ret;
+	return count;
+}
+
+static void *
+slog_writer_main(void *p) {
+
+	struct slog_async *a = p;
+
+	while(1) {
+		int stop = __atomic_load_n(&a->stop, __ATOMIC_ACQUIRE);
+		if(slog_async_flush(a) || stop) {
+			if(stop) break; /* after a last flush */
+			continue;
+		}
+
+		/* idle */
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += SLOG_WRITER_IDLE_MS * 1000000L;
+		if(ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		pthread_mutex_lock(&a->lock);
+		pthread_cond_timedwait(&a->cond, &a->lock, &ts);
+		pthread_mutex_unlock(&a->lock);
+	}
+	return NULL;
+}
+
+/**
+ * Start the log writer, if there are rings to write.
+ */
+void
+slog_async_start(struct server *s) {
+
+	struct slog_async *a = s->log.async;
+
+	if(!a || !a->rings) {
+		return;
+	}
+	a->fsync_all = (s->cfg->log_fsync.mode == LOG_FSYNC_ALL);
+	if(pthread_create(&a->thread, NULL, slog_writer_main, a) == 0) {
+		__atomic_store_n(&a->running, 1, __ATOMIC_RELEASE);
+	}
+}
+
+/**
+ * Write what's left and stop the log writer; lines are written directly after this.
+ */
+void
+slog_async_stop(struct server *s) {
+
+	struct slog_async *a = s->log.async;
+
+	if(!a || !__atomic_load_n(&a->running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	__atomic_store_n(&a->running, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&a->stop, 1, __ATOMIC_RELEASE);
+	if(!pthread_equal(pthread_self(), a->thread)) {
+		slog_wake_writer(a);
+		pthread_join(a->thread, NULL);
+	}
+}
+
+/**
+ * Number of lines dropped because a worker's ring was full.
+ */
+unsigned long
+slog_dropped(struct server *s) {
+
+	struct slog_ring *r;
+	unsigned long dropped = 0;
+
+	if(!s->log.async) {
+		return 0;
+	}
+	for(r = s->log.async->rings; r; r = r->next) {
+		dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+	}
+	return dropped;
+}
+
 /**
  * Thin wrapper around slog_internal that first checks the log level.
  */
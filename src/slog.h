@@ -2,6 +2,8 @@
 #define SLOG_H
 
 #define SLOG_MSG_MAX_LEN 124
+#define SLOG_LINE_MAX_LEN (2 * SLOG_MSG_MAX_LEN)
+#define SLOG_ACCESS_LINE_MAX_LEN 512
 
 typedef enum {
 	WEBDIS_ERROR = 0,
@@ -18,7 +20,13 @@ typedef enum {
 	LOG_FSYNC_ALL
 } log_fsync_mode;
 
+typedef enum {
+	LOG_OVERFLOW_DROP = 0, /* discard the line and count it */
+	LOG_OVERFLOW_WAIT      /* wait for the log writer to make room */
+} log_overflow_policy;
+
 struct server;
+struct slog_ring;
 
 void
 slog_reload();
@@ -29,10 +37,28 @@ slog_init(struct server *s);
 void
 slog_fsync_init(struct server *s);
 
+struct slog_ring *
+slog_ring_new(struct server *s, int *fd, size_t line_max);
+
+void
+slog_ring_bind(struct slog_ring *log, struct slog_ring *access);
+
+void
+slog_async_start(struct server *s);
+
+void
+slog_async_stop(struct server *s);
+
+unsigned long
+slog_dropped(struct server *s);
+
 int
 slog_enabled(struct server *s, log_level level);
 
 void slog(struct server *s, log_level level,
 		const char *body, size_t sz);
 
+void
+slog_access(struct server *s, const char *line, size_t sz);
+
 #endif
@@ -0,0 +1,300 @@
+#include "slowlog.h"
+#include "access.h"
+#include "cmd.h"
+#include "conf.h"
+#include "server.h"
+#include "worker.h"
+
+#include <string.h>
+#include <strings.h>
+#include <stdio.h>
+#include <pthread.h>
+
+/* Slow request log
+ *
+ * Like the Redis SLOWLOG, HTTP requests that took longer than a threshold
+ * are kept with their arguments (truncated) and the time taken by each
+ * phase, in a ring of a fixed size on each worker. Recording is rare, so a
+ * lock per ring is enough for WEBDIS.SLOWLOG to read them from any worker.
+ */
+
+struct slowlog {
+	pthread_mutex_t lock;
+	struct slowlog_entry *entries;
+	unsigned int max_len;
+	unsigned int count;
+	unsigned int next; /* slot written next, holding the oldest entry once full */
+};
+
+static unsigned long long slowlog_next_id = 0;
+
+struct slowlog *
+slowlog_new(unsigned int max_len) {
+
+	struct slowlog *l;
+
+	if(max_len == 0 || !(l = calloc(1, sizeof(struct slowlog)))) {
+		return NULL;
+	}
+	if(!(l->entries = calloc(max_len, sizeof(struct slowlog_entry)))) {
+		free(l);
+		return NULL;
+	}
+	l->max_len = max_len;
+	pthread_mutex_init(&l->lock, NULL);
+	return l;
+}
+
+static int
+slowlog_arg_is(const struct cmd *cmd, int i, const char *s) {
+
+	return i < cmd->count && cmd->argv_len[i] == strlen(s) && strncasecmp(cmd->argv[i], s, cmd->argv_len[i]) == 0;
+}
+
+/* mark the arguments holding passwords, which Redis doesn't log either */
+static void
+slowlog_redact(const struct cmd *cmd, unsigned char *redact, unsigned int argc) {
+
+	unsigned int i, from = argc;
+
+	if(slowlog_arg_is(cmd, 0, "AUTH")) {
+		from = 1;
+	} else if(slowlog_arg_is(cmd, 0, "ACL") && slowlog_arg_is(cmd, 1, "SETUSER")) {
+		from = 3;
+	} else if(slowlog_arg_is(cmd, 0, "CONFIG") && slowlog_arg_is(cmd, 1, "SET")) {
+		for(i = 2; i + 1 < argc; i += 2) {
+			if(slowlog_arg_is(cmd, (int)i, "requirepass") || slowlog_arg_is(cmd, (int)i, "masterauth")) {
+				redact[i + 1] = 1;
+			}
+		}
+	} else if(slowlog_arg_is(cmd, 0, "HELLO")) {
+		for(i = 2; i < argc; ++i) {
+			if(slowlog_arg_is(cmd, (int)i, "AUTH")) { /* followed by the user and password */
+				unsigned int j;
+				for(j = i + 1; j <= i + 2 && j < argc; ++j) {
+					redact[j] = 1;
+				}
+				i += 2;
+			}
+		}
+	} else if(slowlog_arg_is(cmd, 0, "MIGRATE")) {
+		for(i = 6; i < argc && !slowlog_arg_is(cmd, (int)i, "KEYS"); ++i) {
+			if(slowlog_arg_is(cmd, (int)i, "AUTH") && i + 1 < argc) {
+				redact[++i] = 1;
+			} else if(slowlog_arg_is(cmd, (int)i, "AUTH2") && i + 2 < argc) {
+				redact[i + 1] = redact[i + 2] = 1;
+				i += 2;
+			}
+		}
+	}
+	for(i = from; i < argc; ++i) {
+		redact[i] = 1;
+	}
+}
+
+/* copy the arguments, noting what was left out like Redis does */
+static int
+slowlog_copy_args(struct slowlog_entry *e, const struct cmd *cmd) {
+
+	unsigned int i, argc = cmd->count < SLOWLOG_MAX_ARGC ? (unsigned int)cmd->count : SLOWLOG_MAX_ARGC;
+	unsigned char redact[SLOWLOG_MAX_ARGC] = {0};
+	size_t sz = 0;
+	char *p;
+
+	for(i = 0; i < argc; ++i) {
+		size_t len = cmd->argv_len[i];
+		sz += (len > SLOWLOG_MAX_ARG_LEN ? SLOWLOG_MAX_ARG_LEN : len) + 48; /* room for a note */
+	}
+	e->argv_len = malloc((argc ? argc : 1) * sizeof(size_t));
+	e->args = malloc(sz ? sz : 1);
+	if(!e->argv_len || !e->args) {
+		free(e->argv_len);
+		free(e->args);
+		return -1;
+	}
+	slowlog_redact(cmd, redact, argc);
+
+	for(i = 0, p = e->args; i < argc; ++i) {
+		size_t len = cmd->argv_len[i];
+		if(i == SLOWLOG_MAX_ARGC - 1 && (unsigned int)cmd->count > SLOWLOG_MAX_ARGC) {
+			e->argv_len[i] = (size_t)sprintf(p, "... (%d more arguments)", cmd->count - (int)i);
+		} else if(redact[i]) {
+			e->argv_len[i] = (size_t)sprintf(p, "(redacted)");
+		} else if(len > SLOWLOG_MAX_ARG_LEN) {
+			memcpy(p, cmd->argv[i], SLOWLOG_MAX_ARG_LEN);
+			e->argv_len[i] = SLOWLOG_MAX_ARG_LEN + (size_t)sprintf(p + SLOWLOG_MAX_ARG_LEN,
+				"... (%zu more bytes)", len - SLOWLOG_MAX_ARG_LEN);
+		} else {
+			memcpy(p, cmd->argv[i], len);
+			e->argv_len[i] = len;
+		}
+		p += e->argv_len[i];
+	}
+	e->argc = argc;
+	return 0;
+}
+
+/**
+ * Keep this request if it was slow, called once its response is ready.
+ */
+void
+slowlog_record(const struct cmd *cmd, size_t reply_size) {
+
+	const struct access_timing *t = &cmd->timing;
+	struct slowlog *l;
+	struct slowlog_entry e, old;
+	long long slower_than;
+	uint64_t now, reply, parsed;
+
+	if(!t->start || !cmd->w || !(l = cmd->w->slowlog)) {
+		return;
+	}
+	slower_than = cmd->w->s->cfg->slowlog.slower_than_us;
+	now = access_now_us();
+	if(slower_than < 0 || now - t->start < (uint64_t)slower_than) {
+		return;
+	}
+
+	memset(&e, 0, sizeof(e));
+	if(slowlog_copy_args(&e, cmd) < 0) {
+		return;
+	}
+	reply = t->reply ? t->reply : now;
+	parsed = t->sent ? t->sent : reply;
+	e.id = __atomic_fetch_add(&slowlog_next_id, 1, __ATOMIC_RELAXED);
+	e.time = time(NULL);
+	e.parse_us = parsed - t->start;
+	e.redis_us = t->sent ? reply - t->sent : 0;
+	e.format_us = now - reply;
+	e.total_us = now - t->start;
+	e.addr = cmd->addr;
+	e.db = cmd->database;
+	e.reply_size = reply_size;
+
+	pthread_mutex_lock(&l->lock);
+	old = l->entries[l->next];
+	l->entries[l->next] = e;
+	l->next = (l->next + 1) % l->max_len;
+	if(l->count < l->max_len) {
+		l->count++;
+	}
+	pthread_mutex_unlock(&l->lock);
+
+	free(old.argv_len);
+	free(old.args);
+}
+
+static int
+slowlog_cmp_newest(const void *a, const void *b) {
+
+	const struct slowlog_entry *ea = a, *eb = b;
+	return ea->id < eb->id ? 1 : (ea->id > eb->id ? -1 : 0);
+}
+
+static int
+slowlog_copy_entry(struct slowlog_entry *dst, const struct slowlog_entry *src) {
+
+	size_t sz = 0;
+	unsigned int i;
+
+	for(i = 0; i < src->argc; ++i) {
+		sz += src->argv_len[i];
+	}
+	*dst = *src;
+	dst->argv_len = malloc((src->argc ? src->argc : 1) * sizeof(size_t));
+	dst->args = malloc(sz ? sz : 1);
+	if(!dst->argv_len || !dst->args) {
+		free(dst->argv_len);
+		free(dst->args);
+		return -1;
+	}
+	memcpy(dst->argv_len, src->argv_len, src->argc * sizeof(size_t));
+	memcpy(dst->args, src->args, sz);
+	return 0;
+}
+
+/**
+ * Copy the entries of all workers, newest first. Returns how many were copied.
+ */
+size_t
+slowlog_copy(struct server *s, struct slowlog_entry **out) {
+
+	struct slowlog_entry *entries = NULL, *tmp;
+	size_t count = 0;
+	unsigned int i;
+	int n;
+
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct slowlog *l = s->w[n]->slowlog;
+		if(!l) {
+			continue;
+		}
+		pthread_mutex_lock(&l->lock);
+		if(l->count && (tmp = realloc(entries, (count + l->count) * sizeof(struct slowlog_entry)))) {
+			entries = tmp;
+			for(i = 0; i < l->count; ++i) {
+				if(slowlog_copy_entry(&entries[count], &l->entries[i]) == 0) {
+					count++;
+				}
+			}
+		}
+		pthread_mutex_unlock(&l->lock);
+	}
+	if(count > 1) {
+		qsort(entries, count, sizeof(struct slowlog_entry), slowlog_cmp_newest);
+	}
+	*out = entries;
+	return count;
+}
+
+void
+slowlog_free_entries(struct slowlog_entry *e, size_t count) {
+
+	size_t i;
+
+	for(i = 0; i < count; ++i) {
+		free(e[i].argv_len);
+		free(e[i].args);
+	}
+	free(e);
+}
+
+size_t
+slowlog_len(struct server *s) {
+
+	size_t count = 0;
+	int n;
+
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct slowlog *l = s->w[n]->slowlog;
+		if(l) {
+			pthread_mutex_lock(&l->lock);
+			count += l->count;
+			pthread_mutex_unlock(&l->lock);
+		}
+	}
+	return count;
+}
+
+void
+slowlog_reset(struct server *s) {
+
+	unsigned int i;
+	int n;
+
+	for(n = 0; n < s->cfg->http_threads; ++n) {
+		struct slowlog *l = s->w[n]->slowlog;
+		if(!l) {
+			continue;
+		}
+		pthread_mutex_lock(&l->lock);
+		for(i = 0; i < l->count; ++i) {
+			free(l->entries[i].argv_len);
+			free(l->entries[i].args);
+		}
+		memset(l->entries, 0, l->max_len * sizeof(struct slowlog_entry));
+		l->count = 0;
+		l->next = 0;
+		pthread_mutex_unlock(&l->lock);
+	}
+}
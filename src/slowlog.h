@@ -0,0 +1,48 @@
+#ifndef SLOWLOG_H
+#define SLOWLOG_H
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+struct cmd;
+struct server;
+struct slowlog;
+
+#define SLOWLOG_MAX_ARGC 32     /* arguments kept per entry */
+#define SLOWLOG_MAX_ARG_LEN 128 /* bytes kept per argument */
+
+struct slowlog_entry {
+	unsigned long long id;
+	time_t time;
+	uint64_t parse_us, redis_us, format_us, total_us;
+	in_addr_t addr;
+	int db;
+	size_t reply_size;
+
+	/* arguments, the last ones replaced by a note if there were too many */
+	unsigned int argc;
+	size_t *argv_len;
+	char *args; /* all the arguments, one after the other */
+};
+
+struct slowlog *
+slowlog_new(unsigned int max_len);
+
+void
+slowlog_record(const struct cmd *cmd, size_t reply_size);
+
+size_t
+slowlog_copy(struct server *s, struct slowlog_entry **out);
+
+void
+slowlog_free_entries(struct slowlog_entry *e, size_t count);
+
+size_t
+slowlog_len(struct server *s);
+
+void
+slowlog_reset(struct server *s);
+
+#endif
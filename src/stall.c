@@ -0,0 +1,136 @@
+#include "stall.h"
+#include "access.h"
+#include "cmd.h"
+#include "conf.h"
+#include "server.h"
+#include "worker.h"
+#include "metrics.h"
+#include "slog.h"
+
+#include <string.h>
+#include <stdio.h>
+#include <event.h>
+
+/* Event loop stall detector
+ *
+ * Each worker runs a timer every few milliseconds and measures how late it
+ * fires: a callback that blocks the loop (formatting a huge reply, a log
+ * line written synchronously...) delays it by as long. The lag goes to a
+ * histogram in the metrics, and when it exceeds a threshold a warning is
+ * logged along with the slowest reply formatted since the previous tick,
+ * which is the usual culprit.
+ */
+
+struct stall {
+	struct worker *w;
+	struct event ev;
+	struct timeval tv;
+	uint64_t interval_us;
+	uint64_t armed; /* when the timer was last added */
+
+	/* slowest reply formatted since the last tick */
+	uint64_t longest_us;
+	char longest[STALL_NAME_MAX_LEN + 1];
+};
+
+struct stall *
+stall_new(struct worker *w) {
+
+	struct stall *st;
+	int interval_ms = w->s->cfg->stall_detector.interval_ms;
+
+	if(interval_ms <= 0 || !(st = calloc(1, sizeof(struct stall)))) {
+		return NULL;
+	}
+	st->w = w;
+	st->interval_us = (uint64_t)interval_ms * 1000;
+	st->tv.tv_sec = interval_ms / 1000;
+	st->tv.tv_usec = (interval_ms % 1000) * 1000;
+	return st;
+}
+
+static void
+stall_tick(int fd, short event, void *ptr) {
+
+	struct stall *st = ptr;
+	uint64_t now = access_now_us(), lag = 0, threshold_us;
+
+	(void)fd;
+	(void)event;
+
+	if(now > st->armed + st->interval_us) {
+		lag = now - st->armed - st->interval_us;
+	}
+	metrics_loop_lag(lag);
+
+	threshold_us = (uint64_t)st->w->s->cfg->stall_detector.threshold_ms * 1000;
+	if(threshold_us && (lag >= threshold_us || st->longest_us >= threshold_us)) {
+		char msg[128];
+		int msg_sz;
+		if(lag < threshold_us) { /* the callback ended before the timer was due */
+			msg_sz = snprintf(msg, sizeof(msg), "Event loop blocked for %llu ms formatting the reply to %s",
+				(unsigned long long)(st->longest_us / 1000), st->longest);
+		} else if(st->longest_us) {
+			msg_sz = snprintf(msg, sizeof(msg), "Event loop blocked for %llu ms, slowest reply: %s (%llu ms)",
+				(unsigned long long)(lag / 1000), st->longest, (unsigned long long)(st->longest_us / 1000));
+		} else {
+			msg_sz = snprintf(msg, sizeof(msg), "Event loop blocked for %llu ms",
+				(unsigned long long)(lag / 1000));
+		}
+		slog(st->w->s, WEBDIS_WARNING, msg, (size_t)msg_sz);
+		metrics_add(METRICS_LOOP_STALLS, 1);
+	}
+	st->longest_us = 0;
+
+	/* re-armed from now rather than persistent, to measure from a known time */
+	st->armed = access_now_us();
+	evtimer_add(&st->ev, &st->tv);
+}
+
+/**
+ * Start the timer, on the worker's thread once its event base exists.
+ */
+void
+stall_start(struct stall *st) {
+
+	if(!st) return;
+	evtimer_set(&st->ev, stall_tick, st);
+	event_base_set(st->w->base, &st->ev);
+	st->armed = access_now_us();
+	evtimer_add(&st->ev, &st->tv);
+}
+
+/**
+ * Start timing the formatting of a reply; its command may be freed by then.
+ */
+void
+stall_mark(struct stall *st, struct stall_mark *m, const struct cmd *cmd) {
+
+	if(!st) return;
+	m->start = cmd->timing.reply ? cmd->timing.reply : access_now_us();
+	m->len = 0;
+	if(cmd->count) {
+		m->len = cmd->argv_len[0] < STALL_NAME_MAX_LEN ? cmd->argv_len[0] : STALL_NAME_MAX_LEN;
+		memcpy(m->name, cmd->argv[0], m->len);
+	}
+}
+
+void
+stall_check(struct stall *st, const struct stall_mark *m) {
+
+	uint64_t us;
+	size_t i;
+
+	if(!st) return;
+	if((us = access_now_us() - m->start) > st->longest_us) {
+		st->longest_us = us;
+		for(i = 0; i < m->len; ++i) { /* printable, for the log */
+			char c = m->name[i];
+			st->longest[i] = (c > 32 && c < 127) ? c : '?';
+		}
+		st->longest[m->len] = 0;
+		if(!m->len) {
+			strcpy(st->longest, "-");
+		}
+	}
+}
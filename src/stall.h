@@ -0,0 +1,32 @@
+#ifndef STALL_H
+#define STALL_H
+
+#include <stdlib.h>
+#include <stdint.h>
+
+struct worker;
+struct cmd;
+struct stall;
+
+#define STALL_NAME_MAX_LEN 31
+
+/* a callback being timed, kept on the stack while it runs */
+struct stall_mark {
+	uint64_t start;
+	size_t len;
+	char name[STALL_NAME_MAX_LEN + 1];
+};
+
+struct stall *
+stall_new(struct worker *w);
+
+void
+stall_start(struct stall *st);
+
+void
+stall_mark(struct stall *st, struct stall_mark *m, const struct cmd *cmd);
+
+void
+stall_check(struct stall *st, const struct stall_mark *m);
+
+#endif
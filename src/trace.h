@@ -0,0 +1,53 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/* USDT probes
+ *
+ * Static tracepoints on the lifecycle of a request, for bpftrace, perf or
+ * SystemTap. They are built in when <sys/sdt.h> is available (see the
+ * Makefile) and each one is a single nop until a tracer attaches to it.
+ * Requests can be followed from one probe to the next by their fd.
+ *
+ *   webdis:accept   (int fd, uint32_t addr)              client connected
+ *   webdis:request  (int fd, char *path, size_t path_sz,
+ *                    size_t request_sz)                  HTTP request parsed
+ *   webdis:dispatch (int fd, char *cmd, size_t cmd_sz,
+ *                    int argc)                           command sent to Redis
+ *   webdis:reply    (int fd, char *cmd, size_t cmd_sz,
+ *                    int type)                           reply to format, type -1 if Redis was lost
+ *   webdis:write    (int fd, ssize_t written,
+ *                    size_t remaining)                   HTTP response written
+ *   webdis:ws_write (int fd, ssize_t written,
+ *                    size_t remaining)                   WebSocket frames written
+ *
+ * Command names are not NUL-terminated, use their size.
+ */
+
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+
+#define TRACE_ACCEPT(fd, addr) \
+	DTRACE_PROBE2(webdis, accept, fd, addr)
+#define TRACE_REQUEST(fd, path, path_sz, request_sz) \
+	DTRACE_PROBE4(webdis, request, fd, path, path_sz, request_sz)
+#define TRACE_DISPATCH(cmd) \
+	DTRACE_PROBE4(webdis, dispatch, (cmd)->fd, (cmd)->argv[0], (cmd)->argv_len[0], (cmd)->count)
+#define TRACE_REPLY(cmd, reply) \
+	DTRACE_PROBE4(webdis, reply, (cmd)->fd, (cmd)->argv[0], (cmd)->argv_len[0], (reply) ? (reply)->type : -1)
+#define TRACE_WRITE(fd, written, remaining) \
+	DTRACE_PROBE3(webdis, write, fd, written, remaining)
+#define TRACE_WS_WRITE(fd, written, remaining) \
+	DTRACE_PROBE3(webdis, ws_write, fd, written, remaining)
+
+#else
+
+#define TRACE_ACCEPT(fd, addr) do {} while(0)
+#define TRACE_REQUEST(fd, path, path_sz, request_sz) do {} while(0)
+#define TRACE_DISPATCH(cmd) do {} while(0)
+#define TRACE_REPLY(cmd, reply) do {} while(0)
+#define TRACE_WRITE(fd, written, remaining) do {} while(0)
+#define TRACE_WS_WRITE(fd, written, remaining) do {} while(0)
+
+#endif
+
+#endif
@@ -10,6 +10,12 @@
 #include "slog.h"
 #include "server.h"
 #include "conf.h"
+#include "compress.h"
+#include "fanout.h"
+#include "batch.h"
+#include "internal.h"
+#include "metrics.h"
+#include "trace.h"
 
 /* message parsers */
 #include "formats/json.h"
@@ -20,11 +26,25 @@
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <strings.h>
 #include <sys/param.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/* bounds for the amount written to the socket in a single callback */
+#define WS_WRITE_MIN_SZ (4*1024)
+#define WS_WRITE_MAX_SZ (256*1024)
 
 static int
 ws_schedule_write(struct ws_client *ws);
 
+static void
+ws_msg_free(struct ws_msg *m);
+
+static int
+ws_send_frame(struct ws_client *ws, unsigned char first_byte, const char *p, size_t sz);
+
 /**
  * This code uses the WebSocket specification from RFC 6455.
  * A copy is available at http://www.rfc-editor.org/rfc/rfc6455.txt
@@ -110,6 +130,8 @@ ws_client_new(struct http_client *http_client) {
 	ws->rbuf = rbuf;
 	ws->wbuf = wbuf;
 	ws->ac = ac;
+	ws->write_sz = WS_WRITE_MIN_SZ;
+	LIST_INIT(&ws->pending);
 
 	return ws;
 }
@@ -128,15 +150,152 @@ ws_client_free(struct ws_client *ws) {
 	}
 	evbuffer_free(ws->rbuf);
 	evbuffer_free(ws->wbuf);
+	if(ws->frame.msg) ws_msg_free(ws->frame.msg);
+	if(ws->frame.control) ws_msg_free(ws->frame.control);
+	compress_stream_free(ws->pmd.deflate);
+	decompress_stream_free(ws->pmd.inflate);
+	if(ws->reader) redisReaderFree(ws->reader);
 	if(ws->cmd) {
 		ws->cmd->ac = NULL; /* we've just free'd it */
 		cmd_free(ws->cmd);
 	}
+	/* replies still expected from the pool will be discarded */
+	while(!LIST_EMPTY(&ws->pending)) {
+		struct cmd *cmd = LIST_FIRST(&ws->pending);
+		LIST_REMOVE(cmd, ws_entries);
+		cmd->ws_pending = 0;
+		cmd->http_client = NULL;
+	}
+	while(ws->sub_ids) {
+		struct ws_sub_id *next = ws->sub_ids->next;
+		free(ws->sub_ids->channel);
+		free(ws->sub_ids->id);
+		free(ws->sub_ids);
+		ws->sub_ids = next;
+	}
 	free(ws);
 	if(c) http_client_free(c);
 }
 
 
+static int
+ws_token_is(const char *p, const char *end, const char *token) {
+	size_t sz = strlen(token);
+	return (size_t)(end - p) == sz && strncasecmp(p, token, sz) == 0;
+}
+
+static const char *
+ws_skip_spaces(const char *p, const char *end) {
+	while(p < end && (*p == ' ' || *p == '\t')) p++;
+	return p;
+}
+
+/**
+ * Accept a single permessage-deflate offer (RFC 7692, section 7) if we can,
+ * writing the parameters of our response to `out`. Returns the response size,
+ * or 0 to decline the offer.
+ */
+static int
+ws_deflate_offer(struct ws_client *ws, const char *p, const char *end, char *out, size_t out_sz) {
+
+	struct conf *cfg = ws->http_client->s->cfg;
+	int server_bits = cfg->ws_deflate.server_max_window_bits;
+	int client_bits = 0; /* non-zero if the client can limit its own window */
+	int server_nct = cfg->ws_deflate.server_no_context_takeover;
+	int client_nct = cfg->ws_deflate.client_no_context_takeover;
+	const char *name, *name_end, *val, *val_end;
+	int n, bits;
+
+	/* extension name */
+	p = ws_skip_spaces(p, end);
+	name = p;
+	while(p < end && *p != ';' && *p != ' ' && *p != '\t') p++;
+	if(!ws_token_is(name, p, "permessage-deflate")) {
+		return 0;
+	}
+
+	/* parameters, with optional (and possibly quoted) values */
+	while((p = ws_skip_spaces(p, end)) < end) {
+		if(*p != ';') {
+			return 0;
+		}
+		p = ws_skip_spaces(p + 1, end);
+		name = p;
+		while(p < end && *p != '=' && *p != ';' && *p != ' ' && *p != '\t') p++;
+		name_end = p;
+		val = val_end = NULL;
+		p = ws_skip_spaces(p, end);
+		if(p < end && *p == '=') {
+			p = ws_skip_spaces(p + 1, end);
+			if(p < end && *p == '"') p++;
+			val = p;
+			while(p < end && *p != ';' && *p != '"' && *p != ' ' && *p != '\t') p++;
+			val_end = p;
+			if(p < end && *p == '"') p++;
+		}
+		bits = (val && val_end - val <= 2) ? atoi(val) : 0;
+
+		if(ws_token_is(name, name_end, "server_no_context_takeover") && !val) {
+			server_nct = 1;
+		} else if(ws_token_is(name, name_end, "client_no_context_takeover") && !val) {
+			client_nct = 1;
+		} else if(ws_token_is(name, name_end, "server_max_window_bits") && val) {
+			if(bits < 9 || bits > 15) { /* zlib can't produce 256-byte windows */
+				return 0;
+			}
+			server_bits = MIN(server_bits, bits);
+		} else if(ws_token_is(name, name_end, "client_max_window_bits")) {
+			if(val && (bits < 8 || bits > 15)) {
+				return 0;
+			}
+			client_bits = val ? bits : 15;
+		} else {
+			return 0; /* unknown or invalid parameter */
+		}
+	}
+
+	ws->pmd.enabled = 1;
+	ws->pmd.server_max_window_bits = server_bits;
+	ws->pmd.server_no_context_takeover = server_nct;
+	ws->pmd.client_no_context_takeover = client_nct;
+
+	n = snprintf(out, out_sz, "permessage-deflate%s%s",
+		server_nct ? "; server_no_context_takeover" : "",
+		client_nct ? "; client_no_context_takeover" : "");
+	if(server_bits < 15) {
+		n += snprintf(out + n, out_sz - n, "; server_max_window_bits=%d", server_bits);
+	}
+	if(client_bits && cfg->ws_deflate.client_max_window_bits < client_bits) {
+		n += snprintf(out + n, out_sz - n, "; client_max_window_bits=%d", cfg->ws_deflate.client_max_window_bits);
+	}
+	return n;
+}
+
+/**
+ * Pick the first acceptable permessage-deflate offer, if compression is enabled.
+ */
+static int
+ws_negotiate_deflate(struct ws_client *ws, char *out, size_t out_sz) {
+
+	const char *p, *end, *offer_end;
+
+	if(!ws->http_client->s->cfg->ws_deflate.enabled
+			|| !(p = client_get_header(ws->http_client, "Sec-WebSocket-Extensions"))) {
+		return 0;
+	}
+
+	end = p + strlen(p);
+	for(; p < end; p = offer_end + 1) {
+		int n;
+		offer_end = memchr(p, ',', end - p);
+		if(!offer_end) offer_end = end;
+		if((n = ws_deflate_offer(ws, p, offer_end, out, out_sz)) > 0) {
+			return n;
+		}
+	}
+	return 0;
+}
+
 int
 ws_handshake_reply(struct ws_client *ws) {
 
@@ -144,7 +303,8 @@ ws_handshake_reply(struct ws_client *ws) {
 	char sha1_handshake[40];
 	char *buffer = NULL, *p;
 	const char *origin = NULL, *host = NULL;
-	size_t origin_sz = 0, host_sz = 0, handshake_sz = 0, sz;
+	char ext[160];
+	size_t origin_sz = 0, host_sz = 0, handshake_sz = 0, ext_sz, sz;
 
 	char template_start[] = "HTTP/1.1 101 Switching Protocols\r\n"
 		"Upgrade: websocket\r\n"
@@ -153,6 +313,8 @@ ws_handshake_reply(struct ws_client *ws) {
 		"Sec-WebSocket-Accept: "; /* %s */
 	char template_sec_origin[] = "\r\n"
 		"Sec-WebSocket-Origin: "; /* %s (optional header) */
+	char template_ext[] = "\r\n"
+		"Sec-WebSocket-Extensions: "; /* %s (if negotiated) */
 	char template_loc[] = "\r\n"
 		"Sec-WebSocket-Location: ws://"; /* %s%s */
 	char template_end[] = "\r\n\r\n";
@@ -178,10 +340,12 @@ ws_handshake_reply(struct ws_client *ws) {
 		slog(c->s, WEBDIS_WARNING, "Failed to compute handshake", 0);
 		return -1;
 	}
+	ext_sz = ws_negotiate_deflate(ws, ext, sizeof(ext));
 
 	sz = sizeof(template_start)-1
 		+ sizeof(template_accept)-1 + handshake_sz
 		+ (origin && origin_sz ? (sizeof(template_sec_origin)-1 + origin_sz) : 0) /* optional origin */
+		+ (ext_sz ? (sizeof(template_ext)-1 + ext_sz) : 0) /* optional extension */
 		+ sizeof(template_loc)-1 + host_sz + c->path_sz
 		+ sizeof(template_end)-1;
 
@@ -211,6 +375,14 @@ ws_handshake_reply(struct ws_client *ws) {
 		p += origin_sz;
 	}
 
+	/* template_ext */
+	if(ext_sz) {
+		memcpy(p, template_ext, sizeof(template_ext)-1);
+		p += sizeof(template_ext)-1;
+		memcpy(p, ext, ext_sz);
+		p += ext_sz;
+	}
+
 	/* template_loc */
 	memcpy(p, template_loc, sizeof(template_loc)-1);
 	p += sizeof(template_loc)-1;
@@ -266,85 +438,381 @@ ws_log_unauthorized(struct ws_client *ws) {
 }
 
 
+/* Envelopes
+ *
+ * JSON clients can send {"id": ..., "cmd": [...]} instead of a bare array.
+ * The ID is added to the reply, so commands can run concurrently over the
+ * worker's connection pool and their replies arrive in any order, next to
+ * pub/sub messages from the client's own connection. (Un)subscribe commands
+ * still use that connection, and their ID is added to the messages they
+ * produce for each channel or pattern.
+ */
+
 static int
-ws_execute(struct ws_client *ws, struct ws_msg *msg) {
+ws_is_envelope(const char *p, size_t sz) {
 
-	struct http_client *c = ws->http_client;
-	struct cmd*(*fun_extract)(struct http_client *, const char *, size_t) = NULL;
-	formatting_fun fun_reply = NULL;
-	ws_error_fun fun_error = NULL;
+	const char *end = p + sz;
+	while(p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')) p++;
+	return p < end && *p == '{';
+}
 
-	if((c->path_sz == 1 && strncmp(c->path, "/", 1) == 0) ||
-	   strncmp(c->path, "/.json", 6) == 0) {
-		fun_extract = json_ws_extract;
-		fun_reply = json_reply;
-		fun_error = json_ws_error;
-	} else if(strncmp(c->path, "/.raw", 5) == 0) {
-		fun_extract = raw_ws_extract;
-		fun_reply = raw_reply;
-		fun_error = raw_ws_error;
+/**
+ * Send a JSON object with the request ID as its first key, if there is one.
+ */
+int
+ws_send_reply(struct ws_client *ws, const char *id, const char *p, size_t sz) {
+
+	char *out;
+	size_t id_sz, out_sz;
+	int ret;
+
+	if(!id || sz < 2 || p[0] != '{') {
+		return ws_frame_and_send_response(ws, WS_BINARY_FRAME, p, sz);
 	}
 
-	if(fun_extract) {
+	/* {"id":<id>, followed by the rest of the object */
+	id_sz = strlen(id);
+	out_sz = 6 + id_sz + (sz > 2 ? 1 : 0) + sz - 1;
+	if(!(out = malloc(out_sz))) {
+		return -1;
+	}
+	memcpy(out, "{\"id\":", 6);
+	memcpy(out + 6, id, id_sz);
+	if(sz > 2) {
+		out[6 + id_sz] = ',';
+	}
+	memcpy(out + out_sz - (sz - 1), p + 1, sz - 1);
 
-		/* Parse websocket frame into a cmd object. */
-		struct cmd *cmd = fun_extract(c, msg->payload, msg->payload_sz);
+	ret = ws_frame_and_send_response(ws, WS_BINARY_FRAME, out, out_sz);
+	free(out);
+	return ret;
+}
 
-		if(cmd) {
-			cmd->is_websocket = 1;
-
-			if(ws->cmd != NULL) {
-				/* This client already has its own connection to Redis
-				   from a previous command; use it from now on. */
-
-				/* free args for the previous cmd */
-				cmd_free_argv(ws->cmd);
-				/* copy args from what we just parsed to the persistent command */
-				ws->cmd->count = cmd->count;
-				ws->cmd->argv = cmd->argv;
-				ws->cmd->argv_len = cmd->argv_len;
-				ws->cmd->pub_sub_client = c; /* mark as persistent, otherwise the Redis context will be freed */
-
-				cmd->argv = NULL;
-				cmd->argv_len = NULL;
-				cmd->count = 0;
-				cmd_free(cmd);
-
-				cmd = ws->cmd; /* replace pointer since we're about to pass it to cmd_send */
-			} else {
-				/* copy client info into cmd. */
-				cmd_setup(cmd, c);
-
-				/* First WS command; use Redis context from WS client. */
-				cmd->ac = ws->ac;
-				ws->cmd = cmd;
-				cmd->pub_sub_client = c;
-			}
+static void
+ws_send_error(struct ws_client *ws, const char *id, ws_error_fun fun_error, int status, const char *msg) {
+
+	size_t error_sz;
+	char *error = fun_error(status, msg, strlen(msg), &error_sz);
+	if(error) {
+		ws_send_reply(ws, id, error, error_sz);
+		free(error);
+	}
+}
+
+static struct ws_sub_id *
+ws_sub_id_find(struct ws_client *ws, const char *channel, size_t channel_sz, struct ws_sub_id ***prev) {
+
+	struct ws_sub_id *e, **p;
+
+	for(p = &ws->sub_ids; (e = *p); p = &e->next) {
+		if(e->channel_sz == channel_sz && memcmp(e->channel, channel, channel_sz) == 0) {
+			if(prev) *prev = p;
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void
+ws_sub_id_set(struct ws_sub_id *e, const char *id) {
+
+	char *dup = strdup(id);
+	if(dup) {
+		free(e->id);
+		e->id = dup;
+	}
+}
+
+/**
+ * Remember the ID of an envelope for the channels of a (un)subscribe command.
+ */
+static void
+ws_sub_ids_update(struct ws_client *ws, struct cmd *cmd, const char *id) {
+
+	struct ws_sub_id *e;
+	int i;
+
+	if(cmd->count == 1) { /* unsubscribe from everything */
+		for(e = ws->sub_ids; e; e = e->next) {
+			ws_sub_id_set(e, id);
+		}
+		return;
+	}
 
-			int is_subscribe = cmd_is_subscribe_args(cmd);
-			int is_unsubscribe = cmd_is_unsubscribe_args(cmd);
-
-			/* check that the client is able to run this command */
-			if(!acl_allow_command(cmd, c->s->cfg, c)) {
-				const char forbidden[] = "Forbidden";
-				size_t error_sz;
-				char *error = fun_error(403, forbidden, sizeof(forbidden)-1, &error_sz);
-				ws_frame_and_send_response(ws, WS_BINARY_FRAME, error, error_sz);
-				free(error);
-				/* similar to HTTP: log command first and then rejection, both with "WS: " prefix */
-				ws_log_cmd(ws, cmd);
-				ws_log_unauthorized(ws);
-			} else if(ws->ran_subscribe && !is_subscribe && !is_unsubscribe) { /* disallow non-subscribe commands after a subscribe */
-				char error_msg[] = "Command not allowed after subscribe";
-				ws_frame_and_send_response(ws, WS_BINARY_FRAME, error_msg, sizeof(error_msg)-1);
-			} else { /* log and execute */
-				ws_log_cmd(ws, cmd);
-				cmd_send(cmd, fun_reply);
-				ws->ran_subscribe = is_subscribe;
+	for(i = 1; i < cmd->count; ++i) {
+		if(!(e = ws_sub_id_find(ws, cmd->argv[i], cmd->argv_len[i], NULL))) {
+			if(!(e = calloc(1, sizeof(struct ws_sub_id)))
+					|| !(e->channel = malloc(cmd->argv_len[i]))) {
+				free(e);
+				continue;
 			}
+			memcpy(e->channel, cmd->argv[i], cmd->argv_len[i]);
+			e->channel_sz = cmd->argv_len[i];
+			e->next = ws->sub_ids;
+			ws->sub_ids = e;
+		}
+		ws_sub_id_set(e, id);
+	}
+}
+
+/**
+ * Set the ID to add to a pub/sub reply for an envelope client, from its channel.
+ * Called on the client's persistent command before formatting the reply, the
+ * ID is cleared once it's sent.
+ */
+void
+ws_envelope_tag(struct cmd *cmd, const struct redisReply *r) {
+
+	struct ws_client *ws;
+	struct ws_sub_id *e, **prev;
+
+	if(!cmd->is_websocket || !cmd->http_client || !(ws = cmd->http_client->ws) || ws->cmd != cmd) {
+		return;
+	}
+	if(!ws->sub_ids || (r->type != REDIS_REPLY_ARRAY && r->type != REDIS_REPLY_PUSH)
+			|| r->elements < 2 || r->element[0]->type != REDIS_REPLY_STRING
+			|| r->element[1]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+	if(!(e = ws_sub_id_find(ws, r->element[1]->str, r->element[1]->len, &prev))) {
+		return;
+	}
+	if(cmd->ws_id_free) {
+		free(cmd->ws_id);
+	}
+	cmd->ws_id_free = 0;
+
+	if(strcasecmp(r->element[0]->str, "unsubscribe") == 0
+			|| strcasecmp(r->element[0]->str, "punsubscribe") == 0) {
+		/* last reply for this channel, take the ID */
+		*prev = e->next;
+		cmd->ws_id = e->id;
+		cmd->ws_id_free = 1;
+		free(e->channel);
+		free(e);
+	} else {
+		cmd->ws_id = e->id;
+	}
+}
+
+/**
+ * WEBDIS.BATCH <delay_us> <size>: group pub/sub messages, see batch.c.
+ * This is handled by Webdis and not sent to Redis.
+ */
+static void
+ws_batch_command(struct ws_client *ws, struct cmd *cmd, formatting_fun fun_reply, ws_error_fun fun_error) {
 
+	redisReply ok;
+
+	if(cmd->count != 3 || batch_configure(cmd,
+			strtol(cmd->argv[1], NULL, 10), strtol(cmd->argv[2], NULL, 10)) != 0) {
+		ws_send_error(ws, cmd->ws_id, fun_error, 400, "Invalid batch parameters");
+		return;
+	}
+
+	memset(&ok, 0, sizeof(ok));
+	ok.type = REDIS_REPLY_STATUS;
+	ok.str = "OK";
+	ok.len = 2;
+	fun_reply(NULL, &ok, cmd);
+}
+
+/**
+ * Run a command from an envelope over the worker's connection pool.
+ * Takes ownership of the command and ID.
+ */
+static void
+ws_execute_pooled(struct ws_client *ws, struct cmd *cmd, char *id,
+		formatting_fun fun_reply, ws_error_fun fun_error) {
+
+	struct http_client *c = ws->http_client;
+
+	cmd->is_websocket = 1;
+	cmd->ws_id = id;
+	cmd->ws_id_free = 1;
+	cmd_setup(cmd, c);
+	cmd->database = c->s->cfg->database; /* the pool only has connections to this one */
+	ws_log_cmd(ws, cmd);
+
+	if(!acl_allow_command(cmd, c->s->cfg, c)) {
+		ws_send_error(ws, id, fun_error, 403, "Forbidden");
+		ws_log_unauthorized(ws);
+		cmd_free(cmd);
+		return;
+	}
+	if(internal_is_command(cmd)) {
+		internal_run(cmd, fun_reply);
+		return;
+	}
+	if(!(cmd->ac = (redisAsyncContext*)pool_get_context(c->w->pool))) {
+		ws_send_error(ws, id, fun_error, 503, "Service Unavailable");
+		cmd_free(cmd);
+		return;
+	}
+
+	/* detached if the client goes away before the reply */
+	LIST_INSERT_HEAD(&ws->pending, cmd, ws_entries);
+	cmd->ws_pending = 1;
+	cmd_send(cmd, fun_reply);
+}
+
+/**
+ * Run a command parsed from a message, on the client's own connection or
+ * over the pool if it came in an envelope. Takes ownership of the command and ID.
+ */
+static void
+ws_run(struct ws_client *ws, struct cmd *cmd, char *id,
+		formatting_fun fun_reply, ws_error_fun fun_error) {
+
+	struct http_client *c = ws->http_client;
+	int is_batch = cmd->count && cmd->argv_len[0] == 12
+		&& strncasecmp(cmd->argv[0], "WEBDIS.BATCH", 12) == 0;
+
+	cmd->is_websocket = 1;
+
+	/* only pub/sub needs the client's own connection */
+	if(id && !is_batch && !cmd_is_subscribe_args(cmd) && !cmd_is_unsubscribe_args(cmd)) {
+		ws_execute_pooled(ws, cmd, id, fun_reply, fun_error);
+		return;
+	}
+
+	if(ws->cmd != NULL && is_batch) {
+		/* applies to the persistent command, which keeps its own
+		   arguments: they are used to format pub/sub messages */
+		int saved_count = ws->cmd->count;
+		char **saved_argv = ws->cmd->argv;
+		size_t *saved_argv_len = ws->cmd->argv_len;
+		ws->cmd->count = cmd->count;
+		ws->cmd->argv = cmd->argv;
+		ws->cmd->argv_len = cmd->argv_len;
+
+		ws_log_cmd(ws, ws->cmd);
+		ws->cmd->ws_id = id;
+		ws_batch_command(ws, ws->cmd, fun_reply, fun_error);
+		ws->cmd->ws_id = NULL;
+
+		ws->cmd->count = saved_count;
+		ws->cmd->argv = saved_argv;
+		ws->cmd->argv_len = saved_argv_len;
+		cmd_free(cmd);
+		free(id);
+		return;
+	}
+
+	if(ws->cmd != NULL) {
+		/* This client already has its own connection to Redis
+		   from a previous command; use it from now on. */
+
+		/* free args for the previous cmd */
+		cmd_free_argv(ws->cmd);
+		/* copy args from what we just parsed to the persistent command */
+		ws->cmd->count = cmd->count;
+		ws->cmd->argv = cmd->argv;
+		ws->cmd->argv_len = cmd->argv_len;
+		ws->cmd->pub_sub_client = c; /* mark as persistent, otherwise the Redis context will be freed */
+
+		cmd->argv = NULL;
+		cmd->argv_len = NULL;
+		cmd->count = 0;
+		cmd_free(cmd);
+
+		cmd = ws->cmd; /* replace pointer since we're about to pass it to cmd_send */
+	} else {
+		/* copy client info into cmd. */
+		cmd_setup(cmd, c);
+
+		/* First WS command; use Redis context from WS client. */
+		cmd->ac = ws->ac;
+		ws->cmd = cmd;
+		cmd->pub_sub_client = c;
+	}
+
+	int is_subscribe = cmd_is_subscribe_args(cmd);
+	int is_unsubscribe = cmd_is_unsubscribe_args(cmd);
+
+	if(is_batch) {
+		ws_log_cmd(ws, cmd);
+		cmd->ws_id = id;
+		ws_batch_command(ws, cmd, fun_reply, fun_error);
+		cmd->ws_id = NULL;
+	} else if(!acl_allow_command(cmd, c->s->cfg, c)) { /* check that the client is able to run this command */
+		ws_send_error(ws, id, fun_error, 403, "Forbidden");
+		/* similar to HTTP: log command first and then rejection, both with "WS: " prefix */
+		ws_log_cmd(ws, cmd);
+		ws_log_unauthorized(ws);
+	} else if(ws->ran_subscribe && !is_subscribe && !is_unsubscribe) { /* disallow non-subscribe commands after a subscribe */
+		char error_msg[] = "Command not allowed after subscribe";
+		ws_frame_and_send_response(ws, WS_BINARY_FRAME, error_msg, sizeof(error_msg)-1);
+	} else { /* log and execute */
+		ws_log_cmd(ws, cmd);
+		if(id) {
+			ws_sub_ids_update(ws, cmd, id);
+		}
+		if(internal_is_command(cmd)) {
+			internal_run(cmd, fun_reply);
+		} else {
+			cmd_send(cmd, fun_reply);
+		}
+		ws->ran_subscribe = is_subscribe;
+	}
+
+	free(id);
+}
+
+/**
+ * Run the commands in a message from a raw client. The client's reader keeps
+ * a command that spans several messages until it is complete, and all the
+ * commands of a message are written to Redis together as a pipeline.
+ */
+static int
+ws_execute_raw(struct ws_client *ws, struct ws_msg *msg,
+		formatting_fun fun_reply, ws_error_fun fun_error) {
+
+	struct http_client *c = ws->http_client;
+	struct cmd *cmd;
+	int ret;
+
+	if(!ws->reader && !(ws->reader = redisReaderCreate())) {
+		return -1;
+	}
+	if(redisReaderFeed(ws->reader, msg->payload, msg->payload_sz) != REDIS_OK) {
+		return -1;
+	}
+
+	while((ret = raw_ws_next(c, ws->reader, &cmd)) == 1) {
+		ws_run(ws, cmd, NULL, fun_reply, fun_error);
+	}
+
+	/* an incomplete command is subject to the same limit as a request */
+	if(ret == 0 && ws->reader->len - ws->reader->pos > c->s->cfg->http_max_request_size) {
+		return -1;
+	}
+	return ret;
+}
+
+static int
+ws_execute(struct ws_client *ws, struct ws_msg *msg) {
+
+	struct http_client *c = ws->http_client;
+	struct cmd *cmd;
+	char *id = NULL;
+
+	metrics_add(METRICS_REQUESTS, 1);
+	if((c->path_sz == 1 && strncmp(c->path, "/", 1) == 0) ||
+	   strncmp(c->path, "/.json", 6) == 0) {
+
+		/* Parse websocket frame into a cmd object. */
+		if(ws_is_envelope(msg->payload, msg->payload_sz)) {
+			cmd = json_ws_extract_envelope(c, msg->payload, msg->payload_sz, &id);
+		} else {
+			cmd = json_ws_extract(c, msg->payload, msg->payload_sz);
+		}
+		if(cmd) {
+			ws_run(ws, cmd, id, json_reply, json_ws_error);
 			return 0;
 		}
+	} else if(strncmp(c->path, "/.raw", 5) == 0) {
+		return ws_execute_raw(ws, msg, raw_reply, raw_ws_error);
 	}
 
 	return -1;
@@ -360,25 +828,55 @@ ws_msg_new(enum ws_frame_type frame_type) {
 	return msg;
 }
 
-static int
-ws_msg_add(struct ws_msg *m, const char *p, size_t psz, const unsigned char *mask) {
+/**
+ * Copy `sz` bytes from `src` to `dst`, applying the 4-byte mask.
+ * `offset` is the position of `src` within the masked payload, so that
+ * a payload can be unmasked in several pieces. `dst` may be equal to `src`.
+ */
+void
+ws_unmask(char *dst, const char *src, size_t sz, const unsigned char *mask, size_t offset) {
 
-	/* add data to frame */
-	size_t i;
-	m->payload = realloc(m->payload, m->payload_sz + psz);
-	if(!m->payload) {
-		return -1;
+	unsigned char m[16];
+	uint64_t m64, w;
+	size_t i = 0;
+
+	if(sz < 8) { /* not worth preparing the wide mask */
+		for(; i < sz; ++i) {
+			dst[i] = (char)((unsigned char)src[i] ^ mask[(offset + i) & 3]);
+		}
+		return;
 	}
-	memcpy(m->payload + m->payload_sz, p, psz);
 
-	/* apply mask */
-	for(i = 0; i < psz && mask; ++i) {
-		m->payload[m->payload_sz + i] = (unsigned char)p[i] ^ mask[i%4];
+	/* mask rotated to start at `offset`, repeated to fill a vector */
+	for(i = 0; i < 4; ++i) {
+		m[i] = mask[(offset + i) & 3];
+	}
+	memcpy(m + 4, m, 4);
+	memcpy(m + 8, m, 8);
+	i = 0;
+
+#ifdef __SSE2__
+	if(sz >= 16) {
+		__m128i vm = _mm_loadu_si128((const __m128i *)m);
+		for(; i + 16 <= sz; i += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+			_mm_storeu_si128((__m128i *)(dst + i), _mm_xor_si128(v, vm));
+		}
 	}
+#endif
 
-	/* save new size */
-	m->payload_sz += psz;
-	return 0;
+	/* 8 bytes at a time; i is a multiple of 4 so the mask is still aligned */
+	memcpy(&m64, m, sizeof(m64));
+	for(; i + 8 <= sz; i += 8) {
+		memcpy(&w, src + i, sizeof(w));
+		w ^= m64;
+		memcpy(dst + i, &w, sizeof(w));
+	}
+
+	/* tail */
+	for(; i < sz; ++i) {
+		dst[i] = (char)((unsigned char)src[i] ^ m[i & 3]);
+	}
 }
 
 static void
@@ -388,116 +886,264 @@ ws_msg_free(struct ws_msg *m) {
 	free(m);
 }
 
-/* checks to see if we have a complete message */
+static void
+ws_protocol_error(struct ws_client *ws, const char *reason, size_t reason_sz) {
+
+	ws->close_after_events = 1;
+	ws_frame_and_send_response(ws, WS_CONNECTION_CLOSE, reason, reason_sz);
+}
+
+/**
+ * Parse the header of the next frame, if we have all of it.
+ * Only the header bytes are copied out of the read buffer.
+ */
 static enum ws_state
-ws_peek_data(struct ws_client *ws, struct ws_msg **out_msg) {
+ws_read_frame_header(struct ws_client *ws) {
 
-	int has_mask;
+	unsigned char hdr[14]; /* 2 bytes + 8 bytes of length + 4 bytes of mask */
+	size_t sz = evbuffer_get_length(ws->rbuf), hdr_sz = 6;
 	uint64_t len;
-	const char *p;
-	char *frame;
-	unsigned char mask[4];
-	char fin_bit_set;
-	enum ws_frame_type frame_type;
-
-	/* parse frame and extract contents */
-	size_t sz = evbuffer_get_length(ws->rbuf);
+	struct ws_msg **target;
+	int fin, rsv, opcode;
+	size_t max_sz = ws->http_client->s->cfg->http_max_request_size;
+
 	if(sz < 2) {
 		return WS_READING; /* need more data */
 	}
-	/* copy into "frame" to process it */
-	frame = malloc(sz);
-	if(!frame) {
+	if(evbuffer_copyout(ws->rbuf, hdr, sz < sizeof(hdr) ? sz : sizeof(hdr)) < 2) {
 		return WS_ERROR;
 	}
-	int rem_ret = evbuffer_copyout(ws->rbuf, frame, sz); /* copy into frame but keep in rbuf */
-	if(rem_ret < 0) {
-		free(frame);
+
+	fin = hdr[0] & 0x80 ? 1 : 0;
+	rsv = hdr[0] & 0x70;
+	opcode = hdr[0] & 0x0F;	/* lower 4 bits of first byte */
+
+	/* RSV1 marks the first frame of a compressed message, if negotiated (RFC 7692, section 6) */
+	if((rsv & ~0x40) || (rsv && (!ws->pmd.enabled || (opcode & 0x08) || opcode == 0))) {
+		const char close_code_reason[] = "\x03\xea" "Unexpected reserved bits."; /* 1002 */
+		ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
 		return WS_ERROR;
 	}
 
-	fin_bit_set = frame[0] & 0x80 ? 1 : 0;
-	frame_type = frame[0] & 0x0F;	/* lower 4 bits of first byte */
-	has_mask = frame[1] & 0x80 ? 1:0;
-
-	if(!has_mask) {
+	if(!(hdr[1] & 0x80)) {
 		/* a client MUST mask all frames that it sends to the server (RFC6455, 5.1. Overview) */
-		ws->close_after_events = 1;
 		const char close_code_reason[] = "\x03\xeaReceived a frame without a mask from the client (violates RFC6455, 5.1. Overview)."; /* 0x03,0xEA = 1002 - protocol error */
-		ws_frame_and_send_response(ws, WS_CONNECTION_CLOSE, close_code_reason, sizeof(close_code_reason)-1);
-		free(frame);
+		ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
 		return WS_ERROR;
 	}
 
-	/* get payload length */
-	len = frame[1] & 0x7f;	/* remove leftmost bit */
-
-	/* checking that the copyout frame contains the minimum data needed to determine the true length and mask in next step */
-	size_t min_sz = 6; /* 2 bytes for flags and opcode + 4 bytes for mask */
+	/* determine header and payload size (RFC 6455, section 5.2) */
+	len = hdr[1] & 0x7f;	/* remove leftmost bit */
 	if(len == 126) {
-		min_sz += sizeof(uint16_t);
+		hdr_sz += sizeof(uint16_t);
 	} else if(len == 127) {
-		min_sz += sizeof(uint64_t);
+		hdr_sz += sizeof(uint64_t);
 	}
-	if(sz < min_sz) { /* not enough data */
-		free(frame);
+	if(sz < hdr_sz) { /* not enough data */
 		return WS_READING;
 	}
-
-	/* determine payload size (RFC 6455, section 5.2) */
-	if(len <= 125) { /* data starts right after the mask */
-		p = frame + 6;
-		memcpy(&mask, frame + 2, sizeof(mask));
-	} else if(len == 126) { /* size is stored in 16 bits after mask */
+	if(len == 126) { /* size is stored in 16 bits before the mask */
 		uint16_t sz16;
-		memcpy(&sz16, frame + 2, sizeof(uint16_t));
+		memcpy(&sz16, hdr + 2, sizeof(uint16_t));
 		len = ntohs(sz16);
-		p = frame + 6 + sizeof(uint16_t);
-		memcpy(&mask, frame + 4, sizeof(mask));
-	} else if(len == 127) { /* size is stored in 64 bits after mask */
-		uint64_t sz64 = *((uint64_t*)(frame+2));
+	} else if(len == 127) { /* size is stored in 64 bits before the mask */
+		uint64_t sz64;
+		memcpy(&sz64, hdr + 2, sizeof(uint64_t));
 		len = webdis_ntohll(sz64);
-		p = frame + 6 + sizeof(uint64_t);
-		memcpy(&mask, frame + 10, sizeof(mask));
+	}
+	memcpy(ws->frame.mask, hdr + hdr_sz - 4, 4);
+
+	/* control frames can be sent in the middle of a fragmented message */
+	if(opcode & 0x08) {
+		if(!fin || len > 125) {
+			const char close_code_reason[] = "\x03\xea" "Invalid control frame."; /* 1002 */
+			ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
+			return WS_ERROR;
+		}
+		target = &ws->frame.control;
+		*target = ws_msg_new(opcode);
+	} else if(opcode == 0) { /* continuation */
+		if(!ws->frame.msg) {
+			const char close_code_reason[] = "\x03\xea" "Unexpected continuation frame."; /* 1002 */
+			ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
+			return WS_ERROR;
+		}
+		target = &ws->frame.msg;
 	} else {
-		free(frame);
+		if(ws->frame.msg) {
+			const char close_code_reason[] = "\x03\xea" "Expected a continuation frame."; /* 1002 */
+			ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
+			return WS_ERROR;
+		}
+		target = &ws->frame.msg;
+		*target = ws_msg_new(opcode);
+		if(*target) {
+			(*target)->compressed = rsv ? 1 : 0;
+		}
+	}
+	if(!*target) {
 		return WS_ERROR;
 	}
 
-	/* we now have the masked data starting in p, and its length.  */
-	if(len > sz - (p - frame)) { /* not enough data */
-		free(frame);
-		return WS_READING;
+	/* refuse messages we wouldn't accept over HTTP */
+	if(len > max_sz || (*target)->payload_sz + len > max_sz) {
+		const char close_code_reason[] = "\x03\xf1" "Message too big."; /* 0x03,0xF1 = 1009 */
+		ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
+		return WS_ERROR;
 	}
 
-	int ev_copy = 0;
-	if(out_msg) { /* we're extracting the message */
-		struct ws_msg *msg = ws_msg_new(frame_type);
-		if(!msg) {
-			free(frame);
-			return WS_ERROR;
+	ws->frame.in_payload = 1;
+	ws->frame.fin = fin;
+	ws->frame.is_control = (opcode & 0x08) ? 1 : 0;
+	ws->frame.len = len;
+	ws->frame.remaining = len;
+
+	if(evbuffer_drain(ws->rbuf, hdr_sz) < 0) {
+		return WS_ERROR;
+	}
+	return WS_MSG_COMPLETE; /* header complete */
+}
+
+/**
+ * Make room for `sz` more bytes of payload as they arrive, doubling the
+ * allocation but never past `max`, the end of the current frame.
+ */
+static int
+ws_msg_reserve(struct ws_msg *msg, size_t sz, size_t max) {
+
+	size_t alloc;
+	char *payload;
+
+	if(msg->payload_sz + sz <= msg->payload_alloc) {
+		return 0;
+	}
+	alloc = msg->payload_alloc < 2048 ? 4096 : 2 * msg->payload_alloc;
+	if(alloc < msg->payload_sz + sz) {
+		alloc = msg->payload_sz + sz;
+	}
+	if(alloc > max) {
+		alloc = max;
+	}
+	if(!(payload = realloc(msg->payload, alloc))) {
+		return -1;
+	}
+	msg->payload = payload;
+	msg->payload_alloc = alloc;
+	return 0;
+}
+
+/**
+ * Replace the payload of a compressed message with its decompressed form.
+ */
+static int
+ws_inflate_msg(struct ws_client *ws, struct ws_msg *msg) {
+
+	size_t max_sz = ws->http_client->s->cfg->http_max_request_size, out_sz;
+	char *payload, *out;
+
+	if(!ws->pmd.inflate && !(ws->pmd.inflate = decompress_stream_new_raw(15))) {
+		return -1;
+	}
+
+	/* restore the empty block removed by the client (RFC 7692, section 7.2.2) */
+	payload = realloc(msg->payload, msg->payload_sz + 4);
+	if(!payload) {
+		return -1;
+	}
+	memcpy(payload + msg->payload_sz, "\x00\x00\xff\xff", 4);
+	msg->payload = payload;
+	msg->payload_alloc = msg->payload_sz + 4;
+
+	out = decompress_stream_chunk(ws->pmd.inflate, payload, msg->payload_sz + 4, max_sz, &out_sz);
+	if(ws->pmd.client_no_context_takeover) {
+		decompress_stream_reset(ws->pmd.inflate);
+	}
+	if(!out) {
+		if(out_sz > max_sz) {
+			const char close_code_reason[] = "\x03\xf1" "Message too big."; /* 1009 */
+			ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
+		} else {
+			const char close_code_reason[] = "\x03\xef" "Invalid compressed data."; /* 0x03,0xEF = 1007 */
+			ws_protocol_error(ws, close_code_reason, sizeof(close_code_reason)-1);
 		}
-		*out_msg = msg; /* attach for it to be freed by caller */
+		return -1;
+	}
 
-		/* create new ws_msg object holding what we read */
-		int add_ret = ws_msg_add(msg, p, len, mask);
-		if(add_ret < 0) {
-			free(frame);
+	free(msg->payload);
+	msg->payload = out;
+	msg->payload_sz = out_sz;
+	msg->payload_alloc = out_sz;
+	msg->compressed = 0;
+	return 0;
+}
+
+/**
+ * Read the next complete message from the read buffer, if there is one.
+ * The parser state is kept in ws->frame between calls, so each byte is only
+ * looked at once however the data is split across reads. Payloads are
+ * unmasked straight from the buffer chains into the message.
+ */
+static enum ws_state
+ws_read_msg(struct ws_client *ws, struct ws_msg **out_msg) {
+
+	*out_msg = NULL;
+
+	while(1) {
+		struct ws_msg *target;
+		size_t avail, n;
+
+		if(!ws->frame.in_payload) {
+			enum ws_state state = ws_read_frame_header(ws);
+			if(state != WS_MSG_COMPLETE) {
+				return state;
+			}
+		}
+
+		/* copy as much of the payload as we have */
+		target = ws->frame.is_control ? ws->frame.control : ws->frame.msg;
+		avail = evbuffer_get_length(ws->rbuf);
+		n = ws->frame.remaining < avail ? (size_t)ws->frame.remaining : avail;
+		if(n && ws_msg_reserve(target, n, target->payload_sz + (size_t)ws->frame.remaining) != 0) {
 			return WS_ERROR;
 		}
+		while(n) { /* one buffer chain at a time */
+			struct evbuffer_iovec vec;
+			size_t chunk;
 
-		size_t processed_sz = len + (p - frame); /* length of data + header bytes between frame start and payload */
-		msg->total_sz += processed_sz;
-		ev_copy = evbuffer_drain(ws->rbuf, processed_sz); /* remove processed data from evbuffer */
-	}
-	free(frame);
+			if(evbuffer_peek(ws->rbuf, n, NULL, &vec, 1) < 1) {
+				return WS_ERROR;
+			}
+			chunk = vec.iov_len < n ? vec.iov_len : n;
+			ws_unmask(target->payload + target->payload_sz, vec.iov_base, chunk,
+				ws->frame.mask, (size_t)(ws->frame.len - ws->frame.remaining));
+			target->payload_sz += chunk;
+			ws->frame.remaining -= chunk;
+			n -= chunk;
+			if(evbuffer_drain(ws->rbuf, chunk) < 0) {
+				return WS_ERROR;
+			}
+		}
+		if(ws->frame.remaining) {
+			return WS_READING; /* need more data */
+		}
 
-	if(ev_copy < 0) {
-		return WS_ERROR;
-	} else if(fin_bit_set) {
-		return WS_MSG_COMPLETE;
-	} else {
-		return WS_READING;	/* need more data */
+		/* end of frame */
+		ws->frame.in_payload = 0;
+		if(ws->frame.is_control) {
+			*out_msg = ws->frame.control;
+			ws->frame.control = NULL;
+			return WS_MSG_COMPLETE;
+		} else if(ws->frame.fin) {
+			*out_msg = ws->frame.msg;
+			ws->frame.msg = NULL;
+			if((*out_msg)->compressed && ws_inflate_msg(ws, *out_msg) != 0) {
+				ws_msg_free(*out_msg);
+				*out_msg = NULL;
+				return WS_ERROR;
+			}
+			return WS_MSG_COMPLETE;
+		}
+		/* otherwise, wait for the next fragment */
 	}
 }
 
@@ -509,14 +1155,11 @@ enum ws_state
 ws_process_read_data(struct ws_client *ws, unsigned int *out_processed) {
 
 	enum ws_state state;
+	struct ws_msg *msg = NULL;
 	if(out_processed) *out_processed = 0;
 
-	state = ws_peek_data(ws, NULL); /* check for complete message */
-
-	while(state == WS_MSG_COMPLETE) {
+	while((state = ws_read_msg(ws, &msg)) == WS_MSG_COMPLETE) {
 		int ret = 0;
-		struct ws_msg *msg = NULL;
-		ws_peek_data(ws, &msg); /* extract message */
 
 		if(msg && (msg->type == WS_TEXT_FRAME || msg->type == WS_BINARY_FRAME)) {
 			ret = ws_execute(ws, msg);
@@ -541,14 +1184,134 @@ ws_process_read_data(struct ws_client *ws, unsigned int *out_processed) {
 			slog(ws->http_client->s, WEBDIS_DEBUG, "ws_process_read_data: ws_execute failed", 0);
 			return WS_ERROR;
 		}
-		state = ws_peek_data(ws, NULL);
 	}
 	return state;
 }
 
+/**
+ * Apply the backpressure policy if the client isn't reading its data fast enough.
+ * Returns 1 if the frame should be discarded.
+ */
+static int
+ws_output_overflow(struct ws_client *ws, enum ws_frame_type frame_type, size_t sz) {
+
+	struct worker *w = ws->http_client->w;
+	struct conf *cfg = w->s->cfg;
+	size_t high = cfg->ws_backpressure.high_watermark;
+	size_t buffered = evbuffer_get_length(ws->wbuf);
+
+	if(high == 0 || buffered + sz <= high) {
+		return 0;
+	}
+
+	switch(cfg->ws_backpressure.policy) {
+		case WS_OVERFLOW_PAUSE:
+			/* queue this frame but stop reading from Redis; hiredis re-enables
+			 * reads when we send a command, so this is done for every frame */
+			if(ws->ac) {
+				ws->ac->ev.delRead(ws->ac->ev.data);
+			}
+			if(!ws->redis_paused) {
+				ws->redis_paused = 1;
+				w->ws_overflow.paused++;
+				slog(w->s, WEBDIS_DEBUG, "WS client over its high watermark, pausing Redis reads", 0);
+			}
+			return 0;
+
+		case WS_OVERFLOW_DROP:
+			if(buffered < high || (frame_type != WS_TEXT_FRAME && frame_type != WS_BINARY_FRAME)) {
+				return 0; /* always queue control frames */
+			}
+			w->ws_overflow.dropped++;
+			return 1;
+
+		case WS_OVERFLOW_DISCONNECT:
+			if(buffered < high) {
+				return 0;
+			}
+			if(!ws->close_after_events) {
+				w->ws_overflow.disconnected++;
+				slog(w->s, WEBDIS_WARNING, "WS client over its high watermark, disconnecting", 0);
+				if(ws->ac) {
+					ws->ac->ev.delRead(ws->ac->ev.data);
+				}
+				/* discard everything, frames may have been partially written
+				 * so we close without sending a close frame */
+				ws->close_after_events = 1;
+				evbuffer_drain(ws->wbuf, buffered);
+				ws_schedule_write(ws);
+			}
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * Compress a message with the client's deflate stream, returns NULL on failure.
+ */
+static char *
+ws_deflate_msg(struct ws_client *ws, const char *p, size_t sz, size_t *out_sz) {
+
+	struct conf *cfg = ws->http_client->s->cfg;
+	char *out;
+
+	if(!ws->pmd.deflate) {
+		ws->pmd.deflate = compress_stream_new_raw(cfg->ws_deflate.level, ws->pmd.server_max_window_bits);
+		if(!ws->pmd.deflate) {
+			return NULL;
+		}
+	}
+
+	out = compress_stream_chunk(ws->pmd.deflate, p, sz, out_sz);
+	if(!out) {
+		/* the stream may have consumed part of the message, start over
+		 * with an empty window which the client can always decode */
+		compress_stream_free(ws->pmd.deflate);
+		ws->pmd.deflate = NULL;
+		return NULL;
+	}
+	if(ws->pmd.server_no_context_takeover) {
+		compress_stream_reset(ws->pmd.deflate);
+	}
+
+	/* the flush ends with an empty block that the client adds back (RFC 7692, section 7.2.1) */
+	if(*out_sz >= 4) {
+		*out_sz -= 4;
+	}
+	return out;
+}
+
 int
 ws_frame_and_send_response(struct ws_client *ws, enum ws_frame_type frame_type, const char *p, size_t sz) {
 
+	char *zp = NULL;
+	size_t zsz;
+	int ret, rsv = 0;
+
+	if(ws_output_overflow(ws, frame_type, sz)) {
+		return 0;
+	}
+
+	/* compress data frames if permessage-deflate was negotiated */
+	if(ws->pmd.enabled && (frame_type == WS_TEXT_FRAME || frame_type == WS_BINARY_FRAME)
+			&& sz >= ws->http_client->s->cfg->ws_deflate.min_size
+			&& (zp = ws_deflate_msg(ws, p, sz, &zsz))) {
+		p = zp;
+		sz = zsz;
+		rsv = 0x40; /* RSV1 */
+	}
+
+	ret = ws_send_frame(ws, 0x80 | rsv | frame_type, p, sz);
+	free(zp);
+	return ret;
+}
+
+/**
+ * Build a frame by prepending a header to the payload.
+ */
+static char *
+ws_frame_build(unsigned char first_byte, const char *p, size_t sz, size_t *out_sz) {
+
 	/* we can have as much as 14 bytes in the header:
 	 *   1 byte for 4 flag bits + 4 frame type bits
 	 *   1 byte for the payload length indicator
@@ -556,9 +1319,8 @@ ws_frame_and_send_response(struct ws_client *ws, enum ws_frame_type frame_type,
 	 *   4 bytes for the masking key (if present)
 	 */
 	char *frame = malloc(sz + 14); /* create frame by prepending header */
-	size_t frame_sz = 0;
 	if(frame == NULL)
-		return -1;
+		return NULL;
 
 	/*
       The length of the "Payload data", in bytes: if 0-125, that is the
@@ -567,26 +1329,45 @@ ws_frame_and_send_response(struct ws_client *ws, enum ws_frame_type frame_type,
       following 8 bytes interpreted as a 64-bit unsigned integer (the
       most significant bit MUST be 0) are the payload length.
 	  */
-	frame[0] = 0x80 | frame_type; /* frame type + EOM bit */
+	frame[0] = first_byte; /* frame type + EOM bit + RSV bits */
 	if(sz <= 125) {
 		frame[1] = sz;
 		memcpy(frame + 2, p, sz);
-		frame_sz = sz + 2;
-	} else if(sz <= 65536) {
+		*out_sz = sz + 2;
+	} else if(sz <= 65535) {
 		uint16_t sz16 = htons(sz);
 		frame[1] = 126;
 		memcpy(frame + 2, &sz16, 2);
 		memcpy(frame + 4, p, sz);
-		frame_sz = sz + 4;
-	} else { /* sz > 65536 */
+		*out_sz = sz + 4;
+	} else { /* sz > 65535 */
 		uint64_t sz_be = webdis_htonll(sz); /* big endian */
 		char sz64[8];
 		memcpy(sz64, &sz_be, 8);
 		frame[1] = 127;
 		memcpy(frame + 2, sz64, 8);
 		memcpy(frame + 10, p, sz);
-		frame_sz = sz + 10;
+		*out_sz = sz + 10;
 	}
+	return frame;
+}
+
+/**
+ * Complete frame for a payload, e.g. to be shared between clients.
+ */
+char *
+ws_frame_new(enum ws_frame_type frame_type, const char *p, size_t sz, size_t *out_sz) {
+
+	return ws_frame_build(0x80 | frame_type, p, sz, out_sz);
+}
+
+static int
+ws_send_frame(struct ws_client *ws, unsigned char first_byte, const char *p, size_t sz) {
+
+	size_t frame_sz = 0;
+	char *frame = ws_frame_build(first_byte, p, sz, &frame_sz);
+	if(frame == NULL)
+		return -1;
 
 	/* mark as keep alive, otherwise we'll close the connection after the first reply */
 	int add_ret = evbuffer_add(ws->wbuf, frame, frame_sz);
@@ -600,6 +1381,22 @@ ws_frame_and_send_response(struct ws_client *ws, enum ws_frame_type frame_type,
 	return ws_schedule_write(ws);
 }
 
+/**
+ * Queue a complete data frame shared with other clients, without copying it.
+ */
+int
+ws_send_shared(struct ws_client *ws, struct fanout_buf *frame) {
+
+	if(ws_output_overflow(ws, WS_BINARY_FRAME, frame->sz)) {
+		return 0;
+	}
+	if(fanout_buf_add(ws->wbuf, frame) < 0) {
+		slog(ws->http_client->w->s, WEBDIS_ERROR, "Failed response allocation in ws_send_shared", 0);
+		return -1;
+	}
+	return ws_schedule_write(ws);
+}
+
 void
 ws_close_if_able(struct ws_client *ws) {
 
@@ -620,6 +1417,9 @@ ws_can_read(int fd, short event, void *p) {
 	/* read pending data */
 	ws->scheduled_read = 0;
 	ret = evbuffer_read(ws->rbuf, fd, 4096);
+	if(ret > 0) {
+		metrics_add(METRICS_BYTES_IN, (uint64_t)ret);
+	}
 
 	if(ret <= 0 || ws->close_after_events) {
 		ws_close_if_able(ws); /* will close the socket once all events have triggered */
@@ -638,18 +1438,40 @@ static void
 ws_can_write(int fd, short event, void *p) {
 
 	int ret;
+	size_t remaining;
 	struct ws_client *ws = p;
 	(void)event;
 
 	ws->scheduled_write = 0;
 
 	/* send pending data */
-	ret = evbuffer_write_atmost(ws->wbuf, fd, 4096);
+	ret = evbuffer_write_atmost(ws->wbuf, fd, ws->write_sz);
+	if(ret > 0) {
+		metrics_add(METRICS_BYTES_OUT, (uint64_t)ret);
+	}
+	remaining = evbuffer_get_length(ws->wbuf);
+	TRACE_WS_WRITE(fd, ret, remaining);
+
+	/* write more at a time while the socket keeps up, less when it doesn't */
+	if(ret > 0 && (size_t)ret == ws->write_sz) {
+		ws->write_sz = MIN(ws->write_sz * 2, WS_WRITE_MAX_SZ);
+	} else if(ret > 0 && remaining > 0) {
+		ws->write_sz = MAX(ws->write_sz / 2, WS_WRITE_MIN_SZ);
+	}
+
+	/* resume reading from Redis once enough has been sent out */
+	if(ws->redis_paused && remaining <= ws->http_client->w->s->cfg->ws_backpressure.low_watermark) {
+		ws->redis_paused = 0;
+		ws->http_client->w->ws_overflow.resumed++;
+		if(ws->ac && !ws->close_after_events) {
+			ws->ac->ev.addRead(ws->ac->ev.data);
+		}
+	}
 
 	if(ret <= 0) {
 		ws_close_if_able(ws); /* will close the socket once all events have triggered */
 	} else {
-		if(evbuffer_get_length(ws->wbuf) > 0) { /* more data to send */
+		if(remaining > 0) { /* more data to send */
 			ws_schedule_write(ws);
 		} else if(ws->close_after_events) { /* we're done! */
 			ws_close_if_able(ws);
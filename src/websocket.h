@@ -3,11 +3,17 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <sys/queue.h>
 #include <event.h>
 #include <hiredis/async.h>
 
 struct http_client;
 struct cmd;
+struct compress_stream;
+struct fanout_buf;
+struct decompress_stream;
+struct redisReply;
+struct redisReader;
 
 enum ws_state {
 	WS_ERROR,
@@ -26,7 +32,16 @@ struct ws_msg {
 	enum ws_frame_type type;
 	char *payload;
 	size_t payload_sz;
-	size_t total_sz;
+	size_t payload_alloc;
+	int compressed; /* RSV1 was set on the first frame (permessage-deflate) */
+};
+
+/* request ID given with a (un)subscribe command in an envelope, for a channel or pattern */
+struct ws_sub_id {
+	char *channel;
+	size_t channel_sz;
+	char *id;
+	struct ws_sub_id *next;
 };
 
 struct ws_client {
@@ -41,6 +56,37 @@ struct ws_client {
 	   buffered data and read what we planned to read */
 	int close_after_events;
 	int ran_subscribe; /* set if we've run a (p)subscribe command */
+	struct redisReader *reader; /* raw clients: commands read so far, kept across messages */
+
+	/* requests sent in an envelope with an ID */
+	LIST_HEAD(, cmd) pending; /* commands sent over the pool, waiting for a reply */
+	struct ws_sub_id *sub_ids; /* IDs to add to pub/sub messages */
+
+	/* output flow control */
+	size_t write_sz; /* bytes to try writing in the next callback, grows while the socket keeps up */
+	int redis_paused; /* set while we've stopped reading from Redis because wbuf is full */
+
+	/* permessage-deflate parameters, if negotiated in the handshake */
+	struct {
+		int enabled;
+		int server_max_window_bits;
+		int server_no_context_takeover;
+		int client_no_context_takeover;
+		struct compress_stream *deflate;     /* created on the first compressed message */
+		struct decompress_stream *inflate;   /* same, for messages from the client */
+	} pmd;
+
+	/* incremental frame parser, kept across reads */
+	struct {
+		int in_payload; /* set once the current frame header is parsed */
+		int fin;
+		int is_control;
+		unsigned char mask[4];
+		uint64_t len; /* payload size of the current frame */
+		uint64_t remaining; /* bytes of payload still to read */
+		struct ws_msg *msg; /* data message, possibly over several frames */
+		struct ws_msg *control; /* control frame, can arrive between fragments */
+	} frame;
 };
 
 struct ws_client *
@@ -58,7 +104,22 @@ ws_process_read_data(struct ws_client *ws, unsigned int *out_processed);
 int
 ws_frame_and_send_response(struct ws_client *ws, enum ws_frame_type type, const char *p, size_t sz);
 
+char *
+ws_frame_new(enum ws_frame_type frame_type, const char *p, size_t sz, size_t *out_sz);
+
+int
+ws_send_shared(struct ws_client *ws, struct fanout_buf *frame);
+
+int
+ws_send_reply(struct ws_client *ws, const char *id, const char *p, size_t sz);
+
+void
+ws_envelope_tag(struct cmd *cmd, const struct redisReply *r);
+
 void
 ws_close_if_able(struct ws_client *ws);
 
+void
+ws_unmask(char *dst, const char *src, size_t sz, const unsigned char *mask, size_t offset);
+
 #endif
@@ -7,6 +7,11 @@
 #include "websocket.h"
 #include "conf.h"
 #include "server.h"
+#include "offload.h"
+#include "fanout.h"
+#include "metrics.h"
+#include "slowlog.h"
+#include "stall.h"
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -26,10 +31,36 @@ worker_new(struct server *s) {
 	/* setup communication link */
 	ret = pipe(w->link);
 	(void)ret;
+	ret = pipe(w->offload_link);
+	(void)ret;
+	ret = pipe(w->reload_link);
+	(void)ret;
+	w->cfg = s->cfg;
+	w->cfg_gen = s->cfg_gen;
 
 	/* Redis connection pool */
 	w->pool = pool_new(w, s->cfg->pool_size_per_thread);
 
+	/* shared encoding of pub/sub messages */
+	w->fanout = fanout_new();
+
+	/* logging off the event loop */
+	w->log_ring = slog_ring_new(s, &s->log.fd, SLOG_LINE_MAX_LEN);
+	if(s->cfg->access_log) {
+		w->access_ring = slog_ring_new(s, &s->log.access_fd, SLOG_ACCESS_LINE_MAX_LEN);
+	}
+
+	/* counters and latencies */
+	if(s->cfg->metrics.enabled) {
+		w->metrics = metrics_new();
+	}
+	w->slowlog = slowlog_new(s->cfg->slowlog.max_len);
+	w->stall = stall_new(w);
+
+	/* HTTP subscribers */
+	pthread_mutex_init(&w->streams_lock, NULL);
+	LIST_INIT(&w->streams);
+
 	return w;
 
 }
@@ -106,6 +137,9 @@ worker_can_read(int fd, short event, void *p) {
 	if(c->broken) { /* terminate client */
 		if(c->is_websocket) { /* only close for WS since HTTP might use keep-alive */
 			close(c->fd);
+		} else if(c->last_cmd) { /* still in flight, its reply will go to cmd->fd */
+			c->last_cmd->http_client = NULL;
+			c->last_cmd = NULL;
 		}
 		http_client_free(c);
 	} else { /* start monitoring input again */
@@ -141,12 +175,41 @@ worker_on_new_client(int pipefd, short event, void *ptr) {
 	int ret = read(pipefd, &addr, sizeof(addr));
 	if(ret == sizeof(addr)) {
 		c = (struct http_client*)addr;
+		metrics_add(METRICS_CONNECTIONS_OPENED, 1);
 
 		/* monitor client for input */
 		worker_monitor_input(c);
 	}
 }
 
+/**
+ * Called when a new configuration has been published. The previous one is
+ * kept by the main thread until all workers have switched to the new one.
+ */
+static void
+worker_on_reload(int pipefd, short event, void *ptr) {
+
+	struct worker *w = ptr;
+	struct conf *cfg;
+	unsigned long gen;
+	char buf[64];
+	int ret;
+
+	(void)event;
+
+	ret = read(pipefd, buf, sizeof(buf)); /* several reloads are handled at once */
+	(void)ret;
+
+	/* the configuration is published before its generation */
+	gen = __atomic_load_n(&w->s->cfg_gen, __ATOMIC_ACQUIRE);
+	cfg = __atomic_load_n(&w->s->cfg, __ATOMIC_ACQUIRE);
+	if(cfg != w->cfg) {
+		pool_reconfigure(w->pool, w->cfg, cfg);
+		w->cfg = cfg;
+	}
+	__atomic_store_n(&w->cfg_gen, gen, __ATOMIC_RELEASE);
+}
+
 static void
 worker_pool_connect(struct worker *w) {
 
@@ -162,7 +225,10 @@ static void*
 worker_main(void *p) {
 
 	struct worker *w = p;
-	struct event ev;
+	struct event ev, ev_offload, ev_reload;
+
+	slog_ring_bind(w->log_ring, w->access_ring);
+	metrics_bind(w->metrics);
 
 	/* setup libevent */
 	w->base = event_base_new();
@@ -172,6 +238,19 @@ worker_main(void *p) {
 	event_base_set(w->base, &ev);
 	event_add(&ev, NULL);
 
+	/* monitor replies coming back from the offload threads */
+	event_set(&ev_offload, w->offload_link[0], EV_READ | EV_PERSIST, offload_on_complete, w);
+	event_base_set(w->base, &ev_offload);
+	event_add(&ev_offload, NULL);
+
+	/* pick up new configurations */
+	event_set(&ev_reload, w->reload_link[0], EV_READ | EV_PERSIST, worker_on_reload, w);
+	event_base_set(w->base, &ev_reload);
+	event_add(&ev_reload, NULL);
+
+	/* measure how late the loop runs its timers */
+	stall_start(w->stall);
+
 	/* connect to Redis */
 	worker_pool_connect(w);
 
@@ -199,6 +278,17 @@ worker_add_client(struct worker *w, struct http_client *c) {
 	(void)ret;
 }
 
+/**
+ * Tell a worker that a new configuration was published, from the main thread.
+ */
+void
+worker_reload(struct worker *w) {
+
+	char c = 0;
+	int ret = write(w->reload_link[1], &c, 1);
+	(void)ret;
+}
+
 /**
  * Called when a client has finished reading input and can create a cmd
  */
@@ -208,6 +298,8 @@ worker_process_client(struct http_client *c) {
 	/* check that the command can be executed */
 	struct worker *w = c->w;
 	cmd_response_t ret = CMD_PARAM_ERROR;
+
+	metrics_add(METRICS_REQUESTS, 1);
 	switch(c->parser.method) {
 		case HTTP_GET:
 			if(c->path_sz == 16 && memcmp(c->path, "/crossdomain.xml", 16) == 0) {
@@ -2,9 +2,17 @@
 #define WORKER_H
 
 #include <pthread.h>
+#include <sys/queue.h>
 
 struct http_client;
+struct conf;
 struct pool;
+struct fanout;
+struct http_stream;
+struct slog_ring;
+struct metrics;
+struct slowlog;
+struct stall;
 
 struct worker {
 
@@ -16,8 +24,49 @@ struct worker {
 	struct server *s;
 	int link[2];
 
+	/* replies formatted by the offload threads */
+	int offload_link[2];
+
+	/* configuration reloads, see server_reload */
+	int reload_link[2];
+	struct conf *cfg;      /* applied to this worker's pool */
+	unsigned long cfg_gen; /* generation of cfg, read by the main thread */
+
 	/* Redis connection pool */
 	struct pool *pool;
+
+	/* log lines queued for the log writer, NULL if logging is synchronous */
+	struct slog_ring *log_ring;
+	struct slog_ring *access_ring; /* only with an access log */
+
+	/* counters and latencies, NULL if disabled; read from any thread by WEBDIS.METRICS */
+	struct metrics *metrics;
+
+	/* slow requests, see slowlog.c */
+	struct slowlog *slowlog;
+
+	/* event loop watchdog, NULL if disabled */
+	struct stall *stall;
+
+	/* pub/sub messages encoded once for all subscribers */
+	struct fanout *fanout;
+
+	/* WebSocket clients that hit their high watermark, only updated from this thread */
+	struct {
+		unsigned long paused;       /* Redis reads paused */
+		unsigned long resumed;      /* Redis reads resumed */
+		unsigned long dropped;      /* messages discarded */
+		unsigned long disconnected; /* clients closed */
+	} ws_overflow;
+
+	/* HTTP subscribers, listed by WEBDIS.SUBSCRIBERS from any thread */
+	pthread_mutex_t streams_lock;
+	LIST_HEAD(, http_stream) streams;
+	struct { /* also protected by streams_lock */
+		unsigned long dropped_oldest; /* queued messages discarded */
+		unsigned long dropped_newest; /* new messages discarded */
+		unsigned long disconnected;   /* clients closed */
+	} sub_overflow;
 };
 
 struct worker *
@@ -29,6 +78,9 @@ worker_start(struct worker *w);
 void
 worker_add_client(struct worker *w, struct http_client *c);
 
+void
+worker_reload(struct worker *w);
+
 void
 worker_monitor_input(struct http_client *c);
 
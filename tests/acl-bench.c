@@ -0,0 +1,182 @@
+/* Micro-benchmark for ACL checks.
+ *
+ * Compares acl_allow_command, which uses the table built by acl_compile, with
+ * a linear scan of every rule's command lists, for a growing number of rules.
+ * The table is used with the client's memo of matching rules, as it is for
+ * keep-alive and WebSocket connections.
+ * Build with `make microbench` from the root directory.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "acl.h"
+#include "cmd.h"
+#include "conf.h"
+#include "http.h"
+#include "client.h"
+
+static double
+now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* previous implementation, with exact names, used as a reference */
+static int
+allow_linear(struct cmd *cmd, struct conf *cfg, struct http_client *client) {
+
+	const char *always_off[] = {"MULTI", "EXEC", "WATCH", "DISCARD", "SELECT"};
+	in_addr_t client_addr = ntohl(client->addr);
+	int authorized = 1;
+	unsigned int i;
+	struct acl *a;
+
+	for(i = 0; i < sizeof(always_off) / sizeof(always_off[0]); ++i) {
+		if(strcasecmp(always_off[i], cmd->argv[0]) == 0) {
+			return 0;
+		}
+	}
+	for(a = cfg->perms; a; a = a->next) {
+		if(!acl_match_client(a, client_get_header(client, "Authorization"), client_addr)) continue;
+		for(i = 0; i < a->enabled.count; ++i) {
+			if(strcasecmp(a->enabled.commands[i], cmd->argv[0]) == 0 || strcmp(a->enabled.commands[i], "*") == 0) {
+				authorized = 1;
+			}
+		}
+		for(i = 0; i < a->disabled.count; ++i) {
+			if(strcasecmp(a->disabled.commands[i], cmd->argv[0]) == 0 || strcmp(a->disabled.commands[i], "*") == 0) {
+				authorized = 0;
+			}
+		}
+	}
+	return authorized;
+}
+
+static void
+add_names(struct acl_commands *ac, unsigned int count, ...) {
+
+	va_list ap;
+	unsigned int i;
+
+	ac->count = count;
+	ac->commands = calloc(count, sizeof(char *));
+	va_start(ap, count);
+	for(i = 0; i < count; ++i) {
+		ac->commands[i] = strdup(va_arg(ap, const char *));
+	}
+	va_end(ap);
+}
+
+/* rules with a mix of subnets, credentials, and command names */
+static struct acl *
+make_rules(unsigned int n) {
+
+	struct acl *head = NULL, **tail = &head;
+	unsigned int i;
+
+	for(i = 0; i < n; ++i) {
+		struct acl *a = calloc(1, sizeof(struct acl));
+		char own[16], next[16];
+
+		snprintf(own, sizeof(own), "CMD%u", i);
+		snprintf(next, sizeof(next), "CMD%u", i + 1);
+		if(i % 3 == 0) {
+			a->cidr.enabled = 1;
+			a->cidr.mask = 0xffff0000;
+			a->cidr.subnet = ((10u << 24) | ((i % 4) << 16)) & a->cidr.mask;
+		}
+		if(i % 5 == 1) {
+			a->http_basic_auth = strdup("dXNlcjpwYXNzd29yZA==");
+		}
+		if(i % 50 == 49) {
+			add_names(&a->enabled, 1, "PING");
+			add_names(&a->disabled, 1, "*");
+		} else {
+			add_names(&a->enabled, 2, own, "GET");
+			add_names(&a->disabled, 3, next, "DEBUG", "GETSET");
+		}
+		*tail = a;
+		tail = &a->next;
+	}
+	return head;
+}
+
+static double
+run(int (*fun)(struct cmd *, struct conf *, struct http_client *),
+		struct cmd *cmd, struct conf *cfg, struct http_client *client, double duration) {
+
+	long n = 0;
+	double start = now_sec(), elapsed;
+	volatile int sink = 0;
+
+	do {
+		int i;
+		for(i = 0; i < 1000; ++i) {
+			sink += fun(cmd, cfg, client);
+		}
+		n += 1000;
+		elapsed = now_sec() - start;
+	} while(elapsed < duration);
+
+	(void)sink;
+	return n / elapsed;
+}
+
+int
+main(int argc, char *argv[]) {
+
+	double duration = argc > 1 ? atof(argv[1]) : 0.2;
+	unsigned int rule_counts[] = {1, 10, 100, 500};
+	unsigned int i, j;
+	int ret = EXIT_SUCCESS;
+	struct http_client client;
+
+	memset(&client, 0, sizeof(client));
+	client.addr = inet_addr("10.1.2.3");
+
+	printf("%6s %-10s %16s %16s %8s\n", "rules", "command", "linear (cmd/s)", "table (cmd/s)", "speedup");
+	for(i = 0; i < sizeof(rule_counts) / sizeof(rule_counts[0]); ++i) {
+		struct conf cfg;
+		char mid[16];
+		const char *names[] = {"GET", "GETSET", mid, "HGETALL", "DEBUG", "exec"};
+
+		memset(&cfg, 0, sizeof(cfg));
+		cfg.perms = make_rules(rule_counts[i]);
+		cfg.acl = acl_compile(cfg.perms);
+		snprintf(mid, sizeof(mid), "CMD%u", rule_counts[i] / 2);
+
+		for(j = 0; j < sizeof(names) / sizeof(names[0]); ++j) {
+			char *cmd_argv[1];
+			size_t cmd_argv_len[1];
+			struct cmd cmd;
+			double linear_rate, table_rate;
+
+			memset(&cmd, 0, sizeof(cmd));
+			cmd_argv[0] = (char *)names[j];
+			cmd_argv_len[0] = strlen(names[j]);
+			cmd.count = 1;
+			cmd.argv = cmd_argv;
+			cmd.argv_len = cmd_argv_len;
+
+			if(allow_linear(&cmd, &cfg, &client) != acl_allow_command(&cmd, &cfg, &client)) {
+				fprintf(stderr, "Mismatch for %s with %u rules\n", names[j], rule_counts[i]);
+				ret = EXIT_FAILURE;
+			}
+
+			linear_rate = run(allow_linear, &cmd, &cfg, &client, duration);
+			table_rate = run(acl_allow_command, &cmd, &cfg, &client, duration);
+			printf("%6u %-10s %16.0f %16.0f %7.2fx\n", rule_counts[i], names[j],
+				linear_rate, table_rate, table_rate / linear_rate);
+		}
+		acl_table_free(cfg.acl);
+	}
+	acl_memo_free(client.acl);
+
+	return ret;
+}
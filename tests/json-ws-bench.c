@@ -0,0 +1,114 @@
+/* Micro-benchmark for the parsing of JSON WebSocket commands.
+ *
+ * Compares json_ws_extract (single-pass parser for flat arrays) with the
+ * generic jansson-based parser, on a single core. Build with `make microbench`
+ * from the root directory.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "cmd.h"
+#include "formats/json.h"
+
+struct bench_case {
+	const char *name;
+	const char *frame;
+};
+
+static double
+now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+same_args(struct cmd *a, struct cmd *b) {
+	int i;
+	if(!a || !b) {
+		return a == b;
+	}
+	if(a->count != b->count) {
+		return 0;
+	}
+	for(i = 0; i < a->count; ++i) {
+		if(a->argv_len[i] != b->argv_len[i]
+				|| memcmp(a->argv[i], b->argv[i], a->argv_len[i]) != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static double
+run(struct cmd *(*fun)(struct http_client *, const char *, size_t),
+		const char *frame, double duration) {
+
+	size_t sz = strlen(frame);
+	long n = 0;
+	double start = now_sec(), elapsed;
+
+	do {
+		int i;
+		for(i = 0; i < 1000; ++i) {
+			cmd_free(fun(NULL, frame, sz));
+		}
+		n += 1000;
+		elapsed = now_sec() - start;
+	} while(elapsed < duration);
+
+	return n / elapsed;
+}
+
+int
+main(int argc, char *argv[]) {
+
+	unsigned int i;
+	double duration = argc > 1 ? atof(argv[1]) : 1.0;
+	char *large;
+	int ret = EXIT_SUCCESS;
+
+	struct bench_case cases[] = {
+		{"GET", "[\"GET\",\"key\"]"},
+		{"SET", "[\"SET\", \"user:1000:name\", \"Alice\"]"},
+		{"INCRBY (integer)", "[\"INCRBY\",\"counter\",42]"},
+		{"HSET (8 fields)", "[\"HSET\",\"h\",\"f1\",\"v1\",\"f2\",\"v2\",\"f3\",\"v3\",\"f4\",\"v4\","
+			"\"f5\",\"v5\",\"f6\",\"v6\",\"f7\",\"v7\",\"f8\",\"v8\"]"},
+		{"SET (escapes)", "[\"SET\",\"json\",\"{\\\"a\\\":[1,2,3],\\\"b\\\":\\\"x\\\\ny\\\"}\"]"},
+		{"SET (\\u escape, fallback)", "[\"SET\",\"k\",\"caf\\u00e9\"]"},
+		{NULL, NULL} /* large value, filled in below */
+	};
+	size_t case_count = sizeof(cases) / sizeof(cases[0]);
+
+	/* 16 KB value */
+	large = malloc(16 * 1024 + 32);
+	strcpy(large, "[\"SET\",\"big\",\"");
+	memset(large + strlen(large), 'x', 16 * 1024);
+	strcpy(large + 14 + 16 * 1024, "\"]");
+	cases[case_count - 1].name = "SET (16 KB value)";
+	cases[case_count - 1].frame = large;
+
+	printf("%-28s %16s %16s %8s\n", "frame", "flat (cmd/s)", "jansson (cmd/s)", "speedup");
+	for(i = 0; i < case_count; ++i) {
+		size_t sz = strlen(cases[i].frame);
+		struct cmd *fast = json_ws_extract(NULL, cases[i].frame, sz);
+		struct cmd *tree = json_ws_extract_tree(NULL, cases[i].frame, sz);
+		double fast_rate, tree_rate;
+
+		if(!same_args(fast, tree)) {
+			fprintf(stderr, "Mismatch between parsers for %s\n", cases[i].name);
+			ret = EXIT_FAILURE;
+		}
+		cmd_free(fast);
+		cmd_free(tree);
+
+		fast_rate = run(json_ws_extract, cases[i].frame, duration);
+		tree_rate = run(json_ws_extract_tree, cases[i].frame, duration);
+		printf("%-28s %16.0f %16.0f %7.2fx\n", cases[i].name, fast_rate, tree_rate, fast_rate / tree_rate);
+	}
+
+	free(large);
+	return ret;
+}
@@ -0,0 +1,139 @@
+#!/usr/bin/python3
+# Starts its own Webdis and reloads its configuration with SIGHUP.
+import json, os, signal, socket, subprocess, tempfile, threading, time, unittest, urllib.request
+
+REDIS_HOST = os.getenv('REDIS_HOST', '127.0.0.1')
+REDIS_PORT = int(os.getenv('REDIS_PORT', 6379))
+PORT = int(os.getenv('WEBDIS_RELOAD_PORT', 7380))
+WEBDIS = os.getenv('WEBDIS_BIN', os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'webdis'))
+
+class Proxy:
+	"""Forwards a local port to Redis, to give the test a second Redis address.
+	When held, its accept queue is full and connections to it stay in progress
+	until release() is called."""
+
+	def __init__(self, held=False):
+		self.connections = 0
+		self.opened = threading.Event()
+		self.s = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+		self.s.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+		self.s.bind(('127.0.0.1', 0))
+		self.s.listen(0 if held else 64)
+		self.port = self.s.getsockname()[1]
+		if not held:
+			self.opened.set()
+		threading.Thread(target=self.accept, daemon=True).start()
+
+	def release(self):
+		self.s.listen(64) # SYNs dropped so far are sent again within a second
+		self.opened.set()
+
+	def accept(self):
+		self.opened.wait()
+		while True:
+			try:
+				client, _ = self.s.accept()
+				upstream = socket.create_connection((REDIS_HOST, REDIS_PORT))
+			except OSError:
+				return
+			self.connections += 1
+			threading.Thread(target=self.pump, args=(client, upstream), daemon=True).start()
+			threading.Thread(target=self.pump, args=(upstream, client), daemon=True).start()
+
+	def pump(self, src, dst):
+		try:
+			while True:
+				data = src.recv(65536)
+				if not data:
+					break
+				dst.sendall(data)
+		except OSError:
+			pass
+		for s in (src, dst):
+			try:
+				s.shutdown(socket.SHUT_RDWR)
+			except OSError:
+				pass
+
+	def close(self):
+		self.s.close()
+
+class TestReload(unittest.TestCase):
+
+	def setUp(self):
+		self.dir = tempfile.TemporaryDirectory()
+		self.cfg_file = os.path.join(self.dir.name, 'webdis.json')
+		self.proxy = Proxy()
+		self.write_config(REDIS_PORT, 4)
+		self.webdis = subprocess.Popen([WEBDIS, self.cfg_file], stdout=subprocess.DEVNULL)
+		for _ in range(50):
+			try:
+				self.query('PING')
+				return
+			except OSError:
+				time.sleep(0.1)
+		self.fail('Webdis did not start')
+
+	def tearDown(self):
+		self.webdis.terminate()
+		self.webdis.wait()
+		self.proxy.close()
+		self.dir.cleanup()
+
+	def write_config(self, redis_port, pool_size):
+		with open(self.cfg_file, 'w') as f:
+			json.dump({'redis_host': REDIS_HOST, 'redis_port': redis_port,
+				'http_host': '127.0.0.1', 'http_port': PORT, 'threads': 2,
+				'pool_size': pool_size, 'database': 0, 'daemonize': False,
+				'verbosity': 3, 'logfile': os.path.join(self.dir.name, 'webdis.log')}, f)
+
+	def reload(self, redis_port, pool_size):
+		self.write_config(redis_port, pool_size)
+		self.webdis.send_signal(signal.SIGHUP)
+
+	def query(self, url):
+		f = urllib.request.urlopen('http://127.0.0.1:%d/%s' % (PORT, url), timeout=5)
+		return json.loads(f.read().decode('utf-8'))
+
+	def wait_for(self, url, expected):
+		for _ in range(50):
+			try:
+				if self.query(url) == expected:
+					return
+			except OSError:
+				pass
+			time.sleep(0.1)
+		self.fail('no reply to %s' % url)
+
+	def test_resize_and_move(self):
+		"the pool follows a new size and a new Redis port"
+		self.reload(self.proxy.port, 1)
+		self.wait_for('SET/reload/moved', {'SET': [True, 'OK']})
+		self.assertTrue(self.proxy.connections > 0)
+		self.reload(REDIS_PORT, 8)
+		self.wait_for('GET/reload', {'GET': 'moved'})
+		self.assertTrue(self.webdis.poll() is None)
+
+	def reload_while_connecting(self, redis_port):
+		held = Proxy(held=True)
+		self.reload(held.port, 8)
+		time.sleep(0.3) # connecting to the held proxy
+		self.reload(redis_port or held.port, 1)
+		time.sleep(0.3)
+		held.release()
+		time.sleep(2.5) # connections made after the reload
+		self.assertTrue(held.connections > 1)
+		self.assertTrue(self.webdis.poll() is None)
+		self.wait_for('PING', {'PING': [True, 'PONG']})
+		held.close()
+
+	def test_reload_while_connecting(self):
+		"connections to the previous Redis are dropped once established"
+		self.reload_while_connecting(REDIS_PORT)
+
+	def test_shrink_while_connecting(self):
+		"connections that no longer fit in the pool are dropped once established"
+		self.reload_while_connecting(None)
+
+if __name__ == '__main__':
+	unittest.main()
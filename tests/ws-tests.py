@@ -112,6 +112,22 @@ class TestRaw(TestWebdis):
         get_response = self.exec('GET', key)
         self.assertEqual(get_response, f"${len(value)}\r\n{value}\r\n")
 
+    def test_pipeline(self):
+        key = self.clean_key()
+        value = str(uuid.uuid4())
+        self.ws.send(self.serialize('SET', key, value) + self.serialize('GET', key) + self.serialize('PING'))
+        self.assertEqual(self.ws.recv(), "+OK\r\n")
+        self.assertEqual(self.ws.recv(), f"${len(value)}\r\n{value}\r\n")
+        self.assertEqual(self.ws.recv(), "+PONG\r\n")
+
+    def test_split_command(self):
+        key = self.clean_key()
+        value = str(uuid.uuid4())
+        buffer = self.serialize('SET', key, value)
+        self.ws.send(buffer[:10])
+        self.ws.send(buffer[10:])
+        self.assertEqual(self.ws.recv(), "+OK\r\n")
+
 
 class TestPubSub(unittest.TestCase):
     def setUp(self):
@@ -183,6 +199,104 @@ class TestPubSub(unittest.TestCase):
                                  f'In {channel}: expected at offset {i} was "{expected}", actual was: "{received_per_channel[channel][i]}"')
 
 
+class TestEnvelope(TestWebdis):
+    def format(self):
+        return 'json'
+
+    def serialize(self, cmd, *args):
+        return json.dumps([cmd] + list(args))
+
+    def deserialize(self, response):
+        return json.loads(response)
+
+    def exec_id(self, id, cmd, *args):
+        self.ws.send(json.dumps({'id': id, 'cmd': [cmd] + list(args)}))
+        return self.deserialize(self.ws.recv())
+
+    def test_tagged_reply(self):
+        key, value = self.clean_key(), str(uuid.uuid4())
+        self.assertEqual(self.exec_id(1, 'SET', key, value), {'id': 1, 'SET': [True, 'OK']})
+        self.assertEqual(self.exec_id('get-1', 'GET', key), {'id': 'get-1', 'GET': value})
+
+    def test_tagged_error(self):
+        key = self.clean_key()
+        self.assertEqual(self.exec_id('a', 'DEBUG', 'OBJECT', key),
+                         {'id': 'a', 'error': True, 'message': 'Forbidden', 'http_status': 403})
+        unknown = self.exec_id(2, 'UNKNOWN-COMMAND')
+        self.assertEqual(unknown['id'], 2)
+        self.assertEqual(unknown['UNKNOWN-COMMAND'][0], False)
+        self.assertEqual(self.exec('PING'), {'PING': [True, 'PONG']})  # still usable
+
+    def test_tagged_subscribe(self):
+        channel = str(uuid.uuid4())
+        self.assertEqual(self.exec_id('s1', 'SUBSCRIBE', channel),
+                         {'id': 's1', 'SUBSCRIBE': ['subscribe', channel, 1]})
+        publisher = connect('json')
+        publisher.send(self.serialize('PUBLISH', channel, 'hello'))
+        self.assertEqual(self.deserialize(publisher.recv()), {'PUBLISH': 1})
+        publisher.close()
+        self.assertEqual(self.deserialize(self.ws.recv()),
+                         {'id': 's1', 'SUBSCRIBE': ['message', channel, 'hello']})
+        # commands with an ID can still be sent while subscribed
+        self.assertEqual(self.exec_id(3, 'PING'), {'id': 3, 'PING': [True, 'PONG']})
+
+
+class TestBatch(TestWebdis):
+    count = 3
+
+    def format(self):
+        return 'json'
+
+    def serialize(self, cmd, *args):
+        return json.dumps([cmd] + list(args))
+
+    def deserialize(self, response):
+        return json.loads(response)
+
+    def subscribe_and_publish(self, batch_reply, subscribe_reply):
+        channel = str(uuid.uuid4())
+        self.assertEqual(self.exec('WEBDIS.BATCH', 2000000, self.count), batch_reply)
+        self.assertEqual(self.exec('SUBSCRIBE', channel), subscribe_reply(channel))
+        publisher = connect('json')
+        for i in range(self.count):
+            publisher.send(json.dumps(['PUBLISH', channel, f'message-{i}']))
+            self.assertEqual(json.loads(publisher.recv()), {'PUBLISH': 1})
+        publisher.close()
+        return channel
+
+    def test_grouped(self):
+        channel = self.subscribe_and_publish({'WEBDIS.BATCH': [True, 'OK']},
+                                             lambda channel: {'SUBSCRIBE': ['subscribe', channel, 1]})
+        self.assertEqual(self.deserialize(self.ws.recv()),
+                         [{'SUBSCRIBE': ['message', channel, f'message-{i}']} for i in range(self.count)])
+
+
+class TestBatchRaw(TestWebdis):
+    """Only JSON messages are grouped, others are still sent one per frame"""
+    count = TestBatch.count
+
+    def format(self):
+        return 'raw'
+
+    serialize = TestRaw.serialize
+    subscribe_and_publish = TestBatch.subscribe_and_publish
+
+    def deserialize(self, response):
+        return response
+
+    def exec(self, cmd, *args):
+        return super().exec(cmd, *[str(arg) for arg in args])
+
+    def test_not_grouped(self):
+        # integers in arrays are sent as bulk strings by the raw format
+        channel = self.subscribe_and_publish("+OK\r\n",
+                                             lambda channel: f"*3\r\n$9\r\nsubscribe\r\n${len(channel)}\r\n{channel}\r\n$1\r\n1\r\n")
+        for i in range(self.count):
+            message = f'message-{i}'
+            self.assertEqual(self.ws.recv(),
+                             f"*3\r\n$7\r\nmessage\r\n${len(channel)}\r\n{channel}\r\n${len(message)}\r\n{message}\r\n")
+
+
 class TestFrameSizes(TestWebdis):
     def format(self):
         return 'json'
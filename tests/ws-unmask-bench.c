@@ -0,0 +1,99 @@
+/* Micro-benchmark for the unmasking of WebSocket payloads.
+ *
+ * Compares ws_unmask with the byte-at-a-time loop it replaced, on a single
+ * core, for small and large frames. Build with `make microbench` from the
+ * root directory.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "websocket.h"
+
+static double
+now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* previous implementation, used as a reference */
+static void
+unmask_bytewise(char *dst, const char *src, size_t sz, const unsigned char *mask, size_t offset) {
+	size_t i;
+	for(i = 0; i < sz; ++i) {
+		dst[i] = (unsigned char)src[i] ^ mask[(offset + i) % 4];
+	}
+}
+
+static int
+check(const char *src, char *a, char *b, size_t sz, const unsigned char *mask) {
+	size_t offset, start;
+
+	/* all mask offsets and misaligned buffers */
+	for(offset = 0; offset < 4; ++offset) {
+		for(start = 0; start < 8 && start < sz; ++start) {
+			ws_unmask(a, src + start, sz - start, mask, offset);
+			unmask_bytewise(b, src + start, sz - start, mask, offset);
+			if(memcmp(a, b, sz - start) != 0) {
+				return 0;
+			}
+		}
+	}
+	return 1;
+}
+
+static double
+run(void (*fun)(char *, const char *, size_t, const unsigned char *, size_t),
+		char *dst, const char *src, size_t sz, const unsigned char *mask, double duration) {
+
+	long n = 0, batch = sz < 4096 ? 10000 : 10;
+	double start = now_sec(), elapsed;
+
+	do {
+		long i;
+		for(i = 0; i < batch; ++i) {
+			fun(dst, src, sz, mask, 0);
+		}
+		n += batch;
+		elapsed = now_sec() - start;
+	} while(elapsed < duration);
+
+	return (double)n * sz / elapsed / (1024 * 1024); /* MB/s */
+}
+
+int
+main(int argc, char *argv[]) {
+
+	double duration = argc > 1 ? atof(argv[1]) : 1.0;
+	size_t sizes[] = {7, 16, 125, 1024, 64 * 1024, 1024 * 1024};
+	const unsigned char mask[4] = {0x37, 0xfa, 0x21, 0x3d};
+	size_t max_sz = sizes[sizeof(sizes) / sizeof(sizes[0]) - 1];
+	char *src = malloc(max_sz), *a = malloc(max_sz), *b = malloc(max_sz);
+	unsigned int i;
+	int ret = EXIT_SUCCESS;
+
+	for(i = 0; i < max_sz; ++i) {
+		src[i] = (char)(i * 31 + 7);
+	}
+
+	printf("%-12s %16s %16s %8s\n", "frame size", "ws_unmask MB/s", "bytewise MB/s", "speedup");
+	for(i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+		double fast_rate, slow_rate;
+
+		if(!check(src, a, b, sizes[i], mask)) {
+			fprintf(stderr, "Mismatch with the reference for %zu bytes\n", sizes[i]);
+			ret = EXIT_FAILURE;
+		}
+
+		fast_rate = run(ws_unmask, a, src, sizes[i], mask, duration);
+		slow_rate = run(unmask_bytewise, b, src, sizes[i], mask, duration);
+		printf("%-12zu %16.0f %16.0f %7.2fx\n", sizes[i], fast_rate, slow_rate, fast_rate / slow_rate);
+	}
+
+	free(src);
+	free(a);
+	free(b);
+	return ret;
+}